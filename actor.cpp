@@ -0,0 +1,88 @@
+#include <atomic>
+#include <cassert>
+#include <cstdio>
+#include <functional>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "actor.hpp"
+#include "thread_pool.hpp"
+
+using namespace utility;
+
+/*
+Actors on a pool: state touched by the behavior only needs no lock, the messages of each sender are
+processed in order, actors can message each other, and an actor is destroyed cleanly also when its
+pool has been stopped. Build with -O2 -pthread, or -fsanitize=thread.
+*/
+
+using Pool = ThreadPool<void()>;
+
+constexpr int num_senders = 4;
+constexpr int per_sender = 20000;
+
+void senders(Pool& pool) {
+    long processed = 0;     // no lock, only the behavior touches it
+    std::vector<int> last(num_senders, -1);
+    {
+        Actor<std::pair<int, int>, Pool> a(pool, [&](std::pair<int, int>& m) {
+            assert(m.second == last[m.first] + 1);
+            last[m.first] = m.second;
+            ++processed;
+        }, 16);
+        std::vector<std::thread> ts;
+        for (int s = 0; s != num_senders; ++s)
+            ts.emplace_back([&, s] {
+                for (int i = 0; i != per_sender; ++i)
+                    a.send(std::make_pair(s, i));
+            });
+        for (auto& t: ts)
+            t.join();
+    }
+    assert(processed == num_senders * per_sender);
+}
+
+// two actors pass a counter back and forth
+void ping_pong(Pool& pool) {
+    constexpr int rounds = 10000;
+    std::atomic<bool> done{false};
+    std::function<void(int&)> to_pong;
+    Actor<int, Pool> ping(pool, [&](int& n) { to_pong(n); });
+    Actor<int, Pool> pong(pool, [&](int& n) {
+        if (n == rounds)
+            done = true;
+        else
+            ping.send(n + 1);
+    });
+    to_pong = [&](int& n) { pong.send(n); };
+    ping.send(0);
+    while (!done)
+        std::this_thread::yield();
+}
+
+// messages left when the pool stops are processed by the destructor
+void stopped_pool() {
+    Pool pool(2);
+    int processed = 0;
+    {
+        Actor<int, Pool> a(pool, [&](int&) { ++processed; }, 4);
+        for (int i = 0; i != 100; ++i)
+            a.send(i);
+        pool.stop();
+        for (int i = 0; i != 100; ++i)
+            try {
+                a.send(i);
+            }
+            catch (QueueClosed&) {}
+    }
+    assert(processed == 200);
+}
+
+int main() {
+    Pool pool(4);
+    senders(pool);
+    ping_pong(pool);
+    stopped_pool();
+    std::printf("ok\n");
+}
@@ -0,0 +1,189 @@
+#ifndef CONCURRENCY_ACTOR_H_
+#define CONCURRENCY_ACTOR_H_
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <utility>
+
+#include "object_pool.hpp"
+
+namespace utility {
+    /*
+    Intrusive multi-producer single-consumer queue of Vyukov. Nodes are linked through a next
+    pointer of their own, so nothing is allocated. push() is wait-free: one exchange and one store.
+    pop() is only called by one thread at a time, and may return nullptr while a push is halfway
+    through, i.e., between its exchange and its store, even if nodes pushed later are complete.
+    */
+    class IntrusiveMpscQueue {
+    public:
+        struct Node {
+            std::atomic<Node*> next{nullptr};
+        };
+
+        IntrusiveMpscQueue() = default;
+        IntrusiveMpscQueue(const IntrusiveMpscQueue&) = delete;
+        IntrusiveMpscQueue& operator=(const IntrusiveMpscQueue&) = delete;
+
+        void push(Node* n) noexcept {
+            n->next.store(nullptr, std::memory_order_relaxed);
+            auto prev = head.exchange(n, std::memory_order_acq_rel);
+            prev->next.store(n, std::memory_order_release);
+        }
+        Node* pop() noexcept;
+        // consumer only
+        bool empty() const noexcept {
+            return tail == &stub && !stub.next.load(std::memory_order_acquire);
+        }
+    private:
+        std::atomic<Node*> head{&stub};     // the node pushed last
+        Node* tail = &stub;                 // the node popped next, or the stub
+        Node stub;                          // keeps the queue non-empty, so push never sees nullptr
+    };
+
+    inline IntrusiveMpscQueue::Node* IntrusiveMpscQueue::pop() noexcept {
+        auto t = tail;
+        auto next = t->next.load(std::memory_order_acquire);
+        if (t == &stub) {
+            if (!next)
+                return nullptr;
+            tail = t = next;
+            next = next->next.load(std::memory_order_acquire);
+        }
+        if (next) {
+            tail = next;
+            return t;
+        }
+        if (t != head.load(std::memory_order_acquire))
+            return nullptr;     // a push is in progress
+        // t is the last node, put the stub behind it so that t can be handed out
+        push(&stub);
+        next = t->next.load(std::memory_order_acquire);
+        if (next) {
+            tail = next;
+            return t;
+        }
+        return nullptr;
+    }
+
+    /*
+    Actor processing its messages one at a time on the workers of pool, a ThreadPool<void()>.
+    An actor takes no thread while its mailbox is empty: send() counts the message in pending and only
+    the send taking pending from zero submits a turn. A turn runs behavior(Message&) on at most
+    batch messages, so that a busy actor does not hold a worker from the others, and submits the
+    next turn itself if messages are left. At most one turn of an actor runs at a time, and each turn
+    sees the effects of the previous ones, so behavior needs no synchronization of its own.
+    Messages are allocated from an ObjectPool, an idle actor costs sizeof(Actor) bytes, which is
+    why the members are not padded to cache lines.
+    A message whose behavior throws is dropped and the exception is discarded with the future of
+    the turn. If the pool refuses a turn, e.g., with QueueClosed after stop(), the send throws that
+    exception but the message stays in the mailbox.
+    The destructor waits for the turns in flight, running pool tasks meanwhile, and runs a turn the
+    pool refused itself, so that it does not wait forever on a stopped pool; it must not race with
+    send() and must not be called from the actor's own behavior.
+    */
+    template<typename Message, typename Pool, typename Behavior=std::function<void(Message&)>>
+    class Actor {
+    public:
+        Actor(Pool& pool, Behavior behavior, std::size_t batch=64):
+            pool(pool), behavior(std::move(behavior)), batch(batch? batch: 1) {}
+        Actor(const Actor&) = delete;
+        Actor& operator=(const Actor&) = delete;
+        ~Actor();
+
+        void send(const Message& m) { emplace(m); }
+        void send(Message&& m) { emplace(std::move(m)); }
+        template<typename... Args>
+        void emplace(Args&&... args);
+        // messages sent and not processed yet, approximate while sending
+        std::size_t backlog() const { return pending.load(std::memory_order_relaxed); }
+    private:
+        struct Envelope: IntrusiveMpscQueue::Node {
+            template<typename... Args>
+            explicit Envelope(Args&&... args): message(std::forward<Args>(args)...) {}
+            Message message;
+        };
+        using Envelopes = ObjectPool<Envelope>;
+
+        void schedule();
+        void turn();
+
+        IntrusiveMpscQueue mailbox;
+        std::atomic<std::size_t> pending{0};
+        std::atomic<bool> refused{false};   // a turn is owed that the pool did not take
+        Pool& pool;
+        Behavior behavior;
+        const std::size_t batch;
+    };
+
+    template<typename Message, typename Pool, typename Behavior>
+    Actor<Message, Pool, Behavior>::~Actor() {
+        while (pending.load(std::memory_order_acquire)) {
+            if (refused.exchange(false, std::memory_order_acquire)) {
+                // as in the pool, exceptions are discarded; a refused schedule() sets refused again
+                try {
+                    turn();
+                }
+                catch (...) {}
+            }
+            else if (!pool.run_pending_task())
+                std::this_thread::yield();
+        }
+    }
+
+    template<typename Message, typename Pool, typename Behavior>
+    void Actor<Message, Pool, Behavior>::schedule() {
+        try {
+            pool.submit([this] { turn(); });
+        }
+        catch (...) {
+            // pending stays above zero, so no other turn starts until the destructor takes this one
+            refused.store(true, std::memory_order_release);
+            throw;
+        }
+    }
+
+    template<typename Message, typename Pool, typename Behavior>
+    template<typename... Args>
+    void Actor<Message, Pool, Behavior>::emplace(Args&&... args) {
+        mailbox.push(Envelopes::create(std::forward<Args>(args)...));
+        // the message is in the mailbox before it is counted, so that a turn finding it
+        // counted also finds it pushed, unless an earlier push is still halfway through
+        if (pending.fetch_add(1, std::memory_order_acq_rel) == 0)
+            schedule();
+    }
+
+    template<typename Message, typename Pool, typename Behavior>
+    void Actor<Message, Pool, Behavior>::turn() {
+        // a message may be popped before its send counts it, so never take more than counted: pending
+        // must not drop to zero, which lets a send start another turn, before this one is done
+        auto limit = std::min(batch, pending.load(std::memory_order_acquire));
+        std::size_t n = 0;
+        // settles the count even if behavior throws; the last access to this, as
+        // the destructor may run as soon as pending drops to zero
+        auto done = [this, &n] {
+            if (pending.fetch_sub(n, std::memory_order_acq_rel) != n)
+                schedule();
+        };
+        try {
+            while (n != limit) {
+                auto e = static_cast<Envelope*>(mailbox.pop());
+                if (!e)
+                    break;
+                ++n;
+                std::unique_ptr<Envelope, void(*)(Envelope*)> guard(e, &Envelopes::destroy);
+                behavior(e->message);
+            }
+        }
+        catch (...) {
+            done();
+            throw;
+        }
+        done();
+    }
+}
+
+#endif
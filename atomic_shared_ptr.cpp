@@ -0,0 +1,99 @@
+#include <atomic>
+#include <cassert>
+#include <cstdio>
+#include <thread>
+#include <vector>
+
+#include "atomic_shared_ptr.hpp"
+#include "stack.hpp"
+
+using namespace utility;
+
+/*
+Loads racing with stores and compare-exchanges on one AtomicSharedPtr must always see a whole
+object that is still alive, and every object must be freed in the end; the LockFreeStack on top of
+it must pop every element exactly once. Build with -O2 -pthread, or -fsanitize=thread.
+*/
+
+std::atomic<int> alive{0};
+
+struct Counter {
+    explicit Counter(long v): value(v), check(~v) { ++alive; }
+    ~Counter() {
+        check = 0;
+        --alive;
+    }
+    long value, check;
+};
+
+void load_store() {
+    {
+        AtomicSharedPtr<Counter> p(make_shared_ptr<Counter>(0));
+        assert(p.is_lock_free());
+        std::vector<std::thread> ts;
+        for (int t = 0; t != 4; ++t)
+            ts.emplace_back([&, t] {
+                for (long i = 0; i != 50000; ++i) {
+                    if (t == 0)
+                        p.store(make_shared_ptr<Counter>(i));
+                    else {
+                        auto c = p.load();
+                        assert(c && c->check == ~c->value);
+                    }
+                }
+            });
+        for (auto& t: ts)
+            t.join();
+    }
+    assert(alive == 0);
+}
+
+// compare-exchange loops replacing the object with one counting one more lose no increment
+void increments() {
+    constexpr int threads = 4, per_thread = 20000;
+    {
+        AtomicSharedPtr<Counter> p(make_shared_ptr<Counter>(0));
+        std::vector<std::thread> ts;
+        for (int t = 0; t != threads; ++t)
+            ts.emplace_back([&] {
+                for (int i = 0; i != per_thread; ++i) {
+                    auto old = p.load();
+                    while (!p.compare_exchange_weak(old, make_shared_ptr<Counter>(old->value + 1)));
+                }
+            });
+        for (auto& t: ts)
+            t.join();
+        assert(p.load()->value == threads * per_thread);
+    }
+    assert(alive == 0);
+}
+
+void stack() {
+    constexpr int threads = 4, per_thread = 20000;
+    LockFreeStack<int, AtomicSharedPtr<int>> s;
+    assert(s.is_lock_free());
+    std::vector<std::atomic<int>> seen(threads * per_thread);
+    std::vector<std::thread> ts;
+    for (int t = 0; t != threads; ++t)
+        ts.emplace_back([&, t] {
+            for (int i = 0; i != per_thread; ++i) {
+                s.push(t * per_thread + i);
+                if (i % 2)
+                    if (auto p = s.pop())
+                        ++seen[*p];
+            }
+        });
+    for (auto& t: ts)
+        t.join();
+    while (auto p = s.pop())
+        ++seen[*p];
+    for (auto& n: seen)
+        assert(n == 1);
+}
+
+int main() {
+    load_store();
+    increments();
+    stack();
+    std::printf("ok\n");
+}
@@ -0,0 +1,222 @@
+#ifndef CONCURRENCY_ATOMIC_SHARED_PTR_H_
+#define CONCURRENCY_ATOMIC_SHARED_PTR_H_
+
+#include <atomic>
+#include <cstdint>
+#include <memory_resource>
+#include <new>
+#include <utility>
+
+namespace utility {
+    template<typename T>
+    class AtomicSharedPtr;
+
+    // reference counted pointer, the control block is allocated together with the object
+    template<typename T>
+    class SharedPtr {
+    public:
+        SharedPtr() noexcept = default;
+        SharedPtr(std::nullptr_t) noexcept {}
+        SharedPtr(const SharedPtr& other) noexcept: cb(other.cb) {
+            if (cb)
+                cb->count.fetch_add(1, std::memory_order_relaxed);
+        }
+        SharedPtr(SharedPtr&& other) noexcept: cb(other.cb) { other.cb = nullptr; }
+        SharedPtr& operator=(SharedPtr other) noexcept {
+            std::swap(cb, other.cb);
+            return *this;
+        }
+        ~SharedPtr() { reset(); }
+
+        void reset() noexcept {
+            if (cb) {
+                release(cb, 1);
+                cb = nullptr;
+            }
+        }
+        T* get() const noexcept { return cb? &cb->value: nullptr; }
+        T& operator*() const noexcept { return cb->value; }
+        T* operator->() const noexcept { return &cb->value; }
+        explicit operator bool() const noexcept { return cb; }
+        // approximate when shared between threads
+        // acquire, so that a count of one means the other owners are done with the object
+        long use_count() const noexcept {
+            return cb? cb->count.load(std::memory_order_acquire): 0;
+        }
+        friend bool operator==(const SharedPtr& a, const SharedPtr& b) noexcept { return a.cb == b.cb; }
+        friend bool operator!=(const SharedPtr& a, const SharedPtr& b) noexcept { return a.cb != b.cb; }
+
+        template<typename U, typename... Args>
+        friend SharedPtr<U> make_shared_ptr(Args&&...);
+        template<typename U, typename... Args>
+        friend SharedPtr<U> allocate_shared_ptr(std::pmr::memory_resource*, Args&&...);
+    private:
+        friend class AtomicSharedPtr<T>;
+        struct ControlBlock {
+            template<typename... Args>
+            ControlBlock(std::pmr::memory_resource* r, Args&&... args):
+                resource(r), value(std::forward<Args>(args)...) {}
+            std::atomic<std::int64_t> count{1};
+            std::pmr::memory_resource* resource;    // nullptr for operator new
+            T value;
+        };
+        // takes over one reference of cb
+        explicit SharedPtr(ControlBlock* cb) noexcept: cb(cb) {}
+        static void release(ControlBlock* cb, std::int64_t n) noexcept {
+            if (cb->count.fetch_sub(n, std::memory_order_acq_rel) != n)
+                return;
+            if (auto r = cb->resource) {
+                cb->~ControlBlock();
+                r->deallocate(cb, sizeof(ControlBlock), alignof(ControlBlock));
+            }
+            else
+                delete cb;
+        }
+        ControlBlock* cb = nullptr;
+    };
+
+    template<typename T, typename... Args>
+    SharedPtr<T> make_shared_ptr(Args&&... args) {
+        return SharedPtr<T>(new typename SharedPtr<T>::ControlBlock(nullptr, std::forward<Args>(args)...));
+    }
+
+    // as make_shared_ptr(), with the control block and the object allocated from resource
+    template<typename T, typename... Args>
+    SharedPtr<T> allocate_shared_ptr(std::pmr::memory_resource* resource, Args&&... args) {
+        using ControlBlock = typename SharedPtr<T>::ControlBlock;
+        auto p = resource->allocate(sizeof(ControlBlock), alignof(ControlBlock));
+        try {
+            return SharedPtr<T>(new (p) ControlBlock(resource, std::forward<Args>(args)...));
+        }
+        catch (...) {
+            resource->deallocate(p, sizeof(ControlBlock), alignof(ControlBlock));
+            throw;
+        }
+    }
+
+    /*
+    Lock-free atomic SharedPtr with split reference counting (see Chapter 7.2.4).
+    The pointer and an external count share one 64-bit word: x86-64 and AArch64 user space pointers fit in
+    48 bits, leaving 16 bits to the count. While a pointer is stored, the atomic holds `batch` references
+    on it in advance. load() takes one of them by incrementing the external count in the same fetch_add
+    that reads the pointer, so it never touches a control block that may have been freed. The references
+    not taken are given back when the pointer is replaced; when the external count grows too large, the
+    loader tops up the batch.
+    NOTE: up to batch / 2 loads may be in flight between two top-ups, i.e., fewer than 16384 threads.
+    */
+    template<typename T>
+    class AtomicSharedPtr {
+        using ControlBlock = typename SharedPtr<T>::ControlBlock;
+        static constexpr int count_shift = 48;
+        static constexpr std::uint64_t one = std::uint64_t(1) << count_shift;
+        static constexpr std::uint64_t ptr_mask = one - 1;
+        static constexpr std::int64_t batch = 1 << 15;
+        static_assert(sizeof(void*) == 8, "pointer packing requires a 64-bit platform");
+    public:
+        AtomicSharedPtr() noexcept = default;
+        AtomicSharedPtr(SharedPtr<T> p) noexcept: word(acquire(std::move(p))) {}
+        AtomicSharedPtr(const AtomicSharedPtr&) = delete;
+        AtomicSharedPtr& operator=(const AtomicSharedPtr&) = delete;
+        ~AtomicSharedPtr() { release(word.load(std::memory_order_relaxed), 0); }
+
+        bool is_lock_free() const noexcept { return word.is_lock_free(); }
+
+        SharedPtr<T> load(std::memory_order order=std::memory_order_seq_cst) const noexcept;
+        void store(SharedPtr<T> p, std::memory_order order=std::memory_order_seq_cst) noexcept {
+            release(word.exchange(acquire(std::move(p)), with_acquire(order)), 0);
+        }
+        SharedPtr<T> exchange(SharedPtr<T> p, std::memory_order order=std::memory_order_seq_cst) noexcept {
+            auto old = word.exchange(acquire(std::move(p)), with_acquire(order));
+            release(old, 1);
+            return SharedPtr<T>(cb_of(old));
+        }
+        // compares the stored pointer, not the count. On failure expected is loaded with the current value
+        bool compare_exchange_strong(SharedPtr<T>& expected, SharedPtr<T> desired,
+            std::memory_order success=std::memory_order_seq_cst,
+            std::memory_order failure=std::memory_order_seq_cst) noexcept;
+        bool compare_exchange_weak(SharedPtr<T>& expected, SharedPtr<T> desired,
+            std::memory_order success=std::memory_order_seq_cst,
+            std::memory_order failure=std::memory_order_seq_cst) noexcept {
+            return compare_exchange_strong(expected, std::move(desired), success, failure);
+        }
+        operator SharedPtr<T>() const noexcept { return load(); }
+    private:
+        static ControlBlock* cb_of(std::uint64_t w) noexcept {
+            return reinterpret_cast<ControlBlock*>(w & ptr_mask);
+        }
+        static std::int64_t count_of(std::uint64_t w) noexcept {
+            return w >> count_shift;
+        }
+        // the control block read from the word is always dereferenced, so it must be visible
+        static std::memory_order with_acquire(std::memory_order order) noexcept {
+            if (order == std::memory_order_relaxed)
+                return std::memory_order_acquire;
+            if (order == std::memory_order_release)
+                return std::memory_order_acq_rel;
+            return order;
+        }
+        // turns the reference of p into a batch held by the atomic
+        static std::uint64_t acquire(SharedPtr<T> p) noexcept {
+            auto cb = p.cb;
+            p.cb = nullptr;
+            if (cb)
+                cb->count.fetch_add(batch - 1, std::memory_order_relaxed);
+            return reinterpret_cast<std::uint64_t>(cb);
+        }
+        // gives back the references not taken by loaders, keeping `keep` of them
+        static void release(std::uint64_t w, std::int64_t keep) noexcept {
+            if (auto cb = cb_of(w)) {
+                auto unused = batch - count_of(w) - keep;
+                if (unused)
+                    SharedPtr<T>::release(cb, unused);
+            }
+        }
+        void top_up(std::uint64_t w) const noexcept;
+
+        mutable std::atomic<std::uint64_t> word{0};
+    };
+
+    template<typename T>
+    SharedPtr<T> AtomicSharedPtr<T>::load(std::memory_order order) const noexcept {
+        auto w = word.fetch_add(one, with_acquire(order)) + one;
+        if (count_of(w) >= batch / 2)
+            top_up(w);
+        return SharedPtr<T>(cb_of(w));
+    }
+
+    // moves batch / 2 more references into the atomic and resets the count accordingly
+    template<typename T>
+    void AtomicSharedPtr<T>::top_up(std::uint64_t w) const noexcept {
+        auto cb = cb_of(w);
+        if (cb)
+            cb->count.fetch_add(batch / 2, std::memory_order_relaxed);
+        while (count_of(w) >= batch / 2) {
+            if (word.compare_exchange_weak(w, w - (batch / 2) * one, std::memory_order_relaxed))
+                return;
+            if (cb_of(w) != cb)
+                break;
+        }
+        // someone else has topped up or replaced the pointer
+        if (cb)
+            SharedPtr<T>::release(cb, batch / 2);
+    }
+
+    template<typename T>
+    bool AtomicSharedPtr<T>::compare_exchange_strong(SharedPtr<T>& expected,
+        SharedPtr<T> desired, std::memory_order success, std::memory_order failure) noexcept {
+        auto w = word.load(std::memory_order_relaxed);
+        auto d = acquire(std::move(desired));
+        while (cb_of(w) == expected.cb) {
+            // the count may change under us, which only makes us retry
+            if (word.compare_exchange_weak(w, d, with_acquire(success), std::memory_order_relaxed)) {
+                release(w, 0);
+                return true;
+            }
+        }
+        release(d, 0);
+        expected = load(failure);
+        return false;
+    }
+}
+
+#endif
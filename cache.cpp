@@ -0,0 +1,87 @@
+#include <atomic>
+#include <cassert>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "cache.hpp"
+
+using namespace utility;
+
+/*
+A cache bounded in bytes evicting by weight, and threads missing on the same keys at once, each
+key must be computed only once. Build with -O2 -pthread, or -fsanitize=thread.
+*/
+
+struct StringWeight {
+    std::size_t operator()(int, const std::string& s) const { return s.size(); }
+};
+using ByteCache = LockBasedCache<int, std::string, std::hash<int>, StringWeight>;
+
+void eviction_by_weight() {
+    ByteCache cache(1000, 1);
+    for (int i = 0; i != 10; ++i)
+        assert(cache.put(i, std::string(100, 'a' + i)));
+    assert(cache.size() == 10 && cache.weight() == 1000);
+    // a hit spares an entry for one round of the clock hand
+    assert(cache.get(0));
+    assert(cache.put(10, std::string(100, 'k')));
+    assert(cache.get(0) && !cache.get(1) && cache.weight() == 1000);
+    // a heavy entry makes room for itself
+    assert(cache.put(11, std::string(450, 'l')));
+    assert(cache.weight() <= 1000 && cache.size() == 6);
+    assert(*cache.get(11) == std::string(450, 'l'));
+    // one heavier than the whole cache is not kept, and does not leave an older value behind
+    assert(!cache.put(11, std::string(cache.max_entry_weight() + 1, 'x')));
+    assert(!cache.get(11));
+}
+
+void concurrent_weight() {
+    ByteCache cache(1 << 14, 4);
+    std::vector<std::thread> ts;
+    for (int t = 0; t != 4; ++t)
+        ts.emplace_back([&, t] {
+            for (int i = 0; i != 20000; ++i) {
+                auto k = (i * 7 + t) % 500;
+                if (auto v = cache.get(k))
+                    assert(v->size() == std::size_t(k % 50 + 1));
+                else
+                    cache.put(k, std::string(k % 50 + 1, 'v'));
+                if (i % 100 == 0)
+                    cache.erase(k);
+            }
+        });
+    for (auto& t: ts)
+        t.join();
+    assert(cache.weight() <= cache.capacity());
+}
+
+void compute_once() {
+    LockBasedCache<int, int> cache(1024);
+    std::atomic<int> computed[64] = {};
+    std::vector<std::thread> ts;
+    for (int t = 0; t != 8; ++t)
+        ts.emplace_back([&] {
+            for (int k = 0; k != 64; ++k) {
+                auto v = cache.get_or_compute(k, [&](int k) {
+                    ++computed[k];
+                    std::this_thread::yield();
+                    return k * k;
+                });
+                assert(*v == k * k);
+            }
+        });
+    for (auto& t: ts)
+        t.join();
+    for (auto& c: computed)
+        assert(c == 1);
+    assert(cache.size() == 64);
+}
+
+int main() {
+    eviction_by_weight();
+    concurrent_weight();
+    compute_once();
+    std::printf("ok\n");
+}
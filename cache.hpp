@@ -0,0 +1,278 @@
+#ifndef CONCURRENCY_CACHE_H_
+#define CONCURRENCY_CACHE_H_
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <functional>
+#include <future>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <stdexcept>
+#include <unordered_map>
+#include <vector>
+
+namespace utility {
+    // default weigher, which makes the capacity a number of entries
+    struct UnitWeight {
+        template<typename Key, typename Value>
+        std::size_t operator()(const Key&, const Value&) const { return 1; }
+    };
+
+    /*
+    Bounded cache sharded by hash in the same way as LockBasedMap.
+    Each shard evicts with the CLOCK algorithm: a hit only sets the reference bit of the entry, which is atomic, so hits take the shared lock only.
+    The exclusive lock is taken on insertion, eviction and erasure.
+    The capacity is measured by Weigher, which defaults to the number of entries; supply a weigher returning the size of an entry to bound the cache in bytes.
+    The capacity is split among the shards, which are fewer than asked for if each would get less than min_shard_capacity.
+    An entry heavier than its shard, see max_entry_weight(), is not cached, and put() returns false.
+    */
+    template<typename Key, typename Value, typename Hash=std::hash<Key>,
+        typename Weigher=UnitWeight>
+    class LockBasedCache {
+    public:
+        using ValuePtr = std::shared_ptr<const Value>;
+
+        explicit LockBasedCache(std::size_t capacity, std::size_t num_shards=16,
+            const Hash& hasher=Hash(), const Weigher& weigher=Weigher());
+        LockBasedCache(const LockBasedCache&) = delete;
+        LockBasedCache& operator=(const LockBasedCache&) = delete;
+
+        // returns nullptr on miss
+        ValuePtr get(const Key& k) const {
+            return get_shard(k).get(k);
+        }
+        // returns false if v is too heavy to be cached, any previous value of k is erased anyway.
+        // A null v throws std::invalid_argument, as get() could not tell it from a miss
+        bool put(const Key& k, const Value& v) {
+            return put(k, std::make_shared<const Value>(v));
+        }
+        bool put(const Key& k, Value&& v) {
+            return put(k, std::make_shared<const Value>(std::move(v)));
+        }
+        bool put(const Key& k, ValuePtr v) {
+            if (!v)
+                throw std::invalid_argument("null cache value");
+            auto& s = get_shard(k);
+            auto w = weigher(k, *v);
+            std::lock_guard l(s.m);
+            s.supersede(k);
+            return s.insert(k, std::move(v), w);
+        }
+        bool erase(const Key& k) {
+            return get_shard(k).erase(k);
+        }
+        // on miss, f(k) is computed by exactly one of the threads missing on k,
+        // the others wait for its result. Exceptions thrown by f are propagated to all of them.
+        // The result is not cached if k is put or erased while f runs, as it may be stale
+        template<typename Func>
+        ValuePtr get_or_compute(const Key& k, Func f);
+
+        // both are approximate as shards are visited one after another
+        std::size_t size() const;
+        std::size_t weight() const;
+        std::size_t capacity() const { return total_capacity; }
+        std::size_t max_entry_weight() const { return total_capacity / shards.size(); }
+
+        static constexpr std::size_t min_shard_capacity = 8;
+    private:
+        struct Entry {
+            Entry(const Key& k, ValuePtr v, std::size_t w):
+                key(k), value(std::move(v)), weight(w) {}
+            const Key key;
+            ValuePtr value;
+            std::size_t weight;
+            mutable std::atomic<bool> referenced{false};
+        };
+        using Ring = std::list<Entry>;
+
+        struct Pending {
+            std::shared_future<ValuePtr> result;
+            bool superseded = false;    // k was put or erased meanwhile
+        };
+
+        struct Shard {
+            ValuePtr get(const Key& k) const;
+            bool insert(const Key&, ValuePtr, std::size_t);   // requires exclusive lock
+            bool erase(const Key&);
+            void evict(std::size_t);      // requires exclusive lock
+            // keeps a computation running from caching its result, requires exclusive lock
+            void supersede(const Key& k) {
+                auto it = pending.find(k);
+                if (it != pending.end())
+                    it->second.superseded = true;
+            }
+
+            mutable std::shared_mutex m;
+            Ring ring;
+            typename Ring::iterator hand = ring.end();  // clock hand
+            std::unordered_map<Key, typename Ring::iterator, Hash> index;
+            // misses being computed by get_or_compute
+            std::unordered_map<Key, Pending, Hash> pending;
+            std::size_t used = 0;
+            std::size_t capacity = 0;
+        };
+
+        Shard& get_shard(const Key& k) const {
+            const std::size_t idx = hasher(k) % shards.size();
+            return *shards[idx];
+        }
+
+        std::vector<std::unique_ptr<Shard>> shards;
+        std::size_t total_capacity;
+        Hash hasher;
+        Weigher weigher;
+    };
+
+    template<typename Key, typename Value, typename Hash, typename Weigher>
+    LockBasedCache<Key, Value, Hash, Weigher>::LockBasedCache(std::size_t capacity,
+        std::size_t num_shards, const Hash& hasher, const Weigher& weigher):
+        shards(std::max<std::size_t>(1, std::min(num_shards, capacity / min_shard_capacity))),
+        total_capacity(capacity), hasher(hasher), weigher(weigher) {
+        // the first capacity % shards get one more, so that the shards add up to the capacity
+        for (std::size_t i = 0; i != shards.size(); ++i) {
+            shards[i].reset(new Shard);
+            shards[i]->capacity = capacity / shards.size() + (i < capacity % shards.size());
+        }
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Weigher>
+    template<typename Func>
+    typename LockBasedCache<Key, Value, Hash, Weigher>::ValuePtr
+    LockBasedCache<Key, Value, Hash, Weigher>::get_or_compute(const Key& k, Func f) {
+        auto& s = get_shard(k);
+        if (auto v = s.get(k))
+            return v;
+        std::promise<ValuePtr> p;
+        {
+            std::unique_lock l(s.m);
+            // check again as the value may be inserted before we take the lock
+            auto it = s.index.find(k);
+            if (it != s.index.end()) {
+                it->second->referenced.store(true, std::memory_order_relaxed);
+                return it->second->value;
+            }
+            auto pit = s.pending.find(k);
+            if (pit != s.pending.end()) {
+                auto fut = pit->second.result;
+                l.unlock();
+                return fut.get();
+            }
+            s.pending.emplace(k, Pending{p.get_future().share()});
+        }
+        try {
+            auto v = std::make_shared<const Value>(f(k));
+            auto w = weigher(k, *v);
+            {
+                std::lock_guard l(s.m);
+                auto pit = s.pending.find(k);
+                if (!pit->second.superseded)
+                    s.insert(k, v, w);
+                s.pending.erase(pit);
+            }
+            p.set_value(v);
+            return v;
+        }
+        catch (...) {
+            {
+                std::lock_guard l(s.m);
+                s.pending.erase(k);
+            }
+            p.set_exception(std::current_exception());
+            throw;
+        }
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Weigher>
+    std::size_t LockBasedCache<Key, Value, Hash, Weigher>::size() const {
+        std::size_t n = 0;
+        for (auto& s: shards) {
+            std::shared_lock l(s->m);
+            n += s->index.size();
+        }
+        return n;
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Weigher>
+    std::size_t LockBasedCache<Key, Value, Hash, Weigher>::weight() const {
+        std::size_t n = 0;
+        for (auto& s: shards) {
+            std::shared_lock l(s->m);
+            n += s->used;
+        }
+        return n;
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Weigher>
+    typename LockBasedCache<Key, Value, Hash, Weigher>::ValuePtr
+    LockBasedCache<Key, Value, Hash, Weigher>::Shard::get(const Key& k) const {
+        std::shared_lock l(m);
+        auto it = index.find(k);
+        if (it == index.end())
+            return {};
+        auto& e = *it->second;
+        // avoid writing the cache line when the bit is already set
+        if (!e.referenced.load(std::memory_order_relaxed))
+            e.referenced.store(true, std::memory_order_relaxed);
+        return e.value;
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Weigher>
+    bool LockBasedCache<Key, Value, Hash, Weigher>::Shard::insert(
+        const Key& k, ValuePtr v, std::size_t w) {
+        auto it = index.find(k);
+        if (it != index.end()) {
+            auto e = it->second;
+            used -= e->weight;
+            if (hand == e)
+                ++hand;
+            ring.erase(e);
+            index.erase(it);
+        }
+        // entries larger than the shard are not cached at all
+        if (w > capacity)
+            return false;
+        evict(w);
+        // insert right behind the hand so that the new entry is the last one visited
+        auto e = ring.emplace(hand, k, std::move(v), w);
+        index.emplace(k, e);
+        used += w;
+        return true;
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Weigher>
+    bool LockBasedCache<Key, Value, Hash, Weigher>::Shard::erase(const Key& k) {
+        std::lock_guard l(m);
+        supersede(k);
+        auto it = index.find(k);
+        if (it == index.end())
+            return false;
+        auto e = it->second;
+        used -= e->weight;
+        if (hand == e)
+            ++hand;
+        ring.erase(e);
+        index.erase(it);
+        return true;
+    }
+
+    template<typename Key, typename Value, typename Hash, typename Weigher>
+    void LockBasedCache<Key, Value, Hash, Weigher>::Shard::evict(std::size_t w) {
+        // terminates within two rounds as the hand clears every bit it passes
+        while (used + w > capacity && !ring.empty()) {
+            if (hand == ring.end())
+                hand = ring.begin();
+            if (hand->referenced.exchange(false, std::memory_order_relaxed)) {
+                ++hand;
+                continue;
+            }
+            used -= hand->weight;
+            index.erase(hand->key);
+            hand = ring.erase(hand);
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,38 @@
+#ifndef CONCURRENCY_CACHE_LINE_H_
+#define CONCURRENCY_CACHE_LINE_H_
+
+#include <atomic>
+#include <cstddef>
+#include <new>
+
+namespace utility {
+    /*
+    Distance that keeps two objects from sharing a cache line. Members written by different threads,
+    e.g., the head and the tail of a queue, are aligned to it so that a write by one thread does not
+    invalidate the line the other is working on.
+    */
+#ifdef __cpp_lib_hardware_interference_size
+    // GCC warns that the value depends on -mtune, which only matters to layouts shared across builds
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Winterference-size"
+#endif
+    inline constexpr std::size_t cache_line_size = std::hardware_destructive_interference_size;
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+#else
+    inline constexpr std::size_t cache_line_size = 64;
+#endif
+
+    namespace detail {
+        // dense index of the calling thread, spreads threads over the padded cells or slots of sharded objects
+        inline std::size_t thread_index() {
+            static std::atomic<std::size_t> next{0};
+            static thread_local std::size_t index = next.fetch_add(1, std::memory_order_relaxed);
+            return index;
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,62 @@
+#include <atomic>
+#include <cassert>
+#include <cstdio>
+#include <thread>
+#include <vector>
+
+#include "concurrent_vector.hpp"
+#include "thread_pool.hpp"
+
+using namespace utility;
+
+/*
+Threads append while others read the elements already there, which must be whole and never move;
+then the elements are visited on a pool. Build with -O2 -pthread, or -fsanitize=thread.
+*/
+
+struct Item {
+    explicit Item(long v): value(v), check(~v) {}
+    long value, check;
+};
+
+constexpr int num_writers = 4;
+constexpr int per_writer = 50000;
+
+int main() {
+    ConcurrentVector<Item> v;
+    auto& first = v[v.push_back(Item(-1))];
+    std::atomic<bool> writing{true};
+    std::thread reader([&] {
+        while (writing) {
+            v.for_each([](std::size_t, const Item& e) { assert(e.check == ~e.value); });
+            auto n = v.size();
+            if (auto p = v.get(n - 1))
+                assert(p->check == ~p->value);
+        }
+    });
+    std::vector<std::vector<std::size_t>> indices(num_writers);
+    std::vector<std::thread> writers;
+    for (int w = 0; w != num_writers; ++w)
+        writers.emplace_back([&, w] {
+            for (long i = 0; i != per_writer; ++i)
+                indices[w].push_back(v.emplace_back(w * per_writer + i));
+        });
+    for (auto& t: writers)
+        t.join();
+    writing = false;
+    reader.join();
+
+    // the first element stays where it was through every growth
+    assert(&first == &v[0] && first.value == -1);
+    assert(v.size() == 1 + num_writers * per_writer);
+    for (int w = 0; w != num_writers; ++w)
+        for (long i = 0; i != per_writer; ++i)
+            assert(v.at(indices[w][i]).value == w * per_writer + i);
+
+    ThreadPool<void()> pool(2);
+    std::atomic<long> sum{0};
+    v.parallel_for_each(pool, [&](std::size_t, Item& e) { sum += e.value; }, 1000);
+    long n = num_writers * per_writer;
+    assert(sum == n * (n - 1) / 2 - 1);
+    std::printf("%zu elements\n", v.size());
+}
@@ -0,0 +1,189 @@
+#ifndef CONCURRENCY_CONCURRENT_VECTOR_H_
+#define CONCURRENCY_CONCURRENT_VECTOR_H_
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <future>
+#include <limits>
+#include <new>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+namespace utility {
+    /*
+    Append-only vector for many writers. Elements live in segments of geometrically growing size
+    (8, 16, 32, ...), which are allocated when first needed and never moved, so references to
+    elements stay valid until the vector is destroyed.
+    push_back() reserves an index with one fetch_add and constructs the element in place; it is
+    lock-free, only a thread allocating a segment that another thread allocates at the same time
+    wastes its work. operator[] is wait-free: the segment follows from the index by a bit scan.
+    An index below size() may belong to an element still being constructed by another thread:
+    operator[] must only be used with indices known to be ready (e.g., returned by push_back()),
+    while get(), for_each() and parallel_for_each() skip elements that are not ready yet.
+    If a constructor throws, its index stays empty for good.
+    */
+    template<typename T>
+    class ConcurrentVector {
+        static constexpr int first_bits = 3;
+        static constexpr std::size_t first_size = std::size_t(1) << first_bits;
+        static constexpr int max_segments = std::numeric_limits<std::size_t>::digits - first_bits;
+    public:
+        ConcurrentVector() = default;
+        ConcurrentVector(const ConcurrentVector&) = delete;
+        ConcurrentVector& operator=(const ConcurrentVector&) = delete;
+        ~ConcurrentVector();
+
+        // return the index of the new element
+        std::size_t push_back(const T& value) { return emplace_back(value); }
+        std::size_t push_back(T&& value) { return emplace_back(std::move(value)); }
+        template<typename... Args>
+        std::size_t emplace_back(Args&&... args);
+        // allocates the segments for n elements ahead of time
+        void reserve(std::size_t n);
+
+        T& operator[](std::size_t i) { return *slot(i).ptr(); }
+        const T& operator[](std::size_t i) const { return *slot(i).ptr(); }
+        // nullptr if element i has not been constructed yet
+        T* get(std::size_t i);
+        const T* get(std::size_t i) const { return const_cast<ConcurrentVector*>(this)->get(i); }
+        T& at(std::size_t i);
+        const T& at(std::size_t i) const { return const_cast<ConcurrentVector*>(this)->at(i); }
+
+        // number of indices handed out, including elements still under construction
+        std::size_t size() const { return reserved.load(std::memory_order_acquire); }
+        bool empty() const { return size() == 0; }
+
+        // applies f(index, element) to the ready elements in [first, last)
+        template<typename Func>
+        void for_each(Func f, std::size_t first=0, std::size_t last=std::numeric_limits<std::size_t>::max());
+        // splits the elements present at the call into chunks of at most grain elements, never
+        // crossing a segment, and runs them on pool, a ThreadPool<void()>. Returns when all chunks
+        // are done, running chunks itself meanwhile, and rethrows the first exception thrown by f
+        template<typename Pool, typename Func>
+        void parallel_for_each(Pool& pool, Func f, std::size_t grain=1024);
+    private:
+        struct Slot {
+            alignas(T) unsigned char storage[sizeof(T)];
+            std::atomic<bool> ready{false};
+            T* ptr() { return std::launder(reinterpret_cast<T*>(storage)); }
+        };
+        static int segment_of(std::size_t i) {
+            return std::numeric_limits<unsigned long long>::digits - 1
+                - __builtin_clzll(i + first_size) - first_bits;
+        }
+        static std::size_t segment_start(int k) { return (first_size << k) - first_size; }
+        static std::size_t segment_size(int k) { return first_size << k; }
+
+        Slot& slot(std::size_t i) const {
+            auto k = segment_of(i);
+            return segments[k].load(std::memory_order_acquire)[i - segment_start(k)];
+        }
+        Slot* get_segment(int k);
+
+        std::atomic<Slot*> segments[max_segments] = {};
+        std::atomic<std::size_t> reserved{0};
+    };
+
+    template<typename T>
+    ConcurrentVector<T>::~ConcurrentVector() {
+        for (int k = 0; k != max_segments; ++k) {
+            auto s = segments[k].load(std::memory_order_relaxed);
+            if (!s)
+                continue;
+            for (std::size_t j = 0; j != segment_size(k); ++j)
+                if (s[j].ready.load(std::memory_order_relaxed))
+                    s[j].ptr()->~T();
+            delete[] s;
+        }
+    }
+
+    template<typename T>
+    typename ConcurrentVector<T>::Slot* ConcurrentVector<T>::get_segment(int k) {
+        auto s = segments[k].load(std::memory_order_acquire);
+        if (s)
+            return s;
+        auto fresh = new Slot[segment_size(k)];
+        if (segments[k].compare_exchange_strong(s, fresh, std::memory_order_acq_rel))
+            return fresh;
+        delete[] fresh;     // allocated by another thread meanwhile
+        return s;
+    }
+
+    template<typename T>
+    template<typename... Args>
+    std::size_t ConcurrentVector<T>::emplace_back(Args&&... args) {
+        auto i = reserved.fetch_add(1, std::memory_order_relaxed);
+        auto k = segment_of(i);
+        auto& s = get_segment(k)[i - segment_start(k)];
+        new (s.storage) T(std::forward<Args>(args)...);
+        s.ready.store(true, std::memory_order_release);
+        return i;
+    }
+
+    template<typename T>
+    void ConcurrentVector<T>::reserve(std::size_t n) {
+        if (n)
+            for (int k = 0, last = segment_of(n - 1); k <= last; ++k)
+                get_segment(k);
+    }
+
+    template<typename T>
+    T* ConcurrentVector<T>::get(std::size_t i) {
+        if (i >= size())
+            return nullptr;
+        auto k = segment_of(i);
+        auto s = segments[k].load(std::memory_order_acquire);
+        if (!s)
+            return nullptr;
+        auto& e = s[i - segment_start(k)];
+        return e.ready.load(std::memory_order_acquire)? e.ptr(): nullptr;
+    }
+
+    template<typename T>
+    T& ConcurrentVector<T>::at(std::size_t i) {
+        if (auto p = get(i))
+            return *p;
+        throw std::out_of_range("element not present");
+    }
+
+    template<typename T>
+    template<typename Func>
+    void ConcurrentVector<T>::for_each(Func f, std::size_t first, std::size_t last) {
+        last = std::min(last, size());
+        while (first < last) {
+            auto k = segment_of(first);
+            auto s = segments[k].load(std::memory_order_acquire);
+            auto end = std::min(last, segment_start(k) + segment_size(k));
+            for (; s && first != end; ++first) {
+                auto& e = s[first - segment_start(k)];
+                if (e.ready.load(std::memory_order_acquire))
+                    f(first, *e.ptr());
+            }
+            first = end;
+        }
+    }
+
+    template<typename T>
+    template<typename Pool, typename Func>
+    void ConcurrentVector<T>::parallel_for_each(Pool& pool, Func f, std::size_t grain) {
+        grain = std::max<std::size_t>(grain, 1);
+        std::vector<std::future<void>> chunks;
+        auto n = size();
+        for (std::size_t first = 0; first < n;) {
+            auto k = segment_of(first);
+            auto last = std::min({n, segment_start(k) + segment_size(k), first + grain});
+            chunks.push_back(pool.submit([this, &f, first, last] { for_each(f, first, last); }));
+            first = last;
+        }
+        // f must outlive every chunk, even if one of them throws
+        for (auto& c: chunks)
+            pool.wait(c);
+        for (auto& c: chunks)
+            c.get();
+    }
+}
+
+#endif
@@ -0,0 +1,152 @@
+#ifndef CONCURRENCY_FLAT_COMBINING_H_
+#define CONCURRENCY_FLAT_COMBINING_H_
+
+#include <atomic>
+#include <cstddef>
+#include <exception>
+#include <memory>
+#include <optional>
+#include <thread>
+#include <type_traits>
+#include <utility>
+
+#include "cache_line.hpp"
+#include "futex.hpp"
+
+namespace utility {
+    /*
+    Flat combining (Hendler, Incze, Shavit & Tzafrir, 2010) around any sequential Container.
+    apply(f) publishes f in the slot of the calling thread and then either waits for it to be run or,
+    if the combiner lock is free, takes it and runs every published operation in one pass over the
+    slots. Under contention one thread thus applies a whole batch of operations while the container
+    stays in its cache, instead of the container and the lock moving to every thread in turn.
+    Threads are spread over the slots by a thread index; a thread finding its slot in use by another
+    thread takes the combiner lock itself and runs its operation directly.
+    f(Container&) runs on whichever thread combines, so it must not depend on thread identity
+    (thread_local, locks held by the caller) and must not call apply() on the same object. Its result
+    is returned by value, an exception it throws is rethrown by apply() in the calling thread.
+    */
+    template<typename Container>
+    class FlatCombining {
+    public:
+        explicit FlatCombining(std::size_t num_slots=2 * std::thread::hardware_concurrency(),
+            Container c=Container()):
+            data(std::move(c)), slots(new Slot[num_slots? num_slots: 1]),
+            num_slots(num_slots? num_slots: 1) {}
+        FlatCombining(const FlatCombining&) = delete;
+        FlatCombining& operator=(const FlatCombining&) = delete;
+
+        // runs f(Container&) under the combiner lock and returns its result
+        template<typename Func>
+        auto apply(Func f) -> std::invoke_result_t<Func&, Container&>;
+    private:
+        struct Request {
+            explicit Request(void (*run)(Request&, Container&)): run(run) {}
+            void (*run)(Request&, Container&);
+            std::exception_ptr error;
+            std::atomic<bool> done{false};
+        };
+        template<typename Func, typename R=std::invoke_result_t<Func&, Container&>>
+        struct Operation: Request {
+            explicit Operation(Func& f): Request(&Operation::run_operation), f(f) {}
+            static void run_operation(Request& r, Container& c) {
+                auto& op = static_cast<Operation&>(r);
+                if constexpr (std::is_void_v<R>)
+                    op.f(c);
+                else
+                    op.result.emplace(op.f(c));
+            }
+            Func& f;
+            std::optional<std::conditional_t<std::is_void_v<R>, char, R>> result;
+        };
+        struct alignas(cache_line_size) Slot {
+            std::atomic<Request*> request{nullptr};
+        };
+        static constexpr int max_passes = 4;
+
+        bool try_lock() {
+            return !locked.load(std::memory_order_relaxed)
+                && !locked.exchange(true, std::memory_order_acquire);
+        }
+        void unlock() { locked.store(false, std::memory_order_release); }
+        static void run(Request& r, Container& c) {
+            try {
+                r.run(r, c);
+            }
+            catch (...) {
+                r.error = std::current_exception();
+            }
+        }
+        void combine();     // requires the combiner lock
+        void wait(Request& r);
+
+        alignas(cache_line_size) std::atomic<bool> locked{false};
+        Container data;     // only touched by the combiner
+        std::unique_ptr<Slot[]> slots;
+        const std::size_t num_slots;
+    };
+
+    template<typename Container>
+    template<typename Func>
+    auto FlatCombining<Container>::apply(Func f) -> std::invoke_result_t<Func&, Container&> {
+        using R = std::invoke_result_t<Func&, Container&>;
+        static_assert(!std::is_reference_v<R>,
+            "return by value, the container may change as soon as apply() returns");
+        Operation<Func> op(f);
+        auto& slot = slots[detail::thread_index() % num_slots];
+        Request* expected = nullptr;
+        if (slot.request.compare_exchange_strong(expected, &op,
+            std::memory_order_release, std::memory_order_relaxed))
+            wait(op);
+        else {
+            // the slot is taken by another thread, do without
+            while (!try_lock())
+                if (!detail::spin_until([this] { return !locked.load(std::memory_order_relaxed); }))
+                    std::this_thread::yield();
+            run(op, data);
+            combine();
+            unlock();
+        }
+        if (op.error)
+            std::rethrow_exception(op.error);
+        if constexpr (!std::is_void_v<R>)
+            return std::move(*op.result);
+    }
+
+    // waits for r to be run, combining whenever the lock is free
+    template<typename Container>
+    void FlatCombining<Container>::wait(Request& r) {
+        auto done = [&r] { return r.done.load(std::memory_order_acquire); };
+        while (!done()) {
+            if (try_lock()) {
+                combine();
+                unlock();
+                // r was published before the lock was taken, so it has been run
+                return;
+            }
+            if (!detail::spin_until([&] { return done() || !locked.load(std::memory_order_relaxed); }))
+                std::this_thread::yield();
+        }
+    }
+
+    template<typename Container>
+    void FlatCombining<Container>::combine() {
+        for (int pass = 0; pass != max_passes; ++pass) {
+            bool found = false;
+            for (std::size_t i = 0; i != num_slots; ++i) {
+                auto r = slots[i].request.load(std::memory_order_acquire);
+                if (!r)
+                    continue;
+                run(*r, data);
+                // r lives on the stack of its thread, which may return as soon as done is set
+                slots[i].request.store(nullptr, std::memory_order_relaxed);
+                r->done.store(true, std::memory_order_release);
+                found = true;
+            }
+            if (!found)
+                return;
+        }
+    }
+}
+
+#endif
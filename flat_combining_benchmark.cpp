@@ -0,0 +1,108 @@
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <mutex>
+#include <optional>
+#include <queue>
+#include <thread>
+#include <vector>
+
+#include "flat_combining.hpp"
+#include "queue.hpp"
+
+using namespace utility;
+
+/*
+Throughput of a queue and a priority queue under contention: every thread pushes and then pops, as
+a mutex around the sequential container (LockBasedQueue<T, std::deque<T>> for the queue) against
+FlatCombining. Build with -O2 -pthread, optionally pass the number of threads and of operations
+per thread.
+*/
+
+template<typename Func>
+double run(int threads, long ops, Func f) {
+    std::atomic<int> ready{0};
+    std::atomic<bool> go{false};
+    std::vector<std::thread> ts;
+    for (int t = 0; t != threads; ++t)
+        ts.emplace_back([&, t] {
+            ready.fetch_add(1);
+            while (!go.load())
+                std::this_thread::yield();
+            f(t, ops);
+        });
+    while (ready.load() != threads)
+        std::this_thread::yield();
+    auto start = std::chrono::steady_clock::now();
+    go.store(true);
+    for (auto& t: ts)
+        t.join();
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    return 2.0 * threads * ops / elapsed.count();
+}
+
+void report(const char* name, int threads, double ops_per_second) {
+    std::printf("%-36s %3d threads %12.0f ops/s\n", name, threads, ops_per_second);
+}
+
+int main(int argc, char* argv[]) {
+    int max_threads = argc > 1? std::atoi(argv[1]): 2 * std::thread::hardware_concurrency();
+    long ops = argc > 2? std::atol(argv[2]): 200000;
+    for (int threads = 1; threads <= max_threads; threads *= 2) {
+        {
+            LockBasedQueue<long, std::deque<long>> q;
+            report("LockBasedQueue<deque>", threads, run(threads, ops, [&q](int, long n) {
+                long v;
+                for (long i = 0; i != n; ++i) {
+                    q.push(i);
+                    q.try_pop(v);
+                }
+            }));
+        }
+        {
+            FlatCombining<std::queue<long, std::deque<long>>> q;
+            report("FlatCombining<queue>", threads, run(threads, ops, [&q](int, long n) {
+                for (long i = 0; i != n; ++i) {
+                    q.apply([i](auto& c) { c.push(i); });
+                    q.apply([](auto& c) {
+                        std::optional<long> v;
+                        if (!c.empty()) {
+                            v = c.front();
+                            c.pop();
+                        }
+                        return v;
+                    });
+                }
+            }));
+        }
+        {
+            std::mutex m;
+            std::priority_queue<long> pq;
+            report("mutex + priority_queue", threads, run(threads, ops, [&m, &pq](int t, long n) {
+                for (long i = 0; i != n; ++i) {
+                    {
+                        std::lock_guard l(m);
+                        pq.push(i * 31 + t);
+                    }
+                    std::lock_guard l(m);
+                    if (!pq.empty())
+                        pq.pop();
+                }
+            }));
+        }
+        {
+            FlatCombining<std::priority_queue<long>> pq;
+            report("FlatCombining<priority_queue>", threads, run(threads, ops, [&pq](int t, long n) {
+                for (long i = 0; i != n; ++i) {
+                    pq.apply([i, t](auto& c) { c.push(i * 31 + t); });
+                    pq.apply([](auto& c) {
+                        if (!c.empty())
+                            c.pop();
+                    });
+                }
+            }));
+        }
+    }
+}
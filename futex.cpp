@@ -0,0 +1,116 @@
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <cstdio>
+#include <thread>
+#include <vector>
+
+#include "futex.hpp"
+
+using namespace utility;
+using namespace std::chrono_literals;
+
+/*
+The futex primitives under contention: a barrier reused for many phases, latches that nobody
+passes early, a semaphore that never lets in more threads than it has units, and an event count
+that loses no wake-up. Build with -O2 -pthread, or -fsanitize=thread.
+*/
+
+constexpr int num_threads = 6;
+
+// every thread sees what the others wrote in a phase once it passes the barrier closing it
+void barrier_reuse() {
+    constexpr int phases = 2000;
+    Barrier barrier(num_threads);
+    std::vector<std::atomic<int>> written(phases);
+    std::vector<std::thread> ts;
+    for (int t = 0; t != num_threads; ++t)
+        ts.emplace_back([&] {
+            for (int p = 0; p != phases; ++p) {
+                ++written[p];
+                barrier.arrive_and_wait();
+                assert(written[p] == num_threads);
+                assert(p + 1 == phases || written[p + 1] < num_threads);
+            }
+        });
+    for (auto& t: ts)
+        t.join();
+}
+
+void latch() {
+    for (int round = 0; round != 200; ++round) {
+        Latch start(1), done(num_threads);
+        std::atomic<int> arrived{0};
+        std::vector<std::thread> ts;
+        for (int t = 0; t != num_threads; ++t)
+            ts.emplace_back([&] {
+                start.wait();
+                ++arrived;
+                done.arrive_and_wait();
+                assert(arrived == num_threads);
+            });
+        assert(!done.try_wait());
+        start.count_down();
+        done.wait();
+        assert(arrived == num_threads);
+        for (auto& t: ts)
+            t.join();
+        // counting down more than remains leaves the latch open
+        Latch over(2);
+        over.count_down(5);
+        assert(over.try_wait());
+        over.count_down();
+        over.wait();
+    }
+}
+
+void semaphore() {
+    constexpr int units = 2;
+    Semaphore sem(units);
+    std::atomic<int> inside{0}, most{0};
+    std::vector<std::thread> ts;
+    for (int t = 0; t != num_threads; ++t)
+        ts.emplace_back([&] {
+            for (int i = 0; i != 5000; ++i) {
+                sem.acquire();
+                auto n = ++inside;
+                for (auto m = most.load(); n > m && !most.compare_exchange_weak(m, n););
+                --inside;
+                sem.release();
+            }
+        });
+    for (auto& t: ts)
+        t.join();
+    assert(most <= units);
+    for (int i = 0; i != units; ++i)
+        assert(sem.try_acquire());
+    auto before = std::chrono::steady_clock::now();
+    assert(!sem.try_acquire_for(10ms));
+    assert(std::chrono::steady_clock::now() - before >= 10ms);
+}
+
+// a consumer waiting for a counter to reach each value in turn is woken every time
+void event_count() {
+    constexpr int rounds = 20000;
+    EventCount ec;
+    std::atomic<int> value{0};
+    std::thread consumer([&] {
+        for (int i = 1; i <= rounds; ++i) {
+            ec.await([&] { return value.load() >= i; });
+            assert(value >= i);
+        }
+    });
+    for (int i = 1; i <= rounds; ++i) {
+        value.store(i);
+        ec.notify();
+    }
+    consumer.join();
+}
+
+int main() {
+    barrier_reuse();
+    latch();
+    semaphore();
+    event_count();
+    std::printf("ok\n");
+}
@@ -0,0 +1,328 @@
+#ifndef CONCURRENCY_FUTEX_H_
+#define CONCURRENCY_FUTEX_H_
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <cstdint>
+#include <thread>
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+namespace utility {
+    namespace detail {
+        constexpr int spin_count = 128;
+
+        inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+            _mm_pause();
+#else
+            std::this_thread::yield();
+#endif
+        }
+
+        // spins for a short while, returns whether pred() became true
+        template<typename Pred>
+        bool spin_until(Pred pred) {
+            for (int i = 0; i != spin_count; ++i) {
+                if (pred())
+                    return true;
+                cpu_relax();
+            }
+            return pred();
+        }
+
+        /*
+        Sleeps as long as *addr == expected, or until the deadline. May return spuriously.
+        Returns false on timeout. Without futexes it degrades to yielding.
+        A process_shared futex may be waited on and woken from different processes mapping the same
+        memory, a private one is cheaper for the kernel to look up.
+        */
+        template<typename Clock=std::chrono::steady_clock, typename Duration=typename Clock::duration>
+        bool futex_wait(const std::atomic<std::uint32_t>* addr, std::uint32_t expected,
+            const std::chrono::time_point<Clock, Duration>* deadline=nullptr, bool process_shared=false) {
+#ifdef __linux__
+            static_assert(sizeof(std::atomic<std::uint32_t>) == sizeof(std::uint32_t), "futex word");
+            timespec ts, *timeout = nullptr;
+            if (deadline) {
+                auto d = *deadline - Clock::now();
+                if (d <= d.zero())
+                    return false;
+                auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(d).count();
+                ts.tv_sec = ns / 1000000000;
+                ts.tv_nsec = ns % 1000000000;
+                timeout = &ts;
+            }
+            syscall(SYS_futex, addr, process_shared? FUTEX_WAIT: FUTEX_WAIT_PRIVATE, expected, timeout, nullptr, 0);
+            return !deadline || Clock::now() < *deadline;
+#else
+            (void)addr, (void)expected, (void)process_shared;
+            std::this_thread::yield();
+            return !deadline || Clock::now() < *deadline;
+#endif
+        }
+
+        inline void futex_wake(const std::atomic<std::uint32_t>* addr, int n, bool process_shared=false) {
+#ifdef __linux__
+            syscall(SYS_futex, addr, process_shared? FUTEX_WAKE: FUTEX_WAKE_PRIVATE, n, nullptr, nullptr, 0);
+#else
+            (void)addr, (void)n, (void)process_shared;
+#endif
+        }
+    }
+
+    /*
+    Event count (as in Folly and Dmitry Vyukov's design): a condition variable without a mutex.
+    A waiter announces itself with prepare_wait(), checks its condition again, then either calls
+    cancel_wait() or sleeps in commit_wait() until the next notify. The epoch and the number of
+    waiters share one word, so a notify with nobody waiting costs a fence and a load, never a syscall.
+    The notifier must publish its change (e.g., a push) before calling notify(); the seq_cst fence
+    there and the seq_cst RMW in prepare_wait() ensure that either the waiter sees the change or
+    the notifier sees the waiter.
+    A process_shared event count may be placed in memory shared between processes, see SharedMemoryQueue.
+    */
+    class EventCount {
+    public:
+        using Key = std::uint32_t;
+
+        explicit EventCount(bool process_shared=false): process_shared(process_shared) {}
+        EventCount(const EventCount&) = delete;
+        EventCount& operator=(const EventCount&) = delete;
+
+        void notify() { wake(1); }
+        void notify_all() { wake(INT_MAX); }
+
+        Key prepare_wait() {
+            return val.fetch_add(one_waiter) >> epoch_shift;
+        }
+        void cancel_wait() {
+            val.fetch_sub(one_waiter, std::memory_order_relaxed);
+        }
+        void commit_wait(Key key) {
+            wait_until(key, static_cast<const std::chrono::steady_clock::time_point*>(nullptr));
+        }
+        // returns false if timed out without a notify
+        template<typename Clock, typename Duration>
+        bool commit_wait_until(Key key, const std::chrono::time_point<Clock, Duration>& deadline) {
+            return wait_until(key, &deadline);
+        }
+
+        // blocks until pred() is true, pred() must only turn true along with a notify
+        template<typename Pred>
+        void await(Pred pred) {
+            if (detail::spin_until(pred))
+                return;
+            while (true) {
+                auto key = prepare_wait();
+                if (pred()) {
+                    cancel_wait();
+                    return;
+                }
+                commit_wait(key);
+                if (pred())
+                    return;
+            }
+        }
+    private:
+        static constexpr int epoch_shift = 32;
+        static constexpr std::uint64_t one_waiter = 1;
+        static constexpr std::uint64_t one_epoch = std::uint64_t(1) << epoch_shift;
+        static constexpr std::uint64_t waiter_mask = one_epoch - 1;
+
+        // the futex word is the epoch half of val
+        const std::atomic<std::uint32_t>* epoch() const {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+            return reinterpret_cast<const std::atomic<std::uint32_t>*>(&val) + 1;
+#else
+            return reinterpret_cast<const std::atomic<std::uint32_t>*>(&val);
+#endif
+        }
+        Key current() const {
+            return val.load(std::memory_order_acquire) >> epoch_shift;
+        }
+        void wake(int n) {
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (val.load(std::memory_order_relaxed) & waiter_mask) {
+                val.fetch_add(one_epoch, std::memory_order_release);
+                detail::futex_wake(epoch(), n, process_shared);
+            }
+        }
+        template<typename TimePoint>
+        bool wait_until(Key key, const TimePoint* deadline) {
+            bool notified = detail::spin_until([this, key] { return current() != key; });
+            while (!notified) {
+                if (!detail::futex_wait(epoch(), key, deadline, process_shared))
+                    break;
+                notified = current() != key;
+            }
+            notified = notified || current() != key;
+            val.fetch_sub(one_waiter, std::memory_order_relaxed);
+            return notified;
+        }
+
+        std::atomic<std::uint64_t> val{0};
+        const bool process_shared;
+    };
+
+    /*
+    Counting semaphore. The count and the number of sleepers share one word, so release() is a single
+    fetch_add unless somebody sleeps, and acquire() is a single CAS while the count is positive.
+    */
+    class Semaphore {
+    public:
+        explicit Semaphore(std::uint32_t initial=0): val(initial) {}
+        Semaphore(const Semaphore&) = delete;
+        Semaphore& operator=(const Semaphore&) = delete;
+
+        void release(std::uint32_t n=1) {
+            auto prev = val.fetch_add(n, std::memory_order_release);
+            if (prev >> sleeper_shift)
+                detail::futex_wake(count(), n < INT_MAX? int(n): INT_MAX);
+        }
+        bool try_acquire() {
+            auto v = val.load(std::memory_order_relaxed);
+            while (v & count_mask)
+                if (val.compare_exchange_weak(v, v - 1, std::memory_order_acquire, std::memory_order_relaxed))
+                    return true;
+            return false;
+        }
+        void acquire() {
+            acquire_until(static_cast<const std::chrono::steady_clock::time_point*>(nullptr));
+        }
+        template<typename Rep, typename Period>
+        bool try_acquire_for(const std::chrono::duration<Rep, Period>& d) {
+            return try_acquire_until(std::chrono::steady_clock::now() + d);
+        }
+        template<typename Clock, typename Duration>
+        bool try_acquire_until(const std::chrono::time_point<Clock, Duration>& deadline) {
+            return acquire_until(&deadline);
+        }
+    private:
+        static constexpr int sleeper_shift = 32;
+        static constexpr std::uint64_t one_sleeper = std::uint64_t(1) << sleeper_shift;
+        static constexpr std::uint64_t count_mask = one_sleeper - 1;
+
+        const std::atomic<std::uint32_t>* count() const {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+            return reinterpret_cast<const std::atomic<std::uint32_t>*>(&val);
+#else
+            return reinterpret_cast<const std::atomic<std::uint32_t>*>(&val) + 1;
+#endif
+        }
+        template<typename TimePoint>
+        bool acquire_until(const TimePoint* deadline);
+
+        std::atomic<std::uint64_t> val;
+    };
+
+    template<typename TimePoint>
+    bool Semaphore::acquire_until(const TimePoint* deadline) {
+        if (detail::spin_until([this] { return try_acquire(); }))
+            return true;
+        // take a unit or register as a sleeper in one step, so that release() cannot miss us
+        auto v = val.load(std::memory_order_relaxed);
+        while (!val.compare_exchange_weak(v, v & count_mask? v - 1: v + one_sleeper,
+            std::memory_order_acquire, std::memory_order_relaxed));
+        if (v & count_mask)
+            return true;
+        while (true) {
+            // woken or not, take a unit and unregister in one step if there is one
+            v = val.load(std::memory_order_relaxed);
+            while (v & count_mask)
+                if (val.compare_exchange_weak(v, v - 1 - one_sleeper,
+                    std::memory_order_acquire, std::memory_order_relaxed))
+                    return true;
+            if (!detail::futex_wait(count(), 0, deadline)) {
+                v = val.load(std::memory_order_relaxed);
+                while (!val.compare_exchange_weak(v, v & count_mask? v - 1 - one_sleeper: v - one_sleeper,
+                    std::memory_order_acquire, std::memory_order_relaxed));
+                return v & count_mask;
+            }
+        }
+    }
+
+    /*
+    Single-use latch. The high bit of the counter tells count_down() that somebody sleeps in wait(),
+    otherwise count_down() is a single compare-and-swap.
+    */
+    class Latch {
+    public:
+        explicit Latch(std::uint32_t expected): val(expected) {}
+        Latch(const Latch&) = delete;
+        Latch& operator=(const Latch&) = delete;
+
+        // counting down more than remains stops at zero, rather than borrowing from the sleeping bit
+        void count_down(std::uint32_t n=1) {
+            auto prev = val.load(std::memory_order_relaxed);
+            do {
+                if (!(prev & count_mask))
+                    return;
+            } while (!val.compare_exchange_weak(prev, prev - std::min(n, prev & count_mask),
+                std::memory_order_acq_rel, std::memory_order_relaxed));
+            if ((prev & count_mask) <= n && (prev & sleeping))
+                detail::futex_wake(&val, INT_MAX);
+        }
+        bool try_wait() const {
+            return !(val.load(std::memory_order_acquire) & count_mask);
+        }
+        void wait() const {
+            if (detail::spin_until([this] { return try_wait(); }))
+                return;
+            val.fetch_or(sleeping, std::memory_order_relaxed);
+            while (true) {
+                auto v = val.load(std::memory_order_acquire);
+                if (!(v & count_mask))
+                    return;
+                detail::futex_wait(&val, v);
+            }
+        }
+        void arrive_and_wait(std::uint32_t n=1) {
+            count_down(n);
+            wait();
+        }
+    private:
+        static constexpr std::uint32_t sleeping = std::uint32_t(1) << 31;
+        static constexpr std::uint32_t count_mask = sleeping - 1;
+
+        mutable std::atomic<std::uint32_t> val;
+    };
+
+    /*
+    Reusable barrier for a fixed number of threads. Arriving is a single fetch_add; the last thread
+    to arrive starts the next phase and wakes the others through an EventCount.
+    */
+    class Barrier {
+    public:
+        explicit Barrier(std::uint32_t expected): expected(expected) {}
+        Barrier(const Barrier&) = delete;
+        Barrier& operator=(const Barrier&) = delete;
+
+        void arrive_and_wait() {
+            auto ph = phase.load(std::memory_order_acquire);
+            if (arrived.fetch_add(1, std::memory_order_acq_rel) + 1 == expected) {
+                // nobody arrives for the next phase before it starts
+                arrived.store(0, std::memory_order_relaxed);
+                phase.store(ph + 1, std::memory_order_release);
+                ec.notify_all();
+            }
+            else
+                ec.await([this, ph] { return phase.load(std::memory_order_acquire) != ph; });
+        }
+    private:
+        const std::uint32_t expected;
+        std::atomic<std::uint32_t> arrived{0};
+        std::atomic<std::uint32_t> phase{0};
+        EventCount ec;
+    };
+}
+
+#endif
@@ -0,0 +1,137 @@
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <list>
+#include <thread>
+#include <vector>
+
+#include "cache_line.hpp"
+#include "multi_queue.hpp"
+#include "queue.hpp"
+#include "stack.hpp"
+#include "thread_pool.hpp"
+
+using namespace utility;
+
+/*
+Producer/consumer throughput of the containers whose members are laid out against false sharing.
+The static_asserts fail the build if a hot member loses its alignment; the packed and padded
+counters show what the padding is worth on this machine, a padded container falling far behind
+them points at a layout regression. Build with -O2 -pthread, optionally pass the number of
+operations per thread.
+*/
+
+static_assert(alignof(LockBasedQueue<int, std::list<int>>) >= cache_line_size);
+static_assert(sizeof(LockBasedQueue<int, std::list<int>>) >= 3 * cache_line_size,
+    "head, tail and waiters of the two-lock queue must be on lines of their own");
+static_assert(alignof(LockBasedQueue<int, std::deque<int>>) >= cache_line_size);
+static_assert(alignof(LockFreeStack<int, TaggedPtr<int>>) >= cache_line_size);
+static_assert(alignof(LockFreeStack<int, AtomicSharedPtr<int>>) >= cache_line_size);
+static_assert(alignof(ThreadPool<void()>) >= cache_line_size);
+static_assert(sizeof(ThreadPool<void()>) >= 2 * cache_line_size,
+    "done must not share a line with the counters updated around every task");
+
+struct Packed {
+    std::atomic<long> a{0};
+    std::atomic<long> b{0};
+};
+struct Padded {
+    alignas(cache_line_size) std::atomic<long> a{0};
+    alignas(cache_line_size) std::atomic<long> b{0};
+};
+
+// runs producer(i) on one group of threads and consumer(i) on another, returns operations per second
+template<typename Producer, typename Consumer>
+double run(int producers, int consumers, long ops, Producer producer, Consumer consumer) {
+    std::atomic<int> ready{0};
+    std::atomic<bool> go{false};
+    std::vector<std::thread> threads;
+    auto start_when_ready = [&](auto f) {
+        return [&ready, &go, f] {
+            ready.fetch_add(1);
+            while (!go.load())
+                std::this_thread::yield();
+            f();
+        };
+    };
+    for (auto i = 0; i != producers; ++i)
+        threads.emplace_back(start_when_ready([&producer, ops] { producer(ops); }));
+    for (auto i = 0; i != consumers; ++i)
+        threads.emplace_back(start_when_ready([&consumer, ops] { consumer(ops); }));
+    while (ready.load() != producers + consumers)
+        std::this_thread::yield();
+    auto start = std::chrono::steady_clock::now();
+    go.store(true);
+    for (auto& t: threads)
+        t.join();
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    return ops * (producers + consumers) / elapsed.count();
+}
+
+void report(const char* name, double ops_per_second) {
+    std::printf("%-40s %12.0f ops/s\n", name, ops_per_second);
+}
+
+template<typename Counters>
+double counters(long ops) {
+    Counters c;
+    return run(1, 1, ops,
+        [&c](long n) { for (long i = 0; i != n; ++i) c.a.fetch_add(1, std::memory_order_relaxed); },
+        [&c](long n) { for (long i = 0; i != n; ++i) c.b.fetch_add(1, std::memory_order_relaxed); });
+}
+
+template<typename Queue>
+double queue(long ops) {
+    Queue q;
+    return run(1, 1, ops,
+        [&q](long n) { for (long i = 0; i != n; ++i) q.push(i); },
+        [&q](long n) { for (long i = 0; i != n; ++i) q.pop(); });
+}
+
+// each thread pushes and then pops, so head is contended by both groups
+template<typename Stack>
+double stack(long ops) {
+    Stack s;
+    auto f = [&s](long n) {
+        int v;
+        for (long i = 0; i != n; ++i) {
+            s.push(int(i));
+            while (!s.pop(v));
+        }
+    };
+    return run(2, 2, ops, f, f);
+}
+
+double multi_queue(long ops) {
+    MultiQueue<long> q(8);
+    return run(4, 4, ops,
+        [&q](long n) { for (long i = 0; i != n; ++i) q.push(i); },
+        [&q](long n) { long v; for (long i = 0; i != n; ++i) q.pop(v); });
+}
+
+double thread_pool(long ops) {
+    ThreadPool<void()> pool(4);
+    std::atomic<long> done{0};
+    return run(2, 0, ops, [&pool, &done](long n) {
+        std::vector<std::future<void>> futures;
+        futures.reserve(n);
+        for (long i = 0; i != n; ++i)
+            futures.push_back(pool.submit([&done] { done.fetch_add(1, std::memory_order_relaxed); }));
+        for (auto& f: futures)
+            pool.wait(f);
+    }, [](long) {});
+}
+
+int main(int argc, char* argv[]) {
+    long ops = argc > 1? std::atol(argv[1]): 1000000;
+    std::printf("cache_line_size = %zu\n", cache_line_size);
+    report("counters, packed", counters<Packed>(ops * 10));
+    report("counters, padded", counters<Padded>(ops * 10));
+    report("LockBasedQueue<list>, 1P1C", queue<LockBasedQueue<long, std::list<long>>>(ops));
+    report("LockBasedQueue<deque>, 1P1C", queue<LockBasedQueue<long, std::deque<long>>>(ops));
+    report("LockFreeStack<TaggedPtr>, 4 threads", stack<LockFreeStack<int, TaggedPtr<int>>>(ops));
+    report("MultiQueue, 4P4C", multi_queue(ops));
+    report("ThreadPool, 2 submitters", thread_pool(ops / 10));
+}
@@ -4,12 +4,21 @@
 #include <mutex>
 #include <memory>
 #include <functional>
+#include <memory_resource>
+
+#include "memory_resource.hpp"
 
 namespace utility{
+    /*
+    Nodes and data are allocated from the memory_resource of the allocator, which must be thread-safe
+    if the list is shared between threads, see ThreadCachingResource.
+    */
     template<typename T>
     class LockBasedList {
     public:
-        LockBasedList() {}
+        using allocator_type = std::pmr::polymorphic_allocator<T>;
+
+        explicit LockBasedList(const allocator_type& a={}): resource(a.resource()) {}
         LockBasedList(const LockBasedList&) = delete;
         LockBasedList& operator=(const LockBasedList&) = delete;
         ~LockBasedList();
@@ -39,29 +48,34 @@ namespace utility{
         template<typename Pred>
         void remove_if(Pred);
 
+        allocator_type get_allocator() const { return allocator_type(resource); }
     private:
         struct Node {
             Node() {}
-            Node(const T& d, std::unique_ptr<Node>&& p={}): 
-                data(std::make_shared<T>(d)), next(std::move(p)) {}
-            Node(T&& d, std::unique_ptr<Node>&& p={}): 
-                data(std::make_shared<T>(std::move(d))), next(std::move(p)) {}
-            std::mutex m;
+            explicit Node(std::shared_ptr<T>&& d): data(std::move(d)) {}
+            mutable std::mutex m;
             std::shared_ptr<T> data;
-            std::unique_ptr<Node> next;
+            PmrUniquePtr<Node> next;
         };
+        // the control block is allocated together with the data
+        template<typename... Args>
+        std::shared_ptr<T> make_data(Args&&... args) const {
+            return std::allocate_shared<T>(allocator_type(resource), std::forward<Args>(args)...);
+        }
+
+        std::pmr::memory_resource* const resource;
         Node head;
         // Node* tail;
     };
     
     template<typename T>
     LockBasedList<T>::~LockBasedList<T>() {
-        remove_if([](const Node&){ return true;});
+        remove_if([](const T&){ return true;});
     }
 
     template<typename T>
     std::shared_ptr<T> LockBasedList<T>::front() const {
-        std::lock_guard l(head);
+        std::lock_guard l(head.m);
         if (head.next)
             return head.next->data;
         else
@@ -94,7 +108,7 @@ namespace utility{
 
     template<typename T>
     void LockBasedList<T>::push_front(const T& data) {
-        auto new_node = std::make_unique<Node>(data);
+        auto new_node = make_pmr_unique<Node>(resource, make_data(data));
         std::lock_guard l(head.m);
         new_node->next = std::move(head.next);
         head.next = std::move(new_node);
@@ -105,7 +119,7 @@ namespace utility{
 
     template<typename T>
     void LockBasedList<T>::push_front(T&& data) {
-        auto new_node = std::make_unique<Node>(std::move(data));
+        auto new_node = make_pmr_unique<Node>(resource, make_data(std::move(data)));
         std::lock_guard l(head.m);
         new_node->next = std::move(head.next);
         head.next = std::move(new_node);
@@ -140,7 +154,7 @@ namespace utility{
             while ((p = p->next.get())) {   // this is safe as we've already locked p->m
                 l = std::unique_lock(p->m);
                 if (pred(data, *p->data)) {
-                    p->data.reset(new T(data));
+                    p->data = make_data(data);
                     return;
                 }
             }
@@ -157,7 +171,7 @@ namespace utility{
             while ((p = p->next.get())) {   // this is safe as we've already locked p->m
                 l = std::unique_lock(p->m);
                 if (pred(data, *p->data)) {
-                    p->data.reset(new T(std::move(data)));
+                    p->data = make_data(std::move(data));
                     return;
                 }
             }
@@ -173,6 +187,8 @@ namespace utility{
         while (auto p2 = p->next.get()) {   // this is safe as we've already locked p->m
             std::unique_lock l2(p2->m);
             if (pred(*p2->data)) {
+                // p2 must outlive the lock on its mutex
+                auto removed = std::move(p->next);
                 p->next = std::move(p2->next);
                 l2.unlock();
             }
@@ -0,0 +1,94 @@
+#include <atomic>
+#include <cassert>
+#include <cstdio>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "lock_free_list.hpp"
+
+using namespace utility;
+
+/*
+Removals racing with pushes, with each other and with readers, and insert_if() racing with itself and
+with removals: nothing survives that should be removed, nothing is lost that should stay, and no key
+is ever in the list twice. Build with -O2 -pthread, or -fsanitize=thread (or address, for the
+reclamation of removed nodes).
+*/
+
+constexpr int num_threads = 4;
+constexpr int per_thread = 5000;
+
+void remove_while_pushing() {
+    LockFreeList<int> list;
+    std::atomic<int> pushing{num_threads};
+    std::vector<std::thread> ts;
+    for (int t = 0; t != num_threads; ++t)
+        ts.emplace_back([&, t] {
+            for (int i = 0; i != per_thread; ++i)
+                list.push_front(i * num_threads + t);
+            --pushing;
+        });
+    // two removers race on the same elements
+    for (int r = 0; r != 2; ++r)
+        ts.emplace_back([&] {
+            while (pushing)
+                list.remove_if([](int x) { return x % 2 == 0; });
+        });
+    ts.emplace_back([&] {
+        while (pushing) {
+            list.for_each([](int& x) { assert(x >= 0 && x < num_threads * per_thread); });
+            auto p = list.find_if([](int x) { return x % 2; });
+            assert(!p || *p % 2);
+        }
+    });
+    for (auto& t: ts)
+        t.join();
+    list.remove_if([](int x) { return x % 2 == 0; });
+    std::vector<int> seen(num_threads * per_thread);
+    list.for_each([&](int& x) { ++seen[x]; });
+    for (std::size_t x = 0; x != seen.size(); ++x)
+        assert(seen[x] == int(x % 2));
+}
+
+// (key, writer) pairs, equal when the keys are
+void insert_while_removing() {
+    constexpr int num_keys = 100;
+    using Item = std::pair<int, int>;
+    auto same_key = [](const Item& a, const Item& b) { return a.first == b.first; };
+    LockFreeList<Item> list;
+    std::atomic<int> inserting{num_threads};
+    std::vector<std::thread> ts;
+    for (int t = 0; t != num_threads; ++t)
+        ts.emplace_back([&, t] {
+            for (int i = 0; i != per_thread; ++i)
+                list.insert_if(Item(i % num_keys, t), same_key);
+            --inserting;
+        });
+    ts.emplace_back([&] {
+        while (inserting)
+            list.remove_if([](const Item& x) { return x.first % 10 == 0; });
+    });
+    ts.emplace_back([&] {
+        while (inserting) {
+            std::vector<int> seen(num_keys);
+            list.for_each([&](Item& x) { ++seen[x.first]; });
+            // a walk may pass a removed node of a key after the node pushed again for it,
+            // but two nodes of a key are never in the list at once
+            for (auto n: seen)
+                assert(n <= 2);
+        }
+    });
+    for (auto& t: ts)
+        t.join();
+    std::vector<int> seen(num_keys);
+    list.for_each([&](Item& x) { ++seen[x.first]; });
+    for (int k = 0; k != num_keys; ++k)
+        assert(seen[k] == 1 || (k % 10 == 0 && seen[k] == 0));
+}
+
+int main() {
+    remove_while_pushing();
+    insert_while_removing();
+    std::printf("ok\n");
+}
@@ -0,0 +1,285 @@
+#ifndef CONCURRENCY_LOCK_FREE_LIST_H_
+#define CONCURRENCY_LOCK_FREE_LIST_H_
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <memory_resource>
+#include <utility>
+
+#include "memory_resource.hpp"
+
+namespace utility {
+    /*
+    Lock-free counterpart of LockBasedList with the same operations, after the lists of Harris (2001)
+    and Michael (2002): a node is logically removed by marking the lowest bit of its next pointer and
+    physically unlinked by remove_if(), which restarts from the head whenever its unlinking CAS fails.
+    No operation waits for another one, so a slow f in for_each() only holds up itself.
+    insert_if() replaces the data of the first element matching pred(const T& new, const T& old),
+    otherwise pushes a new one, retrying as long as the head moves meanwhile, so two of them never
+    both push equal elements. The data of an element is swapped atomically, a thread holding the old
+    shared_ptr keeps the old data.
+    Unlinked nodes and replaced data are reclaimed as in LockFreeSkipList: they are put in a pending
+    list that is only deleted when no other thread is inside the list.
+    Predicates get a const T& and may be called more than once for the same element. f in for_each()
+    gets a T& that other threads may be reading as well, so it must synchronize any write itself.
+    Nodes and data are allocated from the memory_resource of the allocator, which must be thread-safe,
+    see ThreadCachingResource.
+    */
+    template<typename T>
+    class LockFreeList {
+    public:
+        using allocator_type = std::pmr::polymorphic_allocator<T>;
+
+        explicit LockFreeList(const allocator_type& a={}): resource(a.resource()) {}
+        LockFreeList(const LockFreeList&) = delete;
+        LockFreeList& operator=(const LockFreeList&) = delete;
+        ~LockFreeList();
+
+        std::shared_ptr<T> front() const;
+        template<typename Pred>
+        std::shared_ptr<T> find_if(Pred) const;
+
+        template<typename Func>
+        void for_each(Func) const;
+
+        void push_front(const T& data) { push_node(make_data(data)); }
+        void push_front(T&& data) { push_node(make_data(std::move(data))); }
+        template<typename Pred=std::equal_to<>>
+        void insert_if(const T& data, Pred pred=Pred()) { insert_node(make_data(data), pred); }
+        template<typename Pred=std::equal_to<>>
+        void insert_if(T&& data, Pred pred=Pred()) { insert_node(make_data(std::move(data)), pred); }
+        template<typename Pred>
+        void remove_if(Pred);
+
+        allocator_type get_allocator() const { return allocator_type(resource); }
+    private:
+        // anything waiting in the pending list
+        struct Retired {
+            explicit Retired(void (*destroy)(Retired*, std::pmr::memory_resource*)): destroy(destroy) {}
+            void (*destroy)(Retired*, std::pmr::memory_resource*);
+            Retired* next_pending = nullptr;
+        };
+        struct Value: Retired {
+            explicit Value(std::shared_ptr<T>&& d): Retired(&destroy_value), data(std::move(d)) {}
+            std::shared_ptr<T> data;
+        };
+        struct Node: Retired {
+            explicit Node(std::shared_ptr<T>&& d): Retired(&destroy_node), first(std::move(d)) {}
+            Value first;    // saves an allocation until the data is replaced
+            std::atomic<Value*> value{&first};
+            std::atomic<Node*> next{nullptr};
+        };
+
+        // RAII counter of threads inside the list, see Listing 7.5
+        class Guard {
+        public:
+            explicit Guard(const LockFreeList* l): list(l) { ++list->active; }
+            Guard(const Guard&) = delete;
+            Guard& operator=(const Guard&) = delete;
+            ~Guard() { list->leave(); }
+        private:
+            const LockFreeList* list;
+        };
+
+        static bool is_marked(Node* p) {
+            return reinterpret_cast<std::uintptr_t>(p) & 1;
+        }
+        static Node* marked(Node* p) {
+            return reinterpret_cast<Node*>(reinterpret_cast<std::uintptr_t>(p) | 1);
+        }
+        static Node* unmarked(Node* p) {
+            return reinterpret_cast<Node*>(reinterpret_cast<std::uintptr_t>(p) & ~std::uintptr_t(1));
+        }
+        // nullptr stands for the head
+        std::atomic<Node*>& next_of(Node* prev) const {
+            return prev? prev->next: head;
+        }
+        // the first node from p on that is not removed
+        static Node* skip_removed(Node* p) {
+            Node* succ;
+            while (p && is_marked(succ = p->next.load()))
+                p = unmarked(succ);
+            return p;
+        }
+        static const std::shared_ptr<T>& data_of(Node* p) {
+            return p->value.load()->data;
+        }
+        template<typename... Args>
+        std::shared_ptr<T> make_data(Args&&... args) const {
+            return std::allocate_shared<T>(allocator_type(resource), std::forward<Args>(args)...);
+        }
+
+        void push_node(std::shared_ptr<T>&&);
+        template<typename Pred>
+        void insert_node(std::shared_ptr<T>&&, Pred&);
+        void replace(Node*, std::shared_ptr<T>&&);
+        static void destroy_value(Retired*, std::pmr::memory_resource*);
+        static void destroy_node(Retired*, std::pmr::memory_resource*);
+        void retire(Retired* r) const { chain_pending(r, r); }
+        void leave() const;
+        void chain_pending(Retired* first, Retired* last) const;
+        void delete_pending(Retired*) const;
+
+        std::pmr::memory_resource* const resource;
+        mutable std::atomic<Node*> head{nullptr};
+        mutable std::atomic<unsigned> active{0};
+        mutable std::atomic<Retired*> to_be_deleted{nullptr};
+    };
+
+    template<typename T>
+    LockFreeList<T>::~LockFreeList() {
+        // nodes still linked, marked or not, are not in the pending list
+        auto p = head.load(std::memory_order_relaxed);
+        while (p) {
+            auto next = unmarked(p->next.load(std::memory_order_relaxed));
+            destroy_node(p, resource);
+            p = next;
+        }
+        delete_pending(to_be_deleted.load(std::memory_order_relaxed));
+    }
+
+    template<typename T>
+    std::shared_ptr<T> LockFreeList<T>::front() const {
+        Guard g(this);
+        auto p = skip_removed(head.load());
+        return p? data_of(p): nullptr;
+    }
+
+    template<typename T>
+    template<typename Pred>
+    std::shared_ptr<T> LockFreeList<T>::find_if(Pred pred) const {
+        Guard g(this);
+        for (auto p = skip_removed(head.load()); p; p = skip_removed(unmarked(p->next.load()))) {
+            auto& d = data_of(p);
+            if (pred(static_cast<const T&>(*d)))
+                return d;
+        }
+        return {};
+    }
+
+    template<typename T>
+    template<typename Func>
+    void LockFreeList<T>::for_each(Func f) const {
+        Guard g(this);
+        for (auto p = skip_removed(head.load()); p; p = skip_removed(unmarked(p->next.load())))
+            f(*data_of(p));
+    }
+
+    template<typename T>
+    void LockFreeList<T>::push_node(std::shared_ptr<T>&& data) {
+        auto node = make_pmr_unique<Node>(resource, std::move(data));
+        auto h = head.load();
+        do
+            node->next.store(h, std::memory_order_relaxed);
+        while (!head.compare_exchange_weak(h, node.get()));
+        node.release();
+    }
+
+    template<typename T>
+    template<typename Pred>
+    void LockFreeList<T>::insert_node(std::shared_ptr<T>&& data, Pred& pred) {
+        Guard g(this);
+        PmrUniquePtr<Node> node;
+        auto h = head.load();
+        while (true) {
+            for (auto p = skip_removed(h); p; p = skip_removed(unmarked(p->next.load())))
+                if (pred(static_cast<const T&>(*data), static_cast<const T&>(*data_of(p)))) {
+                    replace(p, std::move(data));
+                    return;
+                }
+            if (!node)
+                node = make_pmr_unique<Node>(resource, std::shared_ptr<T>(data));
+            node->next.store(h, std::memory_order_relaxed);
+            // a failed CAS reloads h, and the elements pushed meanwhile are checked as well
+            if (head.compare_exchange_weak(h, node.get()))
+                break;
+        }
+        node.release();
+    }
+
+    template<typename T>
+    void LockFreeList<T>::replace(Node* p, std::shared_ptr<T>&& data) {
+        auto old = p->value.exchange(make_pmr_unique<Value>(resource, std::move(data)).release());
+        if (old != &p->first)
+            retire(old);
+    }
+
+    template<typename T>
+    template<typename Pred>
+    void LockFreeList<T>::remove_if(Pred pred) {
+        Guard g(this);
+    retry:
+        Node* prev = nullptr;
+        auto curr = head.load();
+        while (curr) {
+            auto succ = curr->next.load();
+            if (!is_marked(succ) && pred(static_cast<const T&>(*data_of(curr)))) {
+                // whoever marks first removes the element, either way it is unlinked below
+                while (!is_marked(succ) && !curr->next.compare_exchange_weak(succ, marked(succ)));
+                succ = marked(succ);
+            }
+            if (is_marked(succ)) {
+                // fails if prev has been removed or unlinked curr meanwhile
+                auto expected = curr;
+                if (!next_of(prev).compare_exchange_strong(expected, unmarked(succ)))
+                    goto retry;
+                retire(curr);
+                curr = unmarked(succ);
+            }
+            else {
+                prev = curr;
+                curr = succ;
+            }
+        }
+    }
+
+    template<typename T>
+    void LockFreeList<T>::destroy_value(Retired* r, std::pmr::memory_resource* resource) {
+        detail::PmrDelete<Value>{resource}(static_cast<Value*>(r));
+    }
+
+    template<typename T>
+    void LockFreeList<T>::destroy_node(Retired* r, std::pmr::memory_resource* resource) {
+        auto node = static_cast<Node*>(r);
+        auto v = node->value.load(std::memory_order_relaxed);
+        if (v != &node->first)
+            destroy_value(v, resource);
+        detail::PmrDelete<Node>{resource}(node);
+    }
+
+    template<typename T>
+    void LockFreeList<T>::leave() const {
+        if (active.load() == 1) {
+            auto pending = to_be_deleted.exchange(nullptr);
+            if (!--active)
+                delete_pending(pending);
+            else if (pending) {
+                auto last = pending;
+                while (last->next_pending)
+                    last = last->next_pending;
+                chain_pending(pending, last);
+            }
+        }
+        else
+            --active;
+    }
+
+    template<typename T>
+    void LockFreeList<T>::chain_pending(Retired* first, Retired* last) const {
+        last->next_pending = to_be_deleted.load();
+        while (!to_be_deleted.compare_exchange_weak(last->next_pending, first));
+    }
+
+    template<typename T>
+    void LockFreeList<T>::delete_pending(Retired* r) const {
+        while (r) {
+            auto next = r->next_pending;
+            r->destroy(r, resource);
+            r = next;
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,123 @@
+#include <atomic>
+#include <cassert>
+#include <cstdio>
+#include <thread>
+#include <vector>
+
+#include "map.hpp"
+#include "thread_pool.hpp"
+
+using namespace utility;
+
+/*
+Threads counting keys with the single-pass operations of LockBasedMap must lose no update, and
+iterations running along with writers must see every key present throughout, each value whole.
+Build with -O2 -pthread, or -fsanitize=thread.
+*/
+
+constexpr int num_threads = 4;
+constexpr int num_keys = 100;
+constexpr int per_thread = 20000;
+
+void counting() {
+    LockBasedMap<int, long> counts;
+    std::atomic<int> inserted{0};
+    std::vector<std::thread> ts;
+    for (int t = 0; t != num_threads; ++t)
+        ts.emplace_back([&, t] {
+            for (int i = 0; i != per_thread; ++i) {
+                auto k = (i + t) % num_keys;
+                switch (i % 3) {
+                case 0:
+                    if (counts.insert_or_update(k, 1L, [](long& n, long d) { n += d; }))
+                        ++inserted;
+                    break;
+                case 1:
+                    if (counts.try_emplace(k, 1L))
+                        ++inserted;
+                    else
+                        assert(counts.update(k, [](long& n) { ++n; }));
+                    break;
+                default:
+                    if (!counts.update(k, [](long& n) { ++n; })) {
+                        if (counts.try_emplace(k, 1L))
+                            ++inserted;
+                        else
+                            counts.update(k, [](long& n) { ++n; });
+                    }
+                }
+            }
+        });
+    for (auto& t: ts)
+        t.join();
+    // every key is inserted once and then only updated
+    assert(inserted == num_keys);
+    long total = 0;
+    for (int k = 0; k != num_keys; ++k)
+        total += counts.at(k);
+    assert(total == long(num_threads) * per_thread);
+    // erase_if only erases when the predicate holds
+    assert(!counts.erase_if(0, [](long n) { return n < 0; }) && counts.at(0, -1) != -1);
+    assert(counts.erase_if(0, [](long n) { return n > 0; }) && counts.at(0, -1) == -1);
+}
+
+// a value and its complement, written together under the bucket lock
+struct Checked {
+    long value = 0, check = ~0L;
+    void set(long v) {
+        value = v;
+        check = ~v;
+    }
+    bool whole() const { return check == ~value; }
+};
+
+void iteration() {
+    constexpr int stable = 500;
+    LockBasedMap<int, Checked> map;
+    for (int k = 0; k != stable; ++k)
+        map.try_emplace(k);
+    std::atomic<bool> writing{true};
+    std::vector<std::thread> writers;
+    for (int t = 0; t != 2; ++t)
+        writers.emplace_back([&, t] {
+            for (long i = 0; writing; ++i) {
+                map.update(int(i % stable), [i](Checked& c) { c.set(i); });
+                // keys from stable on come and go
+                auto k = stable + int(i % 100) * 2 + t;
+                if (i % 2)
+                    map.erase(k);
+                else
+                    map.try_emplace(k);
+            }
+        });
+    ThreadPool<void()> pool(2);
+    for (int round = 0; round != 50; ++round) {
+        std::atomic<int> seen{0};
+        map.for_each([&](int k, const Checked& c) {
+            assert(c.whole());
+            seen += k < stable;
+        });
+        assert(seen == stable);
+        seen = 0;
+        map.parallel_for_each(pool, [&](int k, const Checked& c) {
+            assert(c.whole());
+            seen += k < stable;
+        }, 4);
+        assert(seen == stable);
+        int in_snapshot = 0;
+        for (auto& [k, c]: map.snapshot()) {
+            assert(c.whole());
+            in_snapshot += k < stable;
+        }
+        assert(in_snapshot == stable);
+    }
+    writing = false;
+    for (auto& t: writers)
+        t.join();
+}
+
+int main() {
+    counting();
+    iteration();
+    std::printf("ok\n");
+}
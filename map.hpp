@@ -1,55 +1,213 @@
 #ifndef CONCURRENCY_THREADSAFE_MAP_H_
 #define CONCURRENCY_THREADSAFE_MAP_H_
 
+#include <algorithm>
+#include <iterator>
+#include <functional>
+#include <future>
+#include <list>
 #include <vector>
 #include <utility>
 #include <mutex>
 #include <shared_mutex>
 #include <memory>
-#include "list.hpp"
+#include <memory_resource>
 
 namespace utility{
+    /*
+    Each bucket is a list guarded by one shared_mutex as in Listing 6.11, so that every operation
+    on a key, including the read-modify-write ones, is a single traversal under a single lock.
+    The elements are allocated from the memory_resource of the allocator, which must be thread-safe,
+    see ThreadCachingResource.
+    */
     template<typename Key, typename Value, typename Hash=std::hash<Key>>
     class LockBasedMap {
         class Bucket {
             using KVPair = std::pair<Key, Value>;
-            using DataType = LockBasedList<KVPair>;
+            using DataType = std::pmr::list<KVPair>;
         public:
+            explicit Bucket(std::pmr::memory_resource* r): data(r) {}
             Value at(const Key& k, const Value& v= {}) const {
-                auto p = data.find_if([&k](const KVPair& d) {return d.first == k;});
-                return p?p->second: v;
+                std::shared_lock l(m);
+                auto p = find(k);
+                return p != data.end()? p->second: v;
             }
-            void insert_or_assign(const Key& k, Value&& v) {
-                data.remove_if([&k](const KVPair& d) { return d.first == k;});
-                data.push_front({k, std::forward<Value>(v)});
+            template<typename V>
+            void insert_or_assign(const Key& k, V&& v) {
+                std::unique_lock l(m);
+                auto p = find(k);
+                if (p != data.end())
+                    p->second = std::forward<V>(v);
+                else
+                    data.emplace_front(k, std::forward<V>(v));
             }
-            void erase(const Key& k) {
-                data.remove_if([&k](const KVPair& d) { return d.first == k;});
+            template<typename Func>
+            bool update(const Key& k, Func& f) {
+                std::unique_lock l(m);
+                auto p = find(k);
+                if (p == data.end())
+                    return false;
+                f(p->second);
+                return true;
+            }
+            template<typename... Args>
+            bool try_emplace(const Key& k, Args&&... args) {
+                std::unique_lock l(m);
+                if (find(k) != data.end())
+                    return false;
+                data.emplace_front(std::piecewise_construct, std::forward_as_tuple(k),
+                    std::forward_as_tuple(std::forward<Args>(args)...));
+                return true;
+            }
+            template<typename V, typename Merge>
+            bool insert_or_update(const Key& k, V&& v, Merge& merge) {
+                std::unique_lock l(m);
+                auto p = find(k);
+                if (p != data.end()) {
+                    merge(p->second, std::forward<V>(v));
+                    return false;
+                }
+                data.emplace_front(k, std::forward<V>(v));
+                return true;
+            }
+            template<typename Pred>
+            bool erase_if(const Key& k, Pred& pred) {
+                std::unique_lock l(m);
+                auto p = find(k);
+                if (p == data.end() || !pred(static_cast<const Value&>(p->second)))
+                    return false;
+                data.erase(p);
+                return true;
+            }
+            template<typename Func>
+            void for_each(Func& f) const {
+                std::shared_lock l(m);
+                for (auto& d: data)
+                    f(static_cast<const Key&>(d.first), static_cast<const Value&>(d.second));
+            }
+            template<typename OutputIt>
+            OutputIt copy(OutputIt out) const {
+                std::shared_lock l(m);
+                return std::copy(data.begin(), data.end(), out);
             }
         private:
-            // no mutex for bucket as the list is thread safe
+            typename DataType::iterator find(const Key& k) {
+                return std::find_if(data.begin(), data.end(), [&k](const KVPair& d) { return d.first == k; });
+            }
+            typename DataType::const_iterator find(const Key& k) const {
+                return std::find_if(data.begin(), data.end(), [&k](const KVPair& d) { return d.first == k; });
+            }
             DataType data;
+            mutable std::shared_mutex m;
         };
     public:
-        Value at(const Key& k, const Value& v= {}) {
+        using allocator_type = std::pmr::polymorphic_allocator<std::pair<Key, Value>>;
+
+        // a prime number of buckets spreads poor hashes better
+        explicit LockBasedMap(std::size_t num_buckets=19, const Hash& hasher=Hash(),
+            const allocator_type& a={}):
+            buckets(num_buckets? num_buckets: 1), hasher(hasher), resource(a.resource()) {
+            for (auto& b: buckets)
+                b.reset(new Bucket(resource));
+        }
+        LockBasedMap(const LockBasedMap&) = delete;
+        LockBasedMap& operator=(const LockBasedMap&) = delete;
+
+        Value at(const Key& k, const Value& v= {}) const {
             return get_bucket(k).at(k, v);
         }
+        void insert_or_assign(const Key& k, const Value& v) {
+            get_bucket(k).insert_or_assign(k, v);
+        }
         void insert_or_assign(const Key& k, Value&& v) {
-            return get_bucket(k).insert_or_assign(k, std::forward<Value>(v));
+            get_bucket(k).insert_or_assign(k, std::move(v));
+        }
+        // calls f(Value&) under the bucket lock if k is present, returns whether it is
+        template<typename Func>
+        bool update(const Key& k, Func f) {
+            return get_bucket(k).update(k, f);
+        }
+        // constructs the value from args if k is absent, returns whether it was inserted
+        template<typename... Args>
+        bool try_emplace(const Key& k, Args&&... args) {
+            return get_bucket(k).try_emplace(k, std::forward<Args>(args)...);
+        }
+        // inserts v if k is absent, otherwise calls merge(Value& current, v) under the bucket lock,
+        // e.g., [](auto& sum, int n) { sum += n; }. Returns whether v was inserted
+        template<typename V, typename Merge>
+        bool insert_or_update(const Key& k, V&& v, Merge merge) {
+            return get_bucket(k).insert_or_update(k, std::forward<V>(v), merge);
         }
         void erase(const Key& k) {
-            return get_buecket(k).erase(k);
+            erase_if(k, [](const Value&) { return true; });
+        }
+        // erases k if pred(const Value&) holds, returns whether it was erased
+        template<typename Pred>
+        bool erase_if(const Key& k, Pred pred) {
+            return get_bucket(k).erase_if(k, pred);
+        }
+
+        /*
+        Iteration is weakly consistent: buckets are visited one at a time under a shared lock, so
+        writers are only held up on the bucket being visited. An element inserted or erased during
+        the iteration may or may not be seen, a value updated is seen either before or after the update.
+        f(const Key&, const Value&) runs under the bucket lock, so keep it short.
+        */
+        template<typename Func>
+        void for_each(Func f) const {
+            for (auto& b: buckets)
+                b->for_each(f);
         }
+        // fans out ranges of buckets_per_task buckets to pool, a ThreadPool<void()>, and returns when
+        // they are done, running tasks itself meanwhile. Rethrows the first exception thrown by f
+        template<typename Pool, typename Func>
+        void parallel_for_each(Pool& pool, Func f, std::size_t buckets_per_task=16) const;
+        // copies the contents, holding each bucket lock only for the copy of that bucket
+        std::vector<std::pair<Key, Value>> snapshot() const {
+            std::vector<std::pair<Key, Value>> res, bucket;
+            for (auto& b: buckets) {
+                // growing res may move everything copied so far, which must not happen under the lock
+                b->copy(std::back_inserter(bucket));
+                res.insert(res.end(), std::make_move_iterator(bucket.begin()),
+                    std::make_move_iterator(bucket.end()));
+                bucket.clear();
+            }
+            return res;
+        }
+
+        allocator_type get_allocator() const { return allocator_type(resource); }
     private:
         Bucket& get_bucket(const Key& k) const {
             const std::size_t idx = hasher(k) % buckets.size();
-            return buckets[idx];
+            return *buckets[idx];
         }
-        std::vector<Bucket> buckets;
+        std::vector<std::unique_ptr<Bucket>> buckets;
         Hash hasher;
+        std::pmr::memory_resource* const resource;
     };
 
+    template<typename Key, typename Value, typename Hash>
+    template<typename Pool, typename Func>
+    void LockBasedMap<Key, Value, Hash>::parallel_for_each(
+        Pool& pool, Func f, std::size_t buckets_per_task) const {
+        buckets_per_task = std::max<std::size_t>(buckets_per_task, 1);
+        std::vector<std::future<void>> tasks;
+        for (std::size_t first = 0; first < buckets.size(); first += buckets_per_task) {
+            auto last = std::min(buckets.size(), first + buckets_per_task);
+            tasks.push_back(pool.submit([this, &f, first, last] {
+                auto g = f;     // f is not required to be thread safe, only copyable
+                for (auto i = first; i != last; ++i)
+                    buckets[i]->for_each(g);
+            }));
+        }
+        // f must outlive every task, even if one of them throws
+        for (auto& t: tasks)
+            pool.wait(t);
+        for (auto& t: tasks)
+            t.get();
+    }
+
 
 }
 
-#endif
\ No newline at end of file
+#endif
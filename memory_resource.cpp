@@ -0,0 +1,99 @@
+#include <atomic>
+#include <cassert>
+#include <cstdio>
+#include <memory_resource>
+#include <thread>
+#include <vector>
+
+#include "memory_resource.hpp"
+#include "queue.hpp"
+#include "stack.hpp"
+
+using namespace utility;
+
+/*
+Containers sharing a ThreadCachingResource between producers and consumers, with threads coming and
+going so that their caches are given back; in the end everything is returned to upstream.
+Build with -O2 -pthread, or -fsanitize=thread.
+*/
+
+// counts what is outstanding, only called under the lock of ThreadCachingResource
+class CountingResource: public std::pmr::memory_resource {
+public:
+    long outstanding = 0;
+private:
+    void* do_allocate(std::size_t bytes, std::size_t alignment) override {
+        ++outstanding;
+        return std::pmr::new_delete_resource()->allocate(bytes, alignment);
+    }
+    void do_deallocate(void* p, std::size_t bytes, std::size_t alignment) override {
+        --outstanding;
+        std::pmr::new_delete_resource()->deallocate(p, bytes, alignment);
+    }
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+        return this == &other;
+    }
+};
+
+constexpr int rounds = 5;
+constexpr int per_thread = 20000;
+
+// the nodes of the two-lock queue are allocated by the producers and freed by the consumers
+void queue(std::pmr::memory_resource& upstream) {
+    ThreadCachingResource pool(&upstream, 32);
+    LockBasedQueue<long> q(&pool);
+    for (int r = 0; r != rounds; ++r) {
+        std::atomic<long> sum{0};
+        std::vector<std::thread> ts;
+        for (int t = 0; t != 2; ++t)
+            ts.emplace_back([&] {
+                for (long i = 0; i != per_thread; ++i)
+                    q.push(i);
+            });
+        for (int t = 0; t != 2; ++t)
+            ts.emplace_back([&] {
+                long x;
+                for (int i = 0; i != per_thread; ++i) {
+                    assert(q.pop_for(x, std::chrono::seconds(10)));
+                    sum += x;
+                }
+            });
+        for (auto& t: ts)
+            t.join();
+        assert(sum == 2L * per_thread * (per_thread - 1) / 2);
+    }
+    assert(q.empty());
+}
+
+void stack(std::pmr::memory_resource& upstream) {
+    ThreadCachingResource pool(&upstream, 16);
+    LockFreeStack<int> s(&pool);
+    std::vector<std::atomic<int>> seen(4 * per_thread);
+    std::vector<std::thread> ts;
+    for (int t = 0; t != 4; ++t)
+        ts.emplace_back([&, t] {
+            for (int i = 0; i != per_thread; ++i) {
+                s.push(t * per_thread + i);
+                if (i % 2)
+                    if (auto p = s.pop())
+                        ++seen[*p];
+            }
+        });
+    for (auto& t: ts)
+        t.join();
+    while (auto p = s.pop())
+        ++seen[*p];
+    for (auto& n: seen)
+        assert(n == 1);
+}
+
+int main() {
+    CountingResource upstream;
+    queue(upstream);
+    stack(upstream);
+    assert(upstream.outstanding == 0);
+    // an arena that is not thread-safe is fine as the upstream
+    std::pmr::monotonic_buffer_resource arena;
+    queue(arena);
+    std::printf("ok\n");
+}
@@ -0,0 +1,241 @@
+#ifndef CONCURRENCY_MEMORY_RESOURCE_H_
+#define CONCURRENCY_MEMORY_RESOURCE_H_
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <memory_resource>
+#include <mutex>
+#include <new>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace utility {
+    namespace detail {
+        // destroys and frees an object allocated from resource
+        template<typename T>
+        struct PmrDelete {
+            std::pmr::memory_resource* resource = nullptr;
+            void operator()(T* p) const noexcept {
+                p->~T();
+                resource->deallocate(p, sizeof(T), alignof(T));
+            }
+        };
+    }
+
+    // unique_ptr freeing to the memory_resource it was allocated from, see make_pmr_unique()
+    template<typename T>
+    using PmrUniquePtr = std::unique_ptr<T, detail::PmrDelete<T>>;
+
+    template<typename T, typename... Args>
+    PmrUniquePtr<T> make_pmr_unique(std::pmr::memory_resource* resource, Args&&... args) {
+        auto p = resource->allocate(sizeof(T), alignof(T));
+        try {
+            return PmrUniquePtr<T>(new (p) T(std::forward<Args>(args)...), {resource});
+        }
+        catch (...) {
+            resource->deallocate(p, sizeof(T), alignof(T));
+            throw;
+        }
+    }
+
+    /*
+    Thread-safe pool resource for the node churn of the containers: blocks up to max_block_size bytes are
+    rounded up to a multiple of granularity, and every thread allocates from and frees to free lists of its
+    own, one per size. A thread only takes the lock of the resource to trade cache_size / 2 blocks with the
+    shared free lists, when its list runs empty or grows beyond cache_size, so that a producer allocating
+    and a consumer freeing the nodes of a queue rarely meet. Blocks are carved from chunks of chunk_size
+    bytes taken from upstream, which are only given back when the resource is destroyed; larger or
+    over-aligned blocks go to upstream directly.
+    upstream is only called under the lock, so it need not be thread-safe: a request-scoped
+    std::pmr::monotonic_buffer_resource can back containers shared between threads, e.g.,
+        std::pmr::monotonic_buffer_resource arena;
+        ThreadCachingResource pool(&arena);
+        LockBasedQueue<Request> q(&pool);
+    A thread exiting gives its cached blocks back to the resources still alive.
+    */
+    class ThreadCachingResource: public std::pmr::memory_resource {
+    public:
+        static constexpr std::size_t granularity = alignof(std::max_align_t);
+        static constexpr std::size_t max_block_size = 512;
+
+        explicit ThreadCachingResource(std::pmr::memory_resource* upstream=std::pmr::get_default_resource(),
+            std::size_t cache_size=64, std::size_t chunk_size=64 * 1024);
+        ThreadCachingResource(const ThreadCachingResource&) = delete;
+        ThreadCachingResource& operator=(const ThreadCachingResource&) = delete;
+        ~ThreadCachingResource() override;
+
+        std::pmr::memory_resource* upstream_resource() const noexcept { return upstream; }
+    protected:
+        void* do_allocate(std::size_t bytes, std::size_t alignment) override;
+        void do_deallocate(void* p, std::size_t bytes, std::size_t alignment) override;
+        bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+            return this == &other;
+        }
+    private:
+        static constexpr std::size_t num_classes = max_block_size / granularity;
+        struct Block {
+            Block* next;
+        };
+        struct FreeList {
+            Block* head = nullptr;
+            std::size_t size = 0;
+            void push(Block* b) noexcept {
+                b->next = head;
+                head = b;
+                ++size;
+            }
+            Block* pop() noexcept {
+                auto b = head;
+                head = b->next;
+                --size;
+                return b;
+            }
+            // moves up to n blocks to the front of to
+            void move_to(FreeList& to, std::size_t n) noexcept {
+                for (; n && head; --n)
+                    to.push(pop());
+            }
+        };
+        struct ThreadCache {
+            explicit ThreadCache(std::uint64_t id): id(id) {}
+            const std::uint64_t id;     // of the resource, ids are never reused
+            FreeList lists[num_classes];
+        };
+        // the caches of one thread for every resource it has used
+        struct ThreadCaches {
+            std::vector<std::unique_ptr<ThreadCache>> caches;
+            ~ThreadCaches();
+            void prune();
+        };
+
+        static std::size_t class_of(std::size_t bytes) noexcept {
+            return bytes? (bytes - 1) / granularity: 0;
+        }
+        static bool is_small(std::size_t bytes, std::size_t alignment) noexcept {
+            return bytes <= max_block_size && alignment <= granularity;
+        }
+        // resources alive by id, locked before any resource
+        static std::mutex& registry_mutex() {
+            static auto m = new std::mutex;     // leaked, threads may exit after static destruction
+            return *m;
+        }
+        static std::unordered_map<std::uint64_t, ThreadCachingResource*>& registry() {
+            static auto r = new std::unordered_map<std::uint64_t, ThreadCachingResource*>;
+            return *r;
+        }
+        static std::uint64_t next_id() {
+            static std::atomic<std::uint64_t> id{0};
+            return id.fetch_add(1, std::memory_order_relaxed);
+        }
+        ThreadCache& local_cache();
+        void refill(FreeList& list, std::size_t c);
+        void give_back(ThreadCache& cache);
+
+        std::pmr::memory_resource* const upstream;
+        const std::size_t cache_size;
+        const std::size_t chunk_size;
+        const std::uint64_t id;
+        std::mutex m;
+        FreeList shared[num_classes];                       // protected by m
+        std::vector<std::pair<void*, std::size_t>> chunks;  // protected by m
+    };
+
+    inline ThreadCachingResource::ThreadCachingResource(
+        std::pmr::memory_resource* upstream, std::size_t cache_size, std::size_t chunk_size):
+        upstream(upstream), cache_size(cache_size? cache_size: 1), chunk_size(chunk_size),
+        id(next_id()) {
+        std::lock_guard l(registry_mutex());
+        registry().emplace(id, this);
+    }
+
+    inline ThreadCachingResource::~ThreadCachingResource() {
+        {
+            // from now on exiting threads leave their blocks alone
+            std::lock_guard l(registry_mutex());
+            registry().erase(id);
+        }
+        for (auto& c: chunks)
+            upstream->deallocate(c.first, c.second, granularity);
+    }
+
+    inline ThreadCachingResource::ThreadCaches::~ThreadCaches() {
+        std::lock_guard l(registry_mutex());
+        for (auto& c: caches) {
+            auto r = registry().find(c->id);
+            if (r != registry().end())
+                r->second->give_back(*c);
+        }
+    }
+
+    // drops the caches of destroyed resources, their blocks are gone with the chunks
+    inline void ThreadCachingResource::ThreadCaches::prune() {
+        std::lock_guard l(registry_mutex());
+        caches.erase(std::remove_if(caches.begin(), caches.end(),
+            [](auto& c) { return !registry().count(c->id); }), caches.end());
+    }
+
+    inline ThreadCachingResource::ThreadCache& ThreadCachingResource::local_cache() {
+        static thread_local ThreadCaches local;
+        for (auto& c: local.caches)
+            if (c->id == id)
+                return *c;
+        local.prune();
+        local.caches.push_back(std::make_unique<ThreadCache>(id));
+        return *local.caches.back();
+    }
+
+    inline void ThreadCachingResource::refill(FreeList& list, std::size_t c) {
+        std::lock_guard l(m);
+        auto& from = shared[c];
+        if (!from.head) {
+            auto block_size = (c + 1) * granularity;
+            auto n = std::max<std::size_t>(chunk_size / block_size, 1);
+            chunks.reserve(chunks.size() + 1);
+            auto chunk = static_cast<unsigned char*>(upstream->allocate(n * block_size, granularity));
+            chunks.emplace_back(chunk, n * block_size);
+            // pushed backwards so that blocks are handed out in address order
+            while (n--)
+                from.push(reinterpret_cast<Block*>(chunk + n * block_size));
+        }
+        from.move_to(list, std::max<std::size_t>(cache_size / 2, 1));
+    }
+
+    inline void ThreadCachingResource::give_back(ThreadCache& cache) {
+        std::lock_guard l(m);
+        for (std::size_t c = 0; c != num_classes; ++c)
+            cache.lists[c].move_to(shared[c], cache.lists[c].size);
+    }
+
+    inline void* ThreadCachingResource::do_allocate(std::size_t bytes, std::size_t alignment) {
+        if (!is_small(bytes, alignment)) {
+            std::lock_guard l(m);
+            return upstream->allocate(bytes, alignment);
+        }
+        auto c = class_of(bytes);
+        auto& list = local_cache().lists[c];
+        if (!list.head)
+            refill(list, c);
+        return list.pop();
+    }
+
+    inline void ThreadCachingResource::do_deallocate(void* p, std::size_t bytes, std::size_t alignment) {
+        if (!is_small(bytes, alignment)) {
+            std::lock_guard l(m);
+            upstream->deallocate(p, bytes, alignment);
+            return;
+        }
+        auto c = class_of(bytes);
+        auto& list = local_cache().lists[c];
+        list.push(static_cast<Block*>(p));
+        if (list.size > cache_size) {
+            std::lock_guard l(m);
+            list.move_to(shared[c], std::max<std::size_t>(cache_size / 2, 1));
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,91 @@
+#include <atomic>
+#include <cassert>
+#include <cstdio>
+#include <thread>
+#include <vector>
+
+#include "multi_queue.hpp"
+
+using namespace utility;
+
+/*
+Producers push, one by one and in bulk, while consumers pop until the queue is closed: every element
+must be popped exactly once, also when close() races with the pushes. Build with -O2 -pthread, or
+-fsanitize=thread.
+*/
+
+constexpr int num_producers = 4;
+constexpr int per_producer = 50000;
+
+void exactly_once() {
+    MultiQueue<int> q(8);
+    std::vector<std::atomic<int>> seen(num_producers * per_producer);
+    std::vector<std::thread> consumers;
+    for (int i = 0; i != 4; ++i)
+        consumers.emplace_back([&] {
+            int x;
+            while (q.pop(x))
+                ++seen[x];
+        });
+    std::vector<std::thread> producers;
+    for (int p = 0; p != num_producers; ++p)
+        producers.emplace_back([&, p] {
+            auto first = p * per_producer;
+            std::vector<int> batch;
+            for (int i = 0; i != per_producer; ++i) {
+                if (i % 2)
+                    q.push(first + i);
+                else
+                    batch.push_back(first + i);
+                if (batch.size() == 16) {
+                    q.push_bulk(batch.begin(), batch.end());
+                    batch.clear();
+                }
+            }
+            q.push_bulk(batch.begin(), batch.end());
+        });
+    for (auto& t: producers)
+        t.join();
+    q.close();
+    for (auto& t: consumers)
+        t.join();
+    for (auto& n: seen)
+        assert(n == 1);
+    assert(q.empty());
+}
+
+// no element pushed successfully is lost by the consumers leaving on a closed queue
+void close_race() {
+    for (int round = 0; round != 200; ++round) {
+        MultiQueue<int> q(4);
+        std::atomic<int> pushed{0}, popped{0};
+        std::vector<std::thread> ts;
+        for (int i = 0; i != 2; ++i)
+            ts.emplace_back([&] {
+                try {
+                    while (true) {
+                        q.push(0);
+                        ++pushed;
+                    }
+                }
+                catch (QueueClosed&) {}
+            });
+        for (int i = 0; i != 2; ++i)
+            ts.emplace_back([&] {
+                int x;
+                while (q.pop(x))
+                    ++popped;
+            });
+        std::this_thread::yield();
+        q.close();
+        for (auto& t: ts)
+            t.join();
+        assert(pushed == popped);
+    }
+}
+
+int main() {
+    exactly_once();
+    close_race();
+    std::printf("ok\n");
+}
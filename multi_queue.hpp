@@ -0,0 +1,298 @@
+#ifndef CONCURRENCY_MULTI_QUEUE_H_
+#define CONCURRENCY_MULTI_QUEUE_H_
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "cache_line.hpp"
+#include "futex.hpp"
+#include "queue.hpp"
+
+namespace utility {
+    namespace detail {
+        // index of one of n shards, drawn per thread
+        inline std::size_t random_index(std::size_t n) {
+            // xorshift, std::minstd_rand is noticeably slower here
+            static thread_local std::uint32_t x = std::hash<std::thread::id>()(std::this_thread::get_id()) | 1;
+            x ^= x << 13;
+            x ^= x >> 17;
+            x ^= x << 5;
+            return x % n;
+        }
+
+        // locks a random one of the n shards, skipping those locked by others for a few times before blocking
+        template<typename Shard>
+        Shard& lock_random(Shard* shards, std::size_t n) {
+            auto* s = &shards[random_index(n)];
+            auto locked = s->m.try_lock();
+            for (auto i = 0; i != 3 && !locked; ++i) {
+                s = &shards[random_index(n)];
+                locked = s->m.try_lock();
+            }
+            if (!locked)
+                s->m.lock();
+            return *s;
+        }
+    }
+
+    /*
+    Relaxed FIFO queue in the style of the MultiQueue (Rihani, Sanders & Dementiev, 2015).
+    Data are spread over K sub-queues, each guarded by its own mutex. push() puts data into a random
+    sub-queue; try_pop() peeks at the front timestamps of two random sub-queues without locking and
+    pops from the one with the older front. An element may therefore be popped slightly before
+    older ones, in exchange push and pop rarely contend on the same lock.
+    The interface mirrors LockBasedQueue (including close()) so that it can serve as the shared
+    queue of ThreadPool.
+    */
+    template<typename T>
+    class MultiQueue {
+    public:
+        explicit MultiQueue(std::size_t num_queues=2 * std::thread::hardware_concurrency());
+        MultiQueue(const MultiQueue&) = delete;
+        MultiQueue& operator=(const MultiQueue&) = delete;
+
+        // both are approximate as sub-queues are visited one after another
+        bool empty() const;
+        std::size_t size() const;
+
+        void push(const T& data) { emplace(data); }
+        void push(T&& data) { emplace(std::move(data)); }
+        template<typename... Args>
+        void emplace(Args&&... args);
+        // pushes [first, last) into a single sub-queue under one lock
+        template<typename InputIt>
+        void push_bulk(InputIt first, InputIt last);
+        T pop();
+        bool pop(T&);
+        // best effort: it samples the sub-queues one after another, so it may return false
+        // while other threads are pushing and popping, even if the queue is never empty
+        bool try_pop(T&);
+        template<typename Rep, typename Period>
+        bool pop_for(T& data, const std::chrono::duration<Rep, Period>& d) {
+            return pop_until(data, std::chrono::steady_clock::now() + d);
+        }
+        template<typename Clock, typename Duration>
+        bool pop_until(T&, const std::chrono::time_point<Clock, Duration>&);
+        void close();
+        bool is_closed() const { return closed.load(); }
+    private:
+        using Stamp = std::uint64_t;
+        static constexpr Stamp empty_stamp = std::numeric_limits<Stamp>::max();
+
+        // aligned so that neighbouring sub-queues do not share a cache line
+        struct alignas(cache_line_size) SubQueue {
+            std::mutex m;
+            std::deque<std::pair<Stamp, T>> data;
+            std::atomic<Stamp> top{empty_stamp};    // stamp of the front, readable without m
+        };
+
+        static Stamp now() {
+            return std::chrono::steady_clock::now().time_since_epoch().count();
+        }
+        std::size_t random_index() const { return detail::random_index(num_queues); }
+        SubQueue& lock_random() { return detail::lock_random(queues.get(), num_queues); }
+        bool pop_locked(SubQueue&, T&);     // requires q.m
+        bool try_pop_two_choice(T&);
+        bool all_empty() const;
+        void notify(std::size_t n=1);
+        template<typename Wait>
+        bool wait_pop(T&, Wait);
+
+        std::unique_ptr<SubQueue[]> queues;
+        const std::size_t num_queues;
+        std::atomic<bool> closed{false};    // written with every sub-queue locked, see close()
+        // blocking pops only, only read by a push as long as nobody is waiting
+        alignas(cache_line_size) EventCount event;
+    };
+
+    template<typename T>
+    MultiQueue<T>::MultiQueue(std::size_t n):
+        queues(new SubQueue[n? n: 2]), num_queues(n? n: 2) {}
+
+    template<typename T>
+    bool MultiQueue<T>::empty() const {
+        return all_empty();
+    }
+
+    template<typename T>
+    std::size_t MultiQueue<T>::size() const {
+        std::size_t n = 0;
+        for (std::size_t i = 0; i != num_queues; ++i) {
+            std::lock_guard l(queues[i].m);
+            n += queues[i].data.size();
+        }
+        return n;
+    }
+
+    template<typename T>
+    template<typename... Args>
+    void MultiQueue<T>::emplace(Args&&... args) {
+        auto stamp = now();
+        auto& q = lock_random();
+        std::unique_lock l(q.m, std::adopt_lock);
+        if (closed.load(std::memory_order_relaxed))
+            throw QueueClosed();
+        q.data.emplace_back(std::piecewise_construct, std::forward_as_tuple(stamp),
+            std::forward_as_tuple(std::forward<Args>(args)...));
+        if (q.data.size() == 1)
+            q.top.store(stamp);
+        l.unlock();
+        notify();
+    }
+
+    template<typename T>
+    template<typename InputIt>
+    void MultiQueue<T>::push_bulk(InputIt first, InputIt last) {
+        auto stamp = now();
+        auto& q = lock_random();
+        std::unique_lock l(q.m, std::adopt_lock);
+        if (closed.load(std::memory_order_relaxed))
+            throw QueueClosed();
+        if (first == last)
+            return;
+        auto was_empty = q.data.empty();
+        std::size_t n = 0;
+        for (; first != last; ++first, ++n)
+            q.data.emplace_back(stamp, *first);
+        if (was_empty)
+            q.top.store(stamp);
+        l.unlock();
+        notify(n);
+    }
+
+    template<typename T>
+    bool MultiQueue<T>::pop_locked(SubQueue& q, T& data) {
+        if (q.data.empty())
+            return false;
+        data = std::move(q.data.front().second);
+        q.data.pop_front();
+        q.top.store(q.data.empty()? empty_stamp: q.data.front().first,
+            std::memory_order_relaxed);
+        return true;
+    }
+
+    template<typename T>
+    bool MultiQueue<T>::try_pop_two_choice(T& data) {
+        for (auto attempt = 0; attempt != 4; ++attempt) {
+            auto& a = queues[random_index()];
+            auto& b = queues[random_index()];
+            auto ta = a.top.load(std::memory_order_relaxed);
+            auto tb = b.top.load(std::memory_order_relaxed);
+            if (ta == empty_stamp && tb == empty_stamp)
+                continue;
+            auto& q = ta <= tb? a: b;
+            if (!q.m.try_lock())
+                continue;
+            std::lock_guard l(q.m, std::adopt_lock);
+            if (pop_locked(q, data))
+                return true;
+        }
+        return false;
+    }
+
+    template<typename T>
+    bool MultiQueue<T>::try_pop(T& data) {
+        if (try_pop_two_choice(data))
+            return true;
+        // the queue may be almost empty, scan every sub-queue before giving up
+        auto start = random_index();
+        for (std::size_t i = 0; i != num_queues; ++i) {
+            auto& q = queues[(start + i) % num_queues];
+            if (q.top.load() == empty_stamp)
+                continue;
+            std::lock_guard l(q.m);
+            if (pop_locked(q, data))
+                return true;
+        }
+        return false;
+    }
+
+    template<typename T>
+    bool MultiQueue<T>::all_empty() const {
+        for (std::size_t i = 0; i != num_queues; ++i)
+            if (queues[i].top.load() != empty_stamp)
+                return false;
+        return true;
+    }
+
+    /*
+    A push stores top (when the sub-queue turns non-empty) before notifying, while a consumer
+    calls prepare_wait() before loading every top, so either the consumer sees the data or
+    the push sees the consumer, see EventCount.
+    */
+    template<typename T>
+    void MultiQueue<T>::notify(std::size_t n) {
+        if (n > 1)
+            event.notify_all();
+        else
+            event.notify();
+    }
+
+    template<typename T>
+    template<typename Wait>
+    bool MultiQueue<T>::wait_pop(T& data, Wait wait) {
+        while (!try_pop(data)) {
+            auto key = event.prepare_wait();
+            if (!all_empty() || closed.load()) {
+                event.cancel_wait();
+                if (closed.load() && all_empty())
+                    return false;
+                continue;
+            }
+            if (!wait(key))     // timeout
+                return try_pop(data);
+        }
+        return true;
+    }
+
+    template<typename T>
+    T MultiQueue<T>::pop() {
+        T data;
+        if (!pop(data))
+            throw QueueClosed();
+        return data;
+    }
+
+    template<typename T>
+    bool MultiQueue<T>::pop(T& data) {
+        return wait_pop(data, [this](EventCount::Key key) {
+            event.commit_wait(key);
+            return true;
+        });
+    }
+
+    template<typename T>
+    template<typename Clock, typename Duration>
+    bool MultiQueue<T>::pop_until(
+        T& data, const std::chrono::time_point<Clock, Duration>& deadline) {
+        return wait_pop(data, [this, &deadline](EventCount::Key key) {
+            return event.commit_wait_until(key, deadline);
+        });
+    }
+
+    /*
+    A push checks closed under the lock of its sub-queue, so it either throws or has published
+    its data before close() takes that lock. A consumer seeing closed therefore sees every element
+    pushed and does not return on an empty queue while data are still coming.
+    */
+    template<typename T>
+    void MultiQueue<T>::close() {
+        for (std::size_t i = 0; i != num_queues; ++i)
+            queues[i].m.lock();
+        closed.store(true);
+        for (std::size_t i = 0; i != num_queues; ++i)
+            queues[i].m.unlock();
+        event.notify_all();
+    }
+}
+
+#endif
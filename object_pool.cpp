@@ -0,0 +1,97 @@
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstdio>
+#include <thread>
+#include <vector>
+
+#include "object_pool.hpp"
+#include "queue.hpp"
+#include "stack.hpp"
+
+using namespace utility;
+
+/*
+Objects created on some threads are destroyed on others, so that blocks travel between the magazines
+of threads that come and go; no block may be handed out twice while in use. The pooled LockFreeStack
+must pop every element exactly once. Build with -O2 -pthread, or -fsanitize=thread.
+*/
+
+struct Item {
+    explicit Item(long v): value(v), check(~v) {}
+    ~Item() { check = 0; }
+    long value, check;
+};
+using Items = ObjectPool<Item, 16>;
+
+void cross_thread() {
+    constexpr int rounds = 4, producers = 3, per_producer = 20000;
+    for (int r = 0; r != rounds; ++r) {
+        LockBasedQueue<std::vector<Item*>> q;
+        std::atomic<long> destroyed{0};
+        std::vector<std::thread> ts;
+        for (int p = 0; p != producers; ++p)
+            ts.emplace_back([&, p] {
+                std::vector<Item*> batch;
+                for (long i = 0; i != per_producer; ++i) {
+                    batch.push_back(Items::create(p * per_producer + i));
+                    if (batch.size() == 50) {
+                        // blocks in use at once are distinct
+                        auto sorted = batch;
+                        std::sort(sorted.begin(), sorted.end());
+                        assert(std::adjacent_find(sorted.begin(), sorted.end()) == sorted.end());
+                        q.push(std::move(batch));
+                        batch.clear();
+                    }
+                }
+                q.push(std::move(batch));
+            });
+        for (int c = 0; c != 2; ++c)
+            ts.emplace_back([&] {
+                std::vector<Item*> batch;
+                while (q.pop(batch))
+                    for (auto p: batch) {
+                        assert(p->check == ~p->value);
+                        Items::destroy(p);
+                        ++destroyed;
+                    }
+            });
+        for (int p = 0; p != producers; ++p)
+            ts[p].join();
+        q.close();
+        for (auto& t: ts)
+            if (t.joinable())
+                t.join();
+        assert(destroyed == producers * per_producer);
+    }
+}
+
+void stack() {
+    constexpr int threads = 4, per_thread = 20000;
+    LockFreeStack<int, TaggedPtr<int>> s;
+    assert(s.is_lock_free());
+    std::vector<std::atomic<int>> seen(threads * per_thread);
+    std::vector<std::thread> ts;
+    for (int t = 0; t != threads; ++t)
+        ts.emplace_back([&, t] {
+            int x;
+            for (int i = 0; i != per_thread; ++i) {
+                s.push(t * per_thread + i);
+                if (i % 2 && s.pop(x))
+                    ++seen[x];
+            }
+        });
+    for (auto& t: ts)
+        t.join();
+    int x;
+    while (s.pop(x))
+        ++seen[x];
+    for (auto& n: seen)
+        assert(n == 1);
+}
+
+int main() {
+    cross_thread();
+    stack();
+    std::printf("ok\n");
+}
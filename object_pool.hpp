@@ -0,0 +1,174 @@
+#ifndef CONCURRENCY_OBJECT_POOL_H_
+#define CONCURRENCY_OBJECT_POOL_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <utility>
+
+namespace utility {
+    // pointer and 16-bit version packed in one word, bumped on every change to defeat ABA
+    template<typename T>
+    class TaggedPtr {
+        static constexpr int tag_shift = 48;
+        static_assert(sizeof(void*) == 8, "pointer packing requires a 64-bit platform");
+    public:
+        TaggedPtr() noexcept = default;
+        TaggedPtr(T* p, std::uint16_t tag) noexcept:
+            bits(reinterpret_cast<std::uintptr_t>(p) | (std::uint64_t(tag) << tag_shift)) {}
+        T* get() const noexcept {
+            return reinterpret_cast<T*>(bits & ((std::uint64_t(1) << tag_shift) - 1));
+        }
+        std::uint16_t tag() const noexcept { return bits >> tag_shift; }
+        // the value replacing this one
+        TaggedPtr next(T* p) const noexcept { return TaggedPtr(p, tag() + 1); }
+    private:
+        std::uint64_t bits = 0;
+    };
+
+    /*
+    Lock-free pool of fixed-size blocks for T, shared by all objects of the same type.
+    Every thread allocates from and frees to magazines (lists of up to MagazineSize blocks) of its own, and
+    only trades whole magazines with the shared pool, which is a Treiber stack with a tagged head. A thread
+    exiting gives its magazines back. The pool grows a magazine at a time with operator new and never
+    shrinks, so a block stays readable, e.g., by a thread racing on a stale head, after being recycled.
+    Every block has a link() that is constructed with the block rather than with the T in it, so that
+    a lock-free structure threading its Ts on it may load it while the block is recycled.
+    */
+    template<typename T, std::size_t MagazineSize=64>
+    class ObjectPool {
+        static_assert(MagazineSize > 0, "magazines must not be empty");
+    public:
+        static void* allocate();
+        static void deallocate(void* p) noexcept;
+
+        template<typename... Args>
+        static T* create(Args&&... args) {
+            auto p = allocate();
+            try {
+                return new (p) T(std::forward<Args>(args)...);
+            }
+            catch (...) {
+                deallocate(p);
+                throw;
+            }
+        }
+        static void destroy(T* p) noexcept {
+            if (p) {
+                p->~T();
+                deallocate(p);
+            }
+        }
+        // left as it is by create() and destroy()
+        static std::atomic<void*>& link(T* p) noexcept {
+            return static_cast<Slot*>(static_cast<void*>(p))->link;
+        }
+    private:
+        struct Slot {
+            alignas(T) unsigned char storage[sizeof(T)];    // first, so that a T* is a Slot*
+            std::atomic<void*> link{nullptr};               // see link()
+            Slot* next;                                     // within a magazine
+            std::atomic<Slot*> next_magazine{nullptr};      // read by threads racing on the shared head
+        };
+        struct Chunk {
+            Slot slots[MagazineSize];
+            Chunk* next;
+        };
+        struct Shared {
+            std::atomic<TaggedPtr<Slot>> head{};
+            std::atomic<Chunk*> chunks{nullptr};    // keeps every chunk reachable
+        };
+        struct Cache {
+            Slot* alloc = nullptr;      // magazine allocated from
+            Slot* freed = nullptr;      // magazine freed to
+            std::size_t num_freed = 0;
+            ~Cache() {
+                push(alloc);
+                push(freed);
+            }
+        };
+
+        // never destroyed, threads may still return their magazines during static destruction
+        static Shared& shared() {
+            static auto s = new Shared;
+            return *s;
+        }
+        static Cache& cache() {
+            static thread_local Cache c;
+            return c;
+        }
+        static void push(Slot* magazine) noexcept;
+        static Slot* pop() noexcept;
+        static Slot* grow();
+    };
+
+    template<typename T, std::size_t MagazineSize>
+    void* ObjectPool<T, MagazineSize>::allocate() {
+        auto& c = cache();
+        if (!c.alloc) {
+            if (c.freed) {
+                c.alloc = c.freed;
+                c.freed = nullptr;
+                c.num_freed = 0;
+            }
+            else if (!(c.alloc = pop()))
+                c.alloc = grow();
+        }
+        auto p = c.alloc;
+        c.alloc = p->next;
+        return p->storage;
+    }
+
+    template<typename T, std::size_t MagazineSize>
+    void ObjectPool<T, MagazineSize>::deallocate(void* p) noexcept {
+        if (!p)
+            return;
+        auto& c = cache();
+        if (c.num_freed == MagazineSize) {
+            push(c.freed);
+            c.freed = nullptr;
+            c.num_freed = 0;
+        }
+        auto s = static_cast<Slot*>(p);
+        s->next = c.freed;
+        c.freed = s;
+        ++c.num_freed;
+    }
+
+    template<typename T, std::size_t MagazineSize>
+    void ObjectPool<T, MagazineSize>::push(Slot* magazine) noexcept {
+        if (!magazine)
+            return;
+        auto& head = shared().head;
+        auto old = head.load(std::memory_order_relaxed);
+        do {
+            magazine->next_magazine.store(old.get(), std::memory_order_relaxed);
+        } while (!head.compare_exchange_weak(old, old.next(magazine),
+            std::memory_order_release, std::memory_order_relaxed));
+    }
+
+    template<typename T, std::size_t MagazineSize>
+    typename ObjectPool<T, MagazineSize>::Slot* ObjectPool<T, MagazineSize>::pop() noexcept {
+        auto& head = shared().head;
+        auto old = head.load(std::memory_order_acquire);
+        // the magazine may have been taken and reused meanwhile, in which case the tag has changed
+        while (old.get() && !head.compare_exchange_weak(old,
+            old.next(old.get()->next_magazine.load(std::memory_order_relaxed)),
+            std::memory_order_acquire, std::memory_order_acquire));
+        return old.get();
+    }
+
+    template<typename T, std::size_t MagazineSize>
+    typename ObjectPool<T, MagazineSize>::Slot* ObjectPool<T, MagazineSize>::grow() {
+        auto chunk = new Chunk;
+        for (std::size_t i = 0; i != MagazineSize; ++i)
+            chunk->slots[i].next = i + 1 != MagazineSize? &chunk->slots[i + 1]: nullptr;
+        auto& chunks = shared().chunks;
+        chunk->next = chunks.load(std::memory_order_relaxed);
+        while (!chunks.compare_exchange_weak(chunk->next, chunk, std::memory_order_relaxed));
+        return chunk->slots;
+    }
+}
+
+#endif
@@ -13,21 +13,11 @@ using namespace utility;
 
 /* A reimplementation of List 4.9 */
 using Func = double();
-atomic<bool> go;
 LockBasedQueue<std::packaged_task<Func>, std::list<std::packaged_task<Func>>> task_queue;	// thread safe queue, which handles locks inside
 void task_execution_thread() {
-    while (!go.load())
-        this_thread::yield();
     packaged_task<double()> task;
-    while (!task_queue.empty()) { // for debugging purpose, we only execute this loop once
-        auto flag = task_queue.try_pop(task);	// Returns the front task and removes it from queue. Waits if task_queue is empty
-        if (flag)
-            task();	// execute task
-        else {
-            cout << this_thread::get_id() << "yield\n";
-            this_thread::yield();
-        }
-    }
+    while (task_queue.pop(task))	// Waits if task_queue is empty, returns false once task_queue is closed and drained
+        task();	// execute task
 }
 
 double task(int n=1) {
@@ -37,7 +27,6 @@ double task(int n=1) {
 }
 
 int main() {
-    go = false;
     JoinThread t1(task_execution_thread);
     JoinThread t2(task_execution_thread);
     // auto f1 = post_task(task_queue, task, 3);
@@ -48,7 +37,7 @@ int main() {
     for (auto i = 0; i != 10; ++i) {
         v.push_back(post_task(task_queue, task, i));
     }
-    go = true;
+    task_queue.close();	// wakes up the workers once all tasks are done
     for (auto& f: v)
         cout << f.get() << '\n';
 }
@@ -0,0 +1,76 @@
+#include <atomic>
+#include <cassert>
+#include <cstdio>
+#include <iostream>
+#include <optional>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include "pipeline.hpp"
+
+using namespace utility;
+
+/*
+A pipeline with parallel stages and small channels, so that the stages keep blocking on each other,
+must deliver every item that is not filtered out exactly once; a throwing stage and cancel() must
+stop it. Build with -O2 -pthread, or -fsanitize=thread.
+*/
+
+constexpr long n = 100000;
+
+void every_item() {
+    long next = 0;
+    std::vector<std::atomic<int>> seen(n);
+    auto p = Pipeline::from<long>("count", [&](long& x) { x = next++; return x != n; }, 64, 2)
+        .then("double", 3, [](long& x) { return x * 2; })
+        .then("drop", 2, [](long& x) { return x % 3? std::optional<long>(x): std::nullopt; })
+        .sink("check", 2, [&](long& x) {
+            assert(x % 2 == 0 && x % 3);
+            ++seen[x / 2];
+        });
+    p.run();
+    p.wait();
+    for (long i = 0; i != n; ++i)
+        assert(seen[i] == (i % 3? 1: 0));
+    auto stats = p.stats();
+    assert(stats.size() == 4 && stats[0].items == n && stats[3].items == n - (n + 2) / 3);
+    p.report(std::cout);
+}
+
+void failure() {
+    long next = 0;
+    auto p = Pipeline::from<long>("count", [&](long& x) { x = next++; return true; }, 16, 2)
+        .then("fail", 2, [](long& x) {
+            if (x == 1000)
+                throw std::runtime_error("stage failed");
+            return x;
+        })
+        .sink("drop", 1, [](long&) {});
+    p.run();
+    bool threw = false;
+    try {
+        p.wait();
+    }
+    catch (std::runtime_error&) {
+        threw = true;
+    }
+    assert(threw);
+}
+
+void cancel() {
+    auto p = Pipeline::from<int>("forever", [](int& x) { x = 0; return true; }, 16, 2)
+        .then("slow", 2, [](int& x) { std::this_thread::yield(); return x; })
+        .sink("drop", 1, [](int&) {});
+    p.run();
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    p.cancel();
+    p.wait();
+}
+
+int main() {
+    every_item();
+    failure();
+    cancel();
+    std::printf("ok\n");
+}
@@ -0,0 +1,376 @@
+#ifndef CONCURRENCY_PIPELINE_H_
+#define CONCURRENCY_PIPELINE_H_
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <ostream>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "futex.hpp"
+#include "join_thread.hpp"
+#include "queue.hpp"
+
+namespace utility {
+    namespace detail {
+        /*
+        Bounded channel of batches between two stages. A semaphore counts the free slots, so a
+        producer blocks while the consumer is behind, which pushes back all the way to the source.
+        The channel closes when the last producer is done.
+        */
+        template<typename T>
+        class Channel {
+        public:
+            Channel(std::size_t capacity, std::size_t producers):
+                slots(capacity), producers(producers), num_producers(producers) {}
+
+            // blocks while the channel is full, returns false once cancelled
+            bool push(std::vector<T>&& batch) {
+                if (closed.load(std::memory_order_acquire))
+                    return false;
+                slots.acquire();
+                try {
+                    data.push(std::move(batch));
+                    return true;
+                }
+                catch (const QueueClosed&) {
+                    // pass the unit of cancel() on to another producer blocked on a full channel
+                    slots.release();
+                    return false;
+                }
+            }
+            bool pop(std::vector<T>& batch) {
+                if (!data.pop(batch))
+                    return false;
+                slots.release();
+                return true;
+            }
+            void producer_done() {
+                if (producers.fetch_sub(1, std::memory_order_acq_rel) == 1)
+                    data.close();
+            }
+            // wakes the producers blocked on a full channel. A producer gets past the check of closed
+            // at most once after it is set, so num_producers units are enough for all of them
+            void cancel() {
+                closed.store(true, std::memory_order_release);
+                data.close();
+                slots.release(num_producers);
+            }
+        private:
+            LockBasedQueue<std::vector<T>> data;
+            std::atomic<bool> closed{false};
+            Semaphore slots;
+            std::atomic<std::size_t> producers;
+            const std::size_t num_producers;
+        };
+
+        template<typename T>
+        struct IsOptional: std::false_type {};
+        template<typename T>
+        struct IsOptional<std::optional<T>>: std::true_type {};
+    }
+
+    struct StageStats {
+        std::string name;
+        std::size_t threads;
+        std::size_t items;          // items taken in (produced, for the source)
+        std::size_t batches;
+        double busy_seconds;        // time spent in the stage function, summed over its threads
+        double elapsed_seconds;     // wall time of the pipeline so far
+        // what one thread of the stage could sustain
+        double items_per_second() const { return busy_seconds > 0? items / busy_seconds: 0; }
+        // share of the stage's thread time spent working, the bottleneck is close to 1
+        double utilization() const {
+            return elapsed_seconds > 0? busy_seconds / (threads * elapsed_seconds): 0;
+        }
+    };
+
+    /*
+    Multi-stage pipeline. A source produces items on one thread; each following stage runs on one
+    thread (serial) or several (parallel) and is connected to the previous one by a bounded channel.
+    Stages hand over vectors of up to batch_size items instead of single items, so the cost of a
+    handoff is shared by the whole batch. A parallel stage does not keep the order of the batches.
+
+        auto p = Pipeline::from<std::string>("read", [&](std::string& line) { return bool(std::getline(is, line)); })
+            .then("parse", 4, [](std::string& line) { return parse(line); })
+            .sink("emit", 1, [&](Record& r) { os << r; });
+        p.run();
+        p.wait();
+        p.report(std::cerr);
+
+    A stage function may return std::optional to drop items. If a stage throws, the pipeline is
+    cancelled and wait() rethrows the first exception. Destroying a running pipeline cancels it.
+    */
+    class Pipeline {
+        struct State;
+    public:
+        template<typename T>
+        class Builder;
+
+        // source(T&) fills in the next item, returning false at the end of the input.
+        // Channels hold up to capacity batches
+        template<typename T, typename Source>
+        static Builder<T> from(std::string name, Source source,
+            std::size_t batch_size=256, std::size_t capacity=8);
+
+        Pipeline(Pipeline&&) = default;
+        Pipeline& operator=(Pipeline&&) = default;
+        ~Pipeline();
+
+        void run();
+        // waits for all stages to finish, rethrowing the first exception of a stage
+        void wait();
+        // stops every stage after its current batch
+        void cancel();
+        std::vector<StageStats> stats() const;
+        void report(std::ostream&) const;
+    private:
+        struct Stage {
+            Stage(std::string name, std::size_t threads): name(std::move(name)), threads(threads) {}
+            const std::string name;
+            const std::size_t threads;
+            std::atomic<std::size_t> items{0};
+            std::atomic<std::size_t> batches{0};
+            std::atomic<std::int64_t> busy_ns{0};
+        };
+        struct State {
+            std::size_t batch_size;
+            std::size_t capacity;
+            std::deque<Stage> stages;   // a deque so that bodies may keep references
+            std::vector<std::function<void()>> bodies;      // one per thread
+            std::vector<std::function<void()>> cancels;     // one per channel
+            std::atomic<bool> cancelled{false};
+            std::mutex m;
+            std::exception_ptr error;
+            std::vector<JoinThread> threads;
+            std::chrono::steady_clock::time_point start;
+            std::atomic<std::int64_t> elapsed_ns{-1};   // set when the pipeline is done
+
+            void cancel() {
+                if (!cancelled.exchange(true))
+                    for (auto& c: cancels)
+                        c();
+            }
+            void fail() {
+                {
+                    std::lock_guard l(m);
+                    if (!error)
+                        error = std::current_exception();
+                }
+                cancel();
+            }
+            // runs f and adds its time to the stage
+            template<typename Func>
+            static void timed(Stage& stage, Func f) {
+                auto t0 = std::chrono::steady_clock::now();
+                f();
+                stage.busy_ns.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now() - t0).count(), std::memory_order_relaxed);
+            }
+        };
+
+        explicit Pipeline(std::shared_ptr<State> state): state(std::move(state)) {}
+
+        std::shared_ptr<State> state;
+    };
+
+    template<typename T>
+    class Pipeline::Builder {
+    public:
+        // adds a stage running f(T&) on `threads` threads, f returns the item passed on or an
+        // std::optional of it
+        template<typename Func>
+        auto then(std::string name, std::size_t threads, Func f);
+        // adds the last stage, running f(T&) on `threads` threads
+        template<typename Func>
+        Pipeline sink(std::string name, std::size_t threads, Func f);
+    private:
+        friend class Pipeline;
+        template<typename U>
+        friend class Builder;
+        Builder(std::shared_ptr<State> state, std::shared_ptr<detail::Channel<T>> input):
+            state(std::move(state)), input(std::move(input)) {}
+
+        std::shared_ptr<State> state;
+        std::shared_ptr<detail::Channel<T>> input;
+    };
+
+    template<typename T, typename Source>
+    Pipeline::Builder<T> Pipeline::from(std::string name, Source source,
+        std::size_t batch_size, std::size_t capacity) {
+        auto state = std::make_shared<State>();
+        state->batch_size = batch_size? batch_size: 1;
+        state->capacity = capacity? capacity: 1;
+        auto out = std::make_shared<detail::Channel<T>>(state->capacity, 1);
+        state->cancels.push_back([out] { out->cancel(); });
+        auto& stage = state->stages.emplace_back(std::move(name), 1);
+        state->bodies.push_back([s=state.get(), &stage, out, source=std::move(source)]() mutable {
+            try {
+                bool more = true;
+                while (more && !s->cancelled.load(std::memory_order_relaxed)) {
+                    std::vector<T> batch;
+                    batch.reserve(s->batch_size);
+                    State::timed(stage, [&] {
+                        T item;
+                        while (batch.size() != s->batch_size && (more = source(item)))
+                            batch.push_back(std::move(item));
+                    });
+                    if (batch.empty())
+                        break;
+                    stage.items.fetch_add(batch.size(), std::memory_order_relaxed);
+                    stage.batches.fetch_add(1, std::memory_order_relaxed);
+                    if (!out->push(std::move(batch)))
+                        break;
+                }
+            }
+            catch (...) {
+                s->fail();
+            }
+            out->producer_done();
+        });
+        return Builder<T>(std::move(state), std::move(out));
+    }
+
+    template<typename T>
+    template<typename Func>
+    auto Pipeline::Builder<T>::then(std::string name, std::size_t threads, Func f) {
+        using Result = std::invoke_result_t<Func&, T&>;
+        constexpr bool filter = detail::IsOptional<Result>::value;
+        using U = typename std::conditional_t<filter, Result, std::optional<Result>>::value_type;
+
+        threads = threads? threads: 1;
+        auto out = std::make_shared<detail::Channel<U>>(state->capacity, threads);
+        state->cancels.push_back([out] { out->cancel(); });
+        auto& stage = state->stages.emplace_back(std::move(name), threads);
+        for (std::size_t i = 0; i != threads; ++i) {
+            state->bodies.push_back([s=state.get(), &stage, in=input, out, f]() mutable {
+                try {
+                    std::vector<T> batch;
+                    std::vector<U> pending;     // filtered batches are merged up to batch_size
+                    bool open = true;           // a failed push leaves pending as it was
+                    while (in->pop(batch) && !s->cancelled.load(std::memory_order_relaxed)) {
+                        State::timed(stage, [&] {
+                            for (auto& item: batch) {
+                                if constexpr (filter) {
+                                    if (auto r = f(item))
+                                        pending.push_back(std::move(*r));
+                                }
+                                else
+                                    pending.push_back(f(item));
+                            }
+                        });
+                        stage.items.fetch_add(batch.size(), std::memory_order_relaxed);
+                        stage.batches.fetch_add(1, std::memory_order_relaxed);
+                        if (pending.size() >= s->batch_size) {
+                            if (!(open = out->push(std::move(pending))))
+                                break;
+                            pending = std::vector<U>();
+                        }
+                    }
+                    if (open && !pending.empty() && !s->cancelled.load(std::memory_order_relaxed))
+                        out->push(std::move(pending));
+                }
+                catch (...) {
+                    s->fail();
+                }
+                out->producer_done();
+            });
+        }
+        return Builder<U>(state, std::move(out));
+    }
+
+    template<typename T>
+    template<typename Func>
+    Pipeline Pipeline::Builder<T>::sink(std::string name, std::size_t threads, Func f) {
+        threads = threads? threads: 1;
+        auto& stage = state->stages.emplace_back(std::move(name), threads);
+        for (std::size_t i = 0; i != threads; ++i) {
+            state->bodies.push_back([s=state.get(), &stage, in=input, f]() mutable {
+                try {
+                    std::vector<T> batch;
+                    while (in->pop(batch) && !s->cancelled.load(std::memory_order_relaxed)) {
+                        State::timed(stage, [&] {
+                            for (auto& item: batch)
+                                f(item);
+                        });
+                        stage.items.fetch_add(batch.size(), std::memory_order_relaxed);
+                        stage.batches.fetch_add(1, std::memory_order_relaxed);
+                    }
+                }
+                catch (...) {
+                    s->fail();
+                }
+            });
+        }
+        return Pipeline(state);
+    }
+
+    inline Pipeline::~Pipeline() {
+        if (state && !state->threads.empty()) {
+            state->cancel();
+            state->threads.clear();
+        }
+    }
+
+    inline void Pipeline::run() {
+        state->start = std::chrono::steady_clock::now();
+        state->threads.reserve(state->bodies.size());
+        for (auto& body: state->bodies)
+            state->threads.emplace_back(body);
+    }
+
+    inline void Pipeline::wait() {
+        for (auto& t: state->threads)
+            if (t.joinable())
+                t.join();
+        state->elapsed_ns.store(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - state->start).count());
+        state->threads.clear();
+        if (state->error)
+            std::rethrow_exception(state->error);
+    }
+
+    inline void Pipeline::cancel() {
+        state->cancel();
+    }
+
+    inline std::vector<StageStats> Pipeline::stats() const {
+        auto ns = state->elapsed_ns.load();
+        if (ns < 0)
+            ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - state->start).count();
+        std::vector<StageStats> res;
+        for (auto& s: state->stages)
+            res.push_back({s.name, s.threads, s.items.load(std::memory_order_relaxed),
+                s.batches.load(std::memory_order_relaxed), s.busy_ns.load(std::memory_order_relaxed) * 1e-9,
+                ns * 1e-9});
+        return res;
+    }
+
+    inline void Pipeline::report(std::ostream& os) const {
+        auto flags = os.flags();
+        auto precision = os.precision();
+        os << std::left << std::setw(16) << "stage" << std::right << std::setw(8) << "threads"
+           << std::setw(12) << "items" << std::setw(10) << "batches" << std::setw(14) << "items/s/thr"
+           << std::setw(8) << "util" << '\n';
+        for (auto& s: stats())
+            os << std::left << std::setw(16) << s.name << std::right << std::setw(8) << s.threads
+               << std::setw(12) << s.items << std::setw(10) << s.batches
+               << std::setw(14) << std::fixed << std::setprecision(0) << s.items_per_second()
+               << std::setw(7) << s.utilization() * 100 << "%\n";
+        os.flags(flags);
+        os.precision(precision);
+    }
+}
+
+#endif
@@ -0,0 +1,86 @@
+#include <atomic>
+#include <cassert>
+#include <cstdio>
+#include <iterator>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "priority_queue.hpp"
+
+using namespace utility;
+
+/*
+Producers push random keys while consumers pop the minimum until the queue is closed: every element
+is popped exactly once, and with a single heap the pops come out in order. Build with -O2 -pthread,
+or -fsanitize=thread.
+*/
+
+constexpr int num_producers = 4;
+constexpr int per_producer = 30000;
+
+void exactly_once() {
+    MultiPriorityQueue<unsigned, int> q(8);
+    std::vector<std::atomic<int>> seen(num_producers * per_producer);
+    std::vector<std::thread> consumers;
+    for (int i = 0; i != 3; ++i)
+        consumers.emplace_back([&, i] {
+            std::pair<unsigned, int> x;
+            std::vector<std::pair<unsigned, int>> bulk;
+            while (true) {
+                // bulk pops come from one heap, in order
+                if (i == 0 && q.try_pop_min_bulk(std::back_inserter(bulk), 8)) {
+                    for (std::size_t j = 0; j != bulk.size(); ++j) {
+                        assert(!j || bulk[j - 1].first <= bulk[j].first);
+                        ++seen[bulk[j].second];
+                    }
+                    bulk.clear();
+                }
+                else if (q.pop_min(x))
+                    ++seen[x.second];
+                else
+                    break;
+            }
+        });
+    std::vector<std::thread> producers;
+    for (int p = 0; p != num_producers; ++p)
+        producers.emplace_back([&, p] {
+            std::vector<std::pair<unsigned, int>> batch;
+            for (int i = 0; i != per_producer; ++i) {
+                auto id = p * per_producer + i;
+                auto key = unsigned(id) * 2654435761u;
+                if (i % 2)
+                    q.push(key, id);
+                else
+                    batch.emplace_back(key, id);
+                if (batch.size() == 16) {
+                    q.push_bulk(batch.begin(), batch.end());
+                    batch.clear();
+                }
+            }
+            q.push_bulk(batch.begin(), batch.end());
+        });
+    for (auto& t: producers)
+        t.join();
+    q.close();
+    for (auto& t: consumers)
+        t.join();
+    for (auto& n: seen)
+        assert(n == 1);
+}
+
+void in_order() {
+    MultiPriorityQueue<int, int> q(1);
+    for (int i = 0; i != 1000; ++i)
+        q.push((i * 7919) % 1000, i);
+    std::pair<int, int> x;
+    for (int i = 0; i != 1000; ++i)
+        assert(q.try_pop_min(x) && x.first == i);
+    assert(!q.try_pop_min(x));
+}
+
+int main() {
+    exactly_once();
+    in_order();
+    std::printf("ok\n");
+}
@@ -0,0 +1,305 @@
+#ifndef CONCURRENCY_PRIORITY_QUEUE_H_
+#define CONCURRENCY_PRIORITY_QUEUE_H_
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "cache_line.hpp"
+#include "futex.hpp"
+#include "multi_queue.hpp"
+#include "queue.hpp"
+
+namespace utility {
+    /*
+    Relaxed concurrent min-priority queue, the MultiQueue of Rihani, Sanders & Dementiev (2015) in its
+    original form. Elements are spread over K binary heaps, each guarded by its own mutex. push() goes to a
+    random heap; try_pop_min() peeks at the minimum keys of two random heaps without locking and pops from
+    the one with the smaller key. The popped key is therefore not always the global minimum, but close to it
+    (the expected rank error is O(K)), in exchange producers and consumers rarely contend on the same lock.
+    The blocking interface follows LockBasedQueue::pop, including close().
+    Key must be trivially copyable so that the minimum of each heap can be published in an atomic.
+    */
+    template<typename Key, typename Value, typename Compare=std::less<Key>>
+    class MultiPriorityQueue {
+        static_assert(std::is_trivially_copyable<Key>::value, "Key must be trivially copyable");
+    public:
+        using value_type = std::pair<Key, Value>;
+
+        explicit MultiPriorityQueue(std::size_t num_queues=2 * std::thread::hardware_concurrency(),
+            const Compare& comp=Compare());
+        MultiPriorityQueue(const MultiPriorityQueue&) = delete;
+        MultiPriorityQueue& operator=(const MultiPriorityQueue&) = delete;
+
+        // both are approximate as heaps are visited one after another
+        bool empty() const;
+        std::size_t size() const;
+
+        void push(const Key& key, const Value& value) { emplace(key, value); }
+        void push(const Key& key, Value&& value) { emplace(key, std::move(value)); }
+        template<typename... Args>
+        void emplace(const Key& key, Args&&... args);
+        // pushes the value_types in [first, last) into a single heap under one lock
+        template<typename InputIt>
+        void push_bulk(InputIt first, InputIt last);
+
+        // best effort: it samples the heaps one after another, so it may return false
+        // while other threads are pushing and popping, even if the queue is never empty
+        bool try_pop_min(value_type&);
+        // pops up to max elements in order from the heap try_pop_min() would pick, returns the number popped
+        template<typename OutputIt>
+        std::size_t try_pop_min_bulk(OutputIt out, std::size_t max);
+        value_type pop_min();
+        bool pop_min(value_type&);
+        template<typename Rep, typename Period>
+        bool pop_min_for(value_type& data, const std::chrono::duration<Rep, Period>& d) {
+            return pop_min_until(data, std::chrono::steady_clock::now() + d);
+        }
+        template<typename Clock, typename Duration>
+        bool pop_min_until(value_type&, const std::chrono::time_point<Clock, Duration>&);
+        void close();
+        bool is_closed() const { return closed.load(); }
+    private:
+        // aligned so that neighbouring heaps do not share a cache line
+        struct alignas(cache_line_size) Heap {
+            std::mutex m;
+            std::vector<value_type> data;
+            std::atomic<std::size_t> count{0};  // readable without m
+            std::atomic<Key> top{};             // minimum key, valid if count != 0
+        };
+        // the heap algorithms build max-heaps, so reverse the comparison
+        struct HeapCompare {
+            bool operator()(const value_type& a, const value_type& b) const { return comp(b.first, a.first); }
+            Compare comp;
+        };
+
+        std::size_t random_index() const { return detail::random_index(num_queues); }
+        Heap& lock_random() { return detail::lock_random(heaps.get(), num_queues); }
+        void publish(Heap&);    // requires h.m
+        Heap* choose();
+        template<typename Func>
+        bool pop_from_any(Func pop_locked);
+        bool all_empty() const;
+        void notify(std::size_t n=1);
+        template<typename Wait>
+        bool wait_pop(value_type&, Wait);
+
+        std::unique_ptr<Heap[]> heaps;
+        const std::size_t num_queues;
+        const HeapCompare heap_comp;
+        std::atomic<bool> closed{false};    // written with every heap locked, see close()
+        // blocking pops only, only read by a push as long as nobody is waiting
+        alignas(cache_line_size) EventCount event;
+    };
+
+    template<typename Key, typename Value, typename Compare>
+    MultiPriorityQueue<Key, Value, Compare>::MultiPriorityQueue(std::size_t n, const Compare& comp):
+        heaps(new Heap[n? n: 2]), num_queues(n? n: 2), heap_comp{comp} {}
+
+    template<typename Key, typename Value, typename Compare>
+    bool MultiPriorityQueue<Key, Value, Compare>::empty() const {
+        return all_empty();
+    }
+
+    template<typename Key, typename Value, typename Compare>
+    std::size_t MultiPriorityQueue<Key, Value, Compare>::size() const {
+        std::size_t n = 0;
+        for (std::size_t i = 0; i != num_queues; ++i)
+            n += heaps[i].count.load(std::memory_order_relaxed);
+        return n;
+    }
+
+    template<typename Key, typename Value, typename Compare>
+    void MultiPriorityQueue<Key, Value, Compare>::publish(Heap& h) {
+        if (!h.data.empty())
+            h.top.store(h.data.front().first, std::memory_order_relaxed);
+        h.count.store(h.data.size());
+    }
+
+    template<typename Key, typename Value, typename Compare>
+    template<typename... Args>
+    void MultiPriorityQueue<Key, Value, Compare>::emplace(const Key& key, Args&&... args) {
+        auto& h = lock_random();
+        std::unique_lock l(h.m, std::adopt_lock);
+        if (closed.load(std::memory_order_relaxed))
+            throw QueueClosed();
+        h.data.emplace_back(std::piecewise_construct, std::forward_as_tuple(key),
+            std::forward_as_tuple(std::forward<Args>(args)...));
+        std::push_heap(h.data.begin(), h.data.end(), heap_comp);
+        publish(h);
+        l.unlock();
+        notify();
+    }
+
+    template<typename Key, typename Value, typename Compare>
+    template<typename InputIt>
+    void MultiPriorityQueue<Key, Value, Compare>::push_bulk(InputIt first, InputIt last) {
+        auto& h = lock_random();
+        std::unique_lock l(h.m, std::adopt_lock);
+        if (closed.load(std::memory_order_relaxed))
+            throw QueueClosed();
+        if (first == last)
+            return;
+        auto old_size = h.data.size();
+        h.data.insert(h.data.end(), first, last);
+        auto n = h.data.size() - old_size;
+        // rebuilding is linear, pushing one by one is n log(size)
+        if (n > old_size)
+            std::make_heap(h.data.begin(), h.data.end(), heap_comp);
+        else
+            for (auto i = old_size; i != h.data.size(); ++i)
+                std::push_heap(h.data.begin(), h.data.begin() + i + 1, heap_comp);
+        publish(h);
+        l.unlock();
+        notify(n);
+    }
+
+    // the non-empty heap with the smaller minimum of two random ones
+    template<typename Key, typename Value, typename Compare>
+    typename MultiPriorityQueue<Key, Value, Compare>::Heap*
+    MultiPriorityQueue<Key, Value, Compare>::choose() {
+        auto& a = heaps[random_index()];
+        auto& b = heaps[random_index()];
+        auto na = a.count.load(std::memory_order_relaxed);
+        auto nb = b.count.load(std::memory_order_relaxed);
+        if (!na || !nb)
+            return na? &a: nb? &b: nullptr;
+        return heap_comp.comp(b.top.load(std::memory_order_relaxed),
+            a.top.load(std::memory_order_relaxed))? &b: &a;
+    }
+
+    template<typename Key, typename Value, typename Compare>
+    template<typename Func>
+    bool MultiPriorityQueue<Key, Value, Compare>::pop_from_any(Func pop_locked) {
+        for (auto attempt = 0; attempt != 4; ++attempt) {
+            auto h = choose();
+            if (!h || !h->m.try_lock())
+                continue;
+            std::lock_guard l(h->m, std::adopt_lock);
+            if (pop_locked(*h))
+                return true;
+        }
+        // the queue may be almost empty, scan every heap before giving up
+        auto start = random_index();
+        for (std::size_t i = 0; i != num_queues; ++i) {
+            auto& h = heaps[(start + i) % num_queues];
+            if (!h.count.load())
+                continue;
+            std::lock_guard l(h.m);
+            if (pop_locked(h))
+                return true;
+        }
+        return false;
+    }
+
+    template<typename Key, typename Value, typename Compare>
+    bool MultiPriorityQueue<Key, Value, Compare>::try_pop_min(value_type& data) {
+        return pop_from_any([this, &data](Heap& h) {
+            if (h.data.empty())
+                return false;
+            std::pop_heap(h.data.begin(), h.data.end(), heap_comp);
+            data = std::move(h.data.back());
+            h.data.pop_back();
+            publish(h);
+            return true;
+        });
+    }
+
+    template<typename Key, typename Value, typename Compare>
+    template<typename OutputIt>
+    std::size_t MultiPriorityQueue<Key, Value, Compare>::try_pop_min_bulk(OutputIt out, std::size_t max) {
+        std::size_t n = 0;
+        if (max)
+            pop_from_any([this, &out, &n, max](Heap& h) {
+                for (; n != max && !h.data.empty(); ++n) {
+                    std::pop_heap(h.data.begin(), h.data.end(), heap_comp);
+                    *out++ = std::move(h.data.back());
+                    h.data.pop_back();
+                }
+                publish(h);
+                return n != 0;
+            });
+        return n;
+    }
+
+    template<typename Key, typename Value, typename Compare>
+    bool MultiPriorityQueue<Key, Value, Compare>::all_empty() const {
+        for (std::size_t i = 0; i != num_queues; ++i)
+            if (heaps[i].count.load())
+                return false;
+        return true;
+    }
+
+    // see MultiQueue::notify, with count in place of top
+    template<typename Key, typename Value, typename Compare>
+    void MultiPriorityQueue<Key, Value, Compare>::notify(std::size_t n) {
+        if (n > 1)
+            event.notify_all();
+        else
+            event.notify();
+    }
+
+    template<typename Key, typename Value, typename Compare>
+    template<typename Wait>
+    bool MultiPriorityQueue<Key, Value, Compare>::wait_pop(value_type& data, Wait wait) {
+        while (!try_pop_min(data)) {
+            auto key = event.prepare_wait();
+            if (!all_empty() || closed.load()) {
+                event.cancel_wait();
+                if (closed.load() && all_empty())
+                    return false;
+                continue;
+            }
+            if (!wait(key))     // timeout
+                return try_pop_min(data);
+        }
+        return true;
+    }
+
+    template<typename Key, typename Value, typename Compare>
+    typename MultiPriorityQueue<Key, Value, Compare>::value_type
+    MultiPriorityQueue<Key, Value, Compare>::pop_min() {
+        value_type data;
+        if (!pop_min(data))
+            throw QueueClosed();
+        return data;
+    }
+
+    template<typename Key, typename Value, typename Compare>
+    bool MultiPriorityQueue<Key, Value, Compare>::pop_min(value_type& data) {
+        return wait_pop(data, [this](EventCount::Key key) {
+            event.commit_wait(key);
+            return true;
+        });
+    }
+
+    template<typename Key, typename Value, typename Compare>
+    template<typename Clock, typename Duration>
+    bool MultiPriorityQueue<Key, Value, Compare>::pop_min_until(
+        value_type& data, const std::chrono::time_point<Clock, Duration>& deadline) {
+        return wait_pop(data, [this, &deadline](EventCount::Key key) {
+            return event.commit_wait_until(key, deadline);
+        });
+    }
+
+    // see MultiQueue::close
+    template<typename Key, typename Value, typename Compare>
+    void MultiPriorityQueue<Key, Value, Compare>::close() {
+        for (std::size_t i = 0; i != num_queues; ++i)
+            heaps[i].m.lock();
+        closed.store(true);
+        for (std::size_t i = 0; i != num_queues; ++i)
+            heaps[i].m.unlock();
+        event.notify_all();
+    }
+}
+
+#endif
@@ -0,0 +1,83 @@
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <cstdio>
+#include <deque>
+#include <thread>
+#include <vector>
+
+#include "queue.hpp"
+
+using namespace utility;
+using namespace std::chrono_literals;
+
+/*
+Timed pops and close() of both LockBasedQueues: a timed pop waits at least its timeout, close() wakes
+the consumers blocked on an empty queue, and every element pushed before close() is still popped.
+Build with -O2 -pthread, or -fsanitize=thread.
+*/
+
+template<typename Queue>
+void timed_pop() {
+    Queue q;
+    int x;
+    auto start = std::chrono::steady_clock::now();
+    assert(!q.pop_for(x, 20ms));
+    assert(std::chrono::steady_clock::now() - start >= 20ms);
+    std::thread t([&] {
+        std::this_thread::sleep_for(10ms);
+        q.push(1);
+    });
+    assert(q.pop_for(x, 10s) && x == 1);
+    t.join();
+}
+
+template<typename Queue>
+void close_wakes_consumers() {
+    Queue q;
+    std::atomic<int> popped{0}, woken{0};
+    std::vector<std::thread> consumers;
+    for (int i = 0; i != 4; ++i)
+        consumers.emplace_back([&] {
+            int x;
+            while (q.pop(x))
+                ++popped;
+            ++woken;
+        });
+    std::vector<std::thread> producers;
+    std::atomic<int> pushed{0};
+    for (int i = 0; i != 2; ++i)
+        producers.emplace_back([&] {
+            try {
+                for (int j = 0; ; ++j) {
+                    q.push(j);
+                    ++pushed;
+                }
+            }
+            catch (QueueClosed&) {}
+        });
+    std::this_thread::sleep_for(10ms);
+    q.close();
+    for (auto& t: producers)
+        t.join();
+    for (auto& t: consumers)
+        t.join();
+    assert(woken == 4 && popped == pushed);
+    assert(q.is_closed() && q.empty());
+    bool threw = false;
+    try {
+        q.pop();
+    }
+    catch (QueueClosed&) {
+        threw = true;
+    }
+    assert(threw);
+}
+
+int main() {
+    timed_pop<LockBasedQueue<int, std::deque<int>>>();
+    timed_pop<LockBasedQueue<int>>();
+    close_wakes_consumers<LockBasedQueue<int, std::deque<int>>>();
+    close_wakes_consumers<LockBasedQueue<int>>();
+    std::printf("ok\n");
+}
@@ -7,9 +7,24 @@
 #include <queue>
 #include <memory>
 #include <future>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <stdexcept>
+#include <type_traits>
+#include <memory_resource>
 #include <condition_variable>
 
+#include "cache_line.hpp"
+#include "memory_resource.hpp"
+#include "trace.hpp"
+
 namespace utility{
+    // thrown by pushing to a closed queue, or by pop() when a closed queue runs out of data
+    struct QueueClosed: std::runtime_error {
+        QueueClosed(): std::runtime_error("queue is closed") {}
+    };
+
     template<typename T, typename Container>
     class LockBasedQueue;
 
@@ -27,47 +42,60 @@ namespace utility{
         return res;
     }
 
+    /*
+    Blocking queue with a single mutex.
+    After close(), pushing throws QueueClosed, the data already in the queue can still be popped,
+    and then pop(T&), pop_for() and pop_until() return false without blocking.
+    The allocator constructors take anything Container can be constructed with, e.g., a
+    std::pmr::memory_resource* for the std::pmr containers.
+    */
     template<typename T, typename Container=std::list<T>>
     class LockBasedQueue {
+        template<typename Alloc>
+        using EnableIfAlloc = std::enable_if_t<std::uses_allocator<Container, Alloc>::value>;
     public:
         // constructors
         explicit LockBasedQueue(const Container& c): data_queue(c) {}
         explicit LockBasedQueue(Container&& c=Container()): data_queue(std::move(c)) {}
-        template<typename Alloc> 
+        template<typename Alloc, typename=EnableIfAlloc<Alloc>>
         explicit LockBasedQueue(const Alloc& a): data_queue(a) {}
-        template<typename Alloc> 
+        template<typename Alloc, typename=EnableIfAlloc<Alloc>>
         LockBasedQueue(const Container& c, const Alloc& a): data_queue(c, a) {}
-        template<typename Alloc> 
+        template<typename Alloc, typename=EnableIfAlloc<Alloc>>
         LockBasedQueue(Container&& c, const Alloc& a): data_queue(std::move(c), a) {}
-        LockBasedQueue(LockBasedQueue&& other) {
-            std::scoped_lock l(m, other.m);
-            data_queue(std::move(other.data_queue));
-        }
-        LockBasedQueue(const LockBasedQueue& other) {
-            std::scoped_lock l(m, other.m);
-            data_queue(other.data_queue);
-        }
-
-        template<typename Alloc>
-        LockBasedQueue(LockBasedQueue&& other, const Alloc& a) {
-            std::scoped_lock l(other.m);
-            data_queue(std::move(other.data_queue), a);
-        }
+        LockBasedQueue(LockBasedQueue&& other): data_queue(other.take()) {}
+        LockBasedQueue(const LockBasedQueue& other): data_queue(other.copy()) {}
+        template<typename Alloc, typename=EnableIfAlloc<Alloc>>
+        LockBasedQueue(LockBasedQueue&& other, const Alloc& a): data_queue(other.take(), a) {}
+        template<typename Alloc, typename=EnableIfAlloc<Alloc>>
+        LockBasedQueue(const LockBasedQueue& other, const Alloc& a): data_queue(other.copy(), a) {}
 
         // assignments
         LockBasedQueue& operator=(LockBasedQueue&& rhs) {
-            std::scoped_lock l(m, rhs.m);
-            data_queue = std::move(rhs.data_queue); 
+            if (this != &rhs) {
+                std::scoped_lock l(m, rhs.m);
+                data_queue = std::move(rhs.data_queue);
+                notify(data_queue.size());
+            }
+            return *this;
         }
-        LockBasedQueue& operator=(const LockBasedQueue& rhs) { 
-            std::scoped_lock l(m, rhs.m);
-            data_queue = rhs.data_queue; 
+        LockBasedQueue& operator=(const LockBasedQueue& rhs) {
+            if (this != &rhs) {
+                std::scoped_lock l(m, rhs.m);
+                data_queue = rhs.data_queue;
+                notify(data_queue.size());
+            }
+            return *this;
         }
 
         // general purpose operations
         void swap(LockBasedQueue& other) {
+            if (this == &other)
+                return;
             std::scoped_lock l(m, other.m);
             data_queue.swap(other.data_queue);
+            notify(data_queue.size());
+            other.notify(other.data_queue.size());
         }
         bool empty() const {
             std::lock_guard l(m);
@@ -83,58 +111,163 @@ namespace utility{
         void push(T&&);
         template <typename... Args>
         void emplace(Args&&... args);
+        // pushes [first, last) under a single lock, use move iterators to move the data
+        template<typename InputIt>
+        void push_bulk(InputIt first, InputIt last);
         T pop();
+        bool pop(T&);
         bool try_pop(T&);
+        template<typename Rep, typename Period>
+        bool pop_for(T& data, const std::chrono::duration<Rep, Period>& d) {
+            return pop_until(data, std::chrono::steady_clock::now() + d);
+        }
+        template<typename Clock, typename Duration>
+        bool pop_until(T&, const std::chrono::time_point<Clock, Duration>&);
+        void close();
+        bool is_closed() const {
+            std::lock_guard l(m);
+            return closed;
+        }
         // delete front() and back(), these functions may waste notifications. To enable these function, one should replace notify_one() with notify_all() in push() and emplace()
         T& front() = delete;
         const T& front() const = delete;
         T& back() = delete;
         const T& back() const = delete;
     private:
-        mutable std::mutex m;
+        std::queue<T, Container> take() {
+            std::lock_guard l(m);
+            return std::move(data_queue);
+        }
+        std::queue<T, Container> copy() const {
+            std::lock_guard l(m);
+            return data_queue;
+        }
+        void check_open() const {
+            if (closed)
+                throw QueueClosed();
+        }
+        bool ready() const {    // requires m
+            return !data_queue.empty() || closed;
+        }
+        void wait_for_data(std::unique_lock<std::mutex>& l) {
+            if (ready())
+                return;
+            CONCURRENCY_TRACE_SCOPE("pop");
+            ++waiters;
+            data_cond.wait(l, [this]{ return ready(); });
+            --waiters;
+        }
+        template<typename Clock, typename Duration>
+        void wait_for_data(std::unique_lock<std::mutex>& l,
+            const std::chrono::time_point<Clock, Duration>& deadline) {
+            if (ready())
+                return;
+            CONCURRENCY_TRACE_SCOPE("pop");
+            ++waiters;
+            data_cond.wait_until(l, deadline, [this]{ return ready(); });
+            --waiters;
+        }
+        // skip the notification when nobody is waiting
+        void notify(std::size_t n=1) {
+            if (waiters) {
+                if (n > 1)
+                    data_cond.notify_all();
+                else
+                    data_cond.notify_one();
+            }
+        }
+        bool pop_data(T& data) {
+            if (data_queue.empty())
+                return false;
+            data = std::move(data_queue.front());
+            data_queue.pop();
+            return true;
+        }
+
+        // one lock for both ends, keep it off the lines of neighbouring objects
+        alignas(cache_line_size) mutable std::mutex m;
         std::queue<T, Container> data_queue;
         std::condition_variable data_cond;
+        std::size_t waiters = 0;    // protected by m
+        bool closed = false;        // protected by m
     };
 
     template<typename T, typename Container>
     void LockBasedQueue<T, Container>::push(const T& data) {
         std::lock_guard l(m);
+        check_open();
         data_queue.push(data);
-        data_cond.notify_one();
+        notify();
     }
 
     template<typename T, typename Container>
     void LockBasedQueue<T, Container>::push(T&& data) {
         std::lock_guard l(m);
+        check_open();
         data_queue.push(std::move(data));
-        data_cond.notify_one();
+        notify();
     }
 
     template<typename T, typename Container>
     template<typename... Args>
     void LockBasedQueue<T, Container>::emplace(Args&&... args) {
         std::lock_guard l(m);
+        check_open();
         data_queue.emplace(std::forward<Args>(args)...);
-        data_cond.notify_one();
+        notify();
+    }
+
+    template<typename T, typename Container>
+    template<typename InputIt>
+    void LockBasedQueue<T, Container>::push_bulk(InputIt first, InputIt last) {
+        std::lock_guard l(m);
+        check_open();
+        std::size_t n = 0;
+        for (; first != last; ++first, ++n)
+            data_queue.push(*first);
+        notify(n);
     }
 
     template<typename T, typename Container>
     T LockBasedQueue<T, Container>::pop() {
         std::unique_lock l(m);
-        data_cond.wait(l, [this]{ return !data_queue.empty(); });
+        wait_for_data(l);
+        if (data_queue.empty())
+            throw QueueClosed();
         auto data = std::move(data_queue.front());
         data_queue.pop();
         return data;
     }
 
+    template<typename T, typename Container>
+    bool LockBasedQueue<T, Container>::pop(T& data) {
+        std::unique_lock l(m);
+        wait_for_data(l);
+        return pop_data(data);
+    }
+
     template<typename T, typename Container>
     bool LockBasedQueue<T, Container>::try_pop(T& data) {
         std::lock_guard l(m);
-        if (data_queue.empty())
-            return false;
-        data = std::move(data_queue.front());
-        data_queue.pop();
-        return true;
+        return pop_data(data);
+    }
+
+    template<typename T, typename Container>
+    template<typename Clock, typename Duration>
+    bool LockBasedQueue<T, Container>::pop_until(
+        T& data, const std::chrono::time_point<Clock, Duration>& deadline) {
+        std::unique_lock l(m);
+        wait_for_data(l, deadline);
+        return pop_data(data);
+    }
+
+    template<typename T, typename Container>
+    void LockBasedQueue<T, Container>::close() {
+        {
+            std::lock_guard l(m);
+            closed = true;
+        }
+        data_cond.notify_all();
     }
 
     // template<typename T, typename Container>
@@ -165,12 +298,22 @@ namespace utility{
     //     return data_queue.back();
     // }
 
+    /*
+    Two-lock queue of Listing 6.7-6.10, close() behaves as in the generic queue.
+    Nodes and data are allocated from the memory_resource of the allocator, which must be thread-safe
+    as producers allocate and consumers free, see ThreadCachingResource.
+    */
     template<typename T>
     class LockBasedQueue<T, std::list<T>> {
     public:
+        using allocator_type = std::pmr::polymorphic_allocator<T>;
+
         // constructors
-        LockBasedQueue(): head(std::make_unique<Node>()), tail(head.get()) {}
+        explicit LockBasedQueue(const allocator_type& a={}):
+            head(make_pmr_unique<Node>(a.resource())), tail(head.get()), resource(a.resource()) {}
+        // the new queue uses the memory_resource of other
         LockBasedQueue(LockBasedQueue&&);
+        ~LockBasedQueue();
 
         // assignments
         LockBasedQueue& operator=(LockBasedQueue&&);
@@ -185,17 +328,34 @@ namespace utility{
         void push(T&&);
         template <typename... Args>
         void emplace(Args&&... args);
+        // pushes [first, last) under a single lock, use move iterators to move the data
+        template<typename InputIt>
+        void push_bulk(InputIt first, InputIt last);
         T pop();
+        bool pop(T&);
         bool try_pop(T&);
+        template<typename Rep, typename Period>
+        bool pop_for(T& data, const std::chrono::duration<Rep, Period>& d) {
+            return pop_until(data, std::chrono::steady_clock::now() + d);
+        }
+        template<typename Clock, typename Duration>
+        bool pop_until(T&, const std::chrono::time_point<Clock, Duration>&);
+        void close();
+        bool is_closed() const {
+            std::lock_guard l(tail_mutex);
+            return closed;
+        }
         // delete front() and back(), these functions may waste notifications. To enable these function, one should replace notify_one() with notify_all() in push() and emplace()
         T& front() = delete;
         const T& front() const = delete;
         T& back() = delete;
         const T& back() const = delete;
+
+        allocator_type get_allocator() const { return allocator_type(resource); }
     private:
         struct Node {
-            std::unique_ptr<T> data;    // data is a pointer as it may be empty
-            std::unique_ptr<Node> next;
+            PmrUniquePtr<T> data;   // data is a pointer as it may be empty
+            PmrUniquePtr<Node> next;
         };
 
         Node* get_tail() const {
@@ -206,74 +366,115 @@ namespace utility{
             std::lock_guard l(head_mutex);
             return head.get();
         }
+        bool ready() const {    // requires head_mutex
+            return head.get() != get_tail() || closed;
+        }
+        // a consumer registers itself as a waiter before it checks for data (again) so that 
+        // a push either is seen by the check or sees the waiter, see notify()
         std::unique_lock<std::mutex> get_head_lock() const {
             std::unique_lock l(head_mutex);
-            data_cond.wait(l, [this] { return head.get() != get_tail(); });
+            if (!ready()) {
+                CONCURRENCY_TRACE_SCOPE("pop");
+                waiters.fetch_add(1);
+                data_cond.wait(l, [this] { return ready(); });
+                waiters.fetch_sub(1);
+            }
+            return l;
+        }
+        template<typename Clock, typename Duration>
+        std::unique_lock<std::mutex> get_head_lock(
+            const std::chrono::time_point<Clock, Duration>& deadline) const {
+            std::unique_lock l(head_mutex);
+            if (!ready()) {
+                CONCURRENCY_TRACE_SCOPE("pop");
+                waiters.fetch_add(1);
+                data_cond.wait_until(l, deadline, [this] { return ready(); });
+                waiters.fetch_sub(1);
+            }
             return l;
         }
+        // push does not hold head_mutex, so we take it before notifying to avoid waking a 
+        // consumer that is between checking for data and blocking. Both the lock and the 
+        // notification are skipped when nobody is waiting
+        void notify(std::size_t n=1) {
+            if (waiters.load()) {
+                { std::lock_guard l(head_mutex); }
+                if (n > 1)
+                    data_cond.notify_all();
+                else
+                    data_cond.notify_one();
+            }
+        }
+        void check_open() const {   // requires tail_mutex
+            if (closed)
+                throw QueueClosed();
+        }
         T pop_data() {
             auto data = std::move(*head->data);
-            head = std::move(head->next);   // we move head to the next so that the tail is always valid
+            // we move head to the next so that the tail is always valid. The old head is kept until
+            // the assignment is done, as it reads the deleter of next after freeing the node
+            auto old_head = std::move(head);
+            head = std::move(old_head->next);
             return std::move(data);
         }
 
-        std::unique_ptr<Node> head;
-        Node* tail;
+        // consumers' end, data_cond is waited on with head_mutex
+        alignas(cache_line_size) PmrUniquePtr<Node> head;
         mutable std::mutex head_mutex;
-        mutable std::mutex tail_mutex;
         mutable std::condition_variable data_cond;
+        // producers' end
+        alignas(cache_line_size) Node* tail;
+        std::pmr::memory_resource* const resource;
+        mutable std::mutex tail_mutex;
+        bool closed = false;    // written with both mutexes held, read with either
+        // read by every push, but only written by consumers about to block
+        alignas(cache_line_size) mutable std::atomic<std::size_t> waiters{0};
     };
 
+    // other is left empty
     template<typename T>
     LockBasedQueue<T, std::list<T>>::LockBasedQueue(
-        LockBasedQueue<T, std::list<T>>&& other) {
-        {
-            std::scoped_lock l(head_mutex, other.head_mutex);
-            head(std::move(other.data_queue));
-        }
-        {
-            std::lock_guard l(tail_mutex);
-            tail = head.get();
-        }
-        {
-            std::lock_guard l(other.tail_mutex);
-            other.tail = nullptr;
+        LockBasedQueue<T, std::list<T>>&& other): LockBasedQueue(other.get_allocator()) {
+        swap(other);
+    }
+
+    // frees the nodes one by one, as destroying head would recurse down the whole chain
+    template<typename T>
+    LockBasedQueue<T, std::list<T>>::~LockBasedQueue() {
+        while (head) {
+            auto old_head = std::move(head);
+            head = std::move(old_head->next);
         }
     }
 
+    // the data of rhs is moved as a whole, the nodes keep the memory_resource they came from
     template<typename T>
     LockBasedQueue<T, std::list<T>>& 
     LockBasedQueue<T, std::list<T>>::operator=(
         LockBasedQueue<T, std::list<T>>&& rhs) {
-        {
-            std::scoped_lock l(head_mutex, rhs.head_mutex);
-            head(std::move(rhs.data_queue));
-        }
-        {
-            std::lock_guard l(tail_mutex);
-            tail = head.get();
-        }
-        {
-            std::lock_guard l(rhs.tail_mutex);
-            rhs.tail = nullptr;
-        }
+        LockBasedQueue tmp(std::move(rhs));
+        swap(tmp);
+        return *this;
     }
 
     template<typename T>
     void LockBasedQueue<T, std::list<T>>::swap(
         LockBasedQueue<T, std::list<T>>& other) {
+        if (this == &other)
+            return;
         {
-            std::scoped_lock l(head_mutex, other.head_mutex);
-            head(std::move(other.data_queue));
-        }
-        {
-            std::lock_guard l(tail_mutex);
-            tail = head.get();
-        }
-        {
-            std::lock_guard l(other.tail_mutex);
-            other.tail = other.head.get();
+            // both head_mutexes before both tail_mutexes, in address order, so that the
+            // lock order agrees with pop()
+            auto a = this < &other? this: &other;
+            auto b = this < &other? &other: this;
+            std::lock_guard la(a->head_mutex), lb(b->head_mutex);
+            std::lock_guard lc(a->tail_mutex), ld(b->tail_mutex);
+            head.swap(other.head);
+            std::swap(tail, other.tail);
         }
+        // consumers of either queue may now find data
+        data_cond.notify_all();
+        other.data_cond.notify_all();
     }
 
     template<typename T>
@@ -283,9 +484,10 @@ namespace utility{
 
     template<typename T>
     std::size_t LockBasedQueue<T, std::list<T>>::size() const {
-        int n = 0;
-        std::lock_guard l(tail_mutex);  // do not use get_tail() here to avoid race condition
-        for (auto p = get_head(); p != tail; p = p->next.get())
+        std::size_t n = 0;
+        // both ends are held during the walk, head_mutex first as in pop()
+        std::scoped_lock l(head_mutex, tail_mutex);
+        for (auto p = head.get(); p != tail; p = p->next.get())
             ++n;
         return n;
     }
@@ -306,34 +508,72 @@ namespace utility{
     template<typename T>
     void LockBasedQueue<T, std::list<T>>::push(T&& data) {
         {
-            auto p = std::make_unique<Node>();
+            auto p = make_pmr_unique<Node>(resource);
             std::lock_guard l(tail_mutex);
-            tail->data = std::make_unique<T>(std::move(data));   // we add data to the current tail, this allows us to move head to the next when popping
+            check_open();
+            tail->data = make_pmr_unique<T>(resource, std::move(data));   // we add data to the current tail, this allows us to move head to the next when popping
             tail->next = std::move(p);
             tail = tail->next.get();
         }
-        data_cond.notify_one();
+        notify();
     }
 
     template<typename T>
     template<typename...Args>
     void LockBasedQueue<T, std::list<T>>::emplace(Args&&... args) {
         {
-            auto p = std::make_unique<Node>();
+            auto p = make_pmr_unique<Node>(resource);
             std::lock_guard l(tail_mutex);
-            tail->data = std::make_unique<T>(std::forward<Args>(args)...);
+            check_open();
+            tail->data = make_pmr_unique<T>(resource, std::forward<Args>(args)...);
             tail->next = std::move(p);
             tail = tail->next.get();
         }
-        data_cond.notify_one();
+        notify();
+    }
+
+    template<typename T>
+    template<typename InputIt>
+    void LockBasedQueue<T, std::list<T>>::push_bulk(InputIt first, InputIt last) {
+        if (first == last)
+            return;
+        // build the chain outside the lock, the first data goes to the current tail
+        auto data = make_pmr_unique<T>(resource, *first);
+        auto chain = make_pmr_unique<Node>(resource);
+        auto last_node = chain.get();
+        std::size_t n = 1;
+        for (++first; first != last; ++first, ++n) {
+            last_node->data = make_pmr_unique<T>(resource, *first);
+            last_node->next = make_pmr_unique<Node>(resource);
+            last_node = last_node->next.get();
+        }
+        {
+            std::lock_guard l(tail_mutex);
+            check_open();
+            tail->data = std::move(data);
+            tail->next = std::move(chain);
+            tail = last_node;
+        }
+        notify(n);
     }
 
     template<typename T>
     T LockBasedQueue<T, std::list<T>>::pop() {
         auto l(get_head_lock());
+        if (head.get() == get_tail())
+            throw QueueClosed();
         return pop_data();
     }
 
+    template<typename T>
+    bool LockBasedQueue<T, std::list<T>>::pop(T& data) {
+        auto l(get_head_lock());
+        if (head.get() == get_tail())
+            return false;
+        data = pop_data();
+        return true;
+    }
+
     template<typename T>
     bool LockBasedQueue<T, std::list<T>>::try_pop(T& data) {
         std::lock_guard l(head_mutex);
@@ -343,6 +583,26 @@ namespace utility{
         return true;
     }
 
+    template<typename T>
+    template<typename Clock, typename Duration>
+    bool LockBasedQueue<T, std::list<T>>::pop_until(
+        T& data, const std::chrono::time_point<Clock, Duration>& deadline) {
+        auto l(get_head_lock(deadline));
+        if (head.get() == get_tail())
+            return false;
+        data = pop_data();
+        return true;
+    }
+
+    template<typename T>
+    void LockBasedQueue<T, std::list<T>>::close() {
+        {
+            std::scoped_lock l(head_mutex, tail_mutex);
+            closed = true;
+        }
+        data_cond.notify_all();
+    }
+
     // template<typename ReturnType, typename... Args, 
     //     typename Container=std::list<ReturnType(Args...)>,
     //     typename ThreadQueue=LockBasedQueue<std::packaged_task<ReturnType(Args...)>, Container>>
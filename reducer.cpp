@@ -0,0 +1,59 @@
+#include <atomic>
+#include <cassert>
+#include <cstdio>
+#include <thread>
+#include <vector>
+
+#include "reducer.hpp"
+
+using namespace utility;
+
+/*
+Threads updating counters, min/max reducers and a histogram, with fewer cells than threads so that
+cells are shared, while another thread harvests the counter: no update is lost or counted twice.
+Build with -O2 -pthread, or -fsanitize=thread.
+*/
+
+constexpr int num_threads = 6;
+constexpr long per_thread = 50000;
+
+int main() {
+    ShardedCounter<long> counter(2);
+    MinReducer<long> low(2);
+    MaxReducer<long> high(2);
+    auto hist = Histogram<long>::linear(100, 100, 9, 2);
+    std::atomic<bool> updating{true};
+    long harvested = 0;
+    std::thread harvester([&] {
+        while (updating)
+            harvested += counter.sum_and_reset();
+    });
+    std::vector<std::thread> ts;
+    for (int t = 0; t != num_threads; ++t)
+        ts.emplace_back([&, t] {
+            for (long i = 0; i != per_thread; ++i) {
+                ++counter;
+                auto v = t * per_thread + i;
+                low.update(v);
+                high.update(v);
+                hist.record(v % 1000);
+            }
+        });
+    for (auto& t: ts)
+        t.join();
+    updating = false;
+    harvester.join();
+
+    long n = num_threads * per_thread;
+    assert(harvested + counter.sum() == n);
+    assert(low.value() == 0 && high.value() == n - 1);
+    // the values 0 to 999 are recorded equally often; the buckets are [0, 100], (100, 200], ...,
+    // (900, 999]
+    auto counts = hist.counts();
+    assert(hist.count() == std::uint64_t(n) && counts.size() == 10);
+    for (std::size_t b = 0; b != counts.size(); ++b)
+        assert(counts[b] == std::uint64_t(n / 1000 * (b == 0? 101: b == 9? 99: 100)));
+    assert(hist.sum() == n / 1000 * (999 * 1000 / 2));
+    assert(hist.quantile(0.5) == 500);
+    std::printf("ok\n");
+}
@@ -0,0 +1,261 @@
+#ifndef CONCURRENCY_REDUCER_H_
+#define CONCURRENCY_REDUCER_H_
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <numeric>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "cache_line.hpp"
+
+namespace utility {
+    namespace detail {
+        // a power of two, so that a thread index is reduced with a mask
+        inline std::size_t default_cells() {
+            std::size_t n = 1;
+            while (n < 2 * std::max(1u, std::thread::hardware_concurrency()))
+                n *= 2;
+            return n;
+        }
+        inline std::size_t round_up_cells(std::size_t n) {
+            std::size_t m = 1;
+            while (m < n)
+                m *= 2;
+            return m;
+        }
+
+        template<typename T>
+        struct Min {
+            T operator()(const T& a, const T& b) const { return std::min(a, b); }
+        };
+        template<typename T>
+        struct Max {
+            T operator()(const T& a, const T& b) const { return std::max(a, b); }
+        };
+    }
+
+    /*
+    Sharded reduction in the style of LongAdder: every thread updates a cell of its own on a cache line
+    of its own, so updates do not contend as long as there are no more threads than cells, and a read
+    folds the cells with op, which costs O(cells). op must be associative and commutative with identity
+    as its neutral element, and T trivially copyable so that cells are atomics.
+    A read concurrent with updates sees each update either entirely or not at all, but not
+    necessarily in the order they were made; reset() may lose updates concurrent with it.
+    */
+    template<typename T, typename Op>
+    class Reducer {
+        static_assert(std::is_trivially_copyable<T>::value, "T must be trivially copyable");
+    public:
+        explicit Reducer(T identity=T(), Op op=Op(), std::size_t num_cells=detail::default_cells()):
+            cells(new Cell[detail::round_up_cells(num_cells)]),
+            mask(detail::round_up_cells(num_cells) - 1), identity(identity), op(op) {
+            reset();
+        }
+
+        void update(const T& x);
+        T value() const;
+        void reset() {
+            for (std::size_t i = 0; i <= mask; ++i)
+                cells[i].value.store(identity, std::memory_order_relaxed);
+        }
+        // folds and resets the cells, every update is seen by exactly one call
+        T value_and_reset();
+    protected:
+        struct alignas(cache_line_size) Cell {
+            std::atomic<T> value;
+        };
+        Cell& local() const { return cells[detail::thread_index() & mask]; }
+
+        std::unique_ptr<Cell[]> cells;
+        std::size_t mask;
+        T identity;
+        Op op;
+    };
+
+    template<typename T, typename Op>
+    void Reducer<T, Op>::update(const T& x) {
+        auto& v = local().value;
+        if constexpr (std::is_integral<T>::value && std::is_same<Op, std::plus<T>>::value)
+            v.fetch_add(x, std::memory_order_relaxed);
+        else {
+            // the cell is shared only by threads with the same index, so this rarely loops
+            auto old = v.load(std::memory_order_relaxed);
+            T desired;
+            do {
+                desired = op(old, x);
+                if (desired == old)     // e.g., a max not exceeded, save the write
+                    return;
+            } while (!v.compare_exchange_weak(old, desired, std::memory_order_relaxed));
+        }
+    }
+
+    template<typename T, typename Op>
+    T Reducer<T, Op>::value() const {
+        auto res = identity;
+        for (std::size_t i = 0; i <= mask; ++i)
+            res = op(res, cells[i].value.load(std::memory_order_relaxed));
+        return res;
+    }
+
+    template<typename T, typename Op>
+    T Reducer<T, Op>::value_and_reset() {
+        auto res = identity;
+        for (std::size_t i = 0; i <= mask; ++i)
+            res = op(res, cells[i].value.exchange(identity, std::memory_order_relaxed));
+        return res;
+    }
+
+    template<typename T>
+    using SumReducer = Reducer<T, std::plus<T>>;
+
+    template<typename T>
+    class MinReducer: public Reducer<T, detail::Min<T>> {
+    public:
+        explicit MinReducer(std::size_t num_cells=detail::default_cells()):
+            Reducer<T, detail::Min<T>>(std::numeric_limits<T>::max(), {}, num_cells) {}
+    };
+
+    template<typename T>
+    class MaxReducer: public Reducer<T, detail::Max<T>> {
+    public:
+        explicit MaxReducer(std::size_t num_cells=detail::default_cells()):
+            Reducer<T, detail::Max<T>>(std::numeric_limits<T>::lowest(), {}, num_cells) {}
+    };
+
+    // counter for statistics updated by many threads, see Reducer
+    template<typename T=long>
+    class ShardedCounter: public SumReducer<T> {
+    public:
+        explicit ShardedCounter(std::size_t num_cells=detail::default_cells()):
+            SumReducer<T>(T(0), {}, num_cells) {}
+
+        void add(T n) { this->update(n); }
+        ShardedCounter& operator++() { add(1); return *this; }
+        ShardedCounter& operator--() { add(-1); return *this; }
+        ShardedCounter& operator+=(T n) { add(n); return *this; }
+        ShardedCounter& operator-=(T n) { add(-n); return *this; }
+        T sum() const { return this->value(); }
+        T sum_and_reset() { return this->value_and_reset(); }
+    };
+
+    /*
+    Histogram over the buckets (-inf, bounds[0]], (bounds[0], bounds[1]], ..., (bounds[n-1], +inf),
+    sharded as Reducer: a thread counts into buckets of its own, and reads merge them.
+    */
+    template<typename T=double>
+    class Histogram {
+    public:
+        explicit Histogram(std::vector<T> upper_bounds, std::size_t num_cells=detail::default_cells());
+        // bounds first, first * factor, first * factor^2, ...
+        static Histogram exponential(T first, T factor, std::size_t num_bounds,
+            std::size_t num_cells=detail::default_cells());
+        static Histogram linear(T first, T width, std::size_t num_bounds,
+            std::size_t num_cells=detail::default_cells());
+
+        void record(const T& value, std::uint64_t n=1);
+
+        const std::vector<T>& bounds() const { return upper_bounds; }
+        // one count per bucket, bounds().size() + 1 in total
+        std::vector<std::uint64_t> counts() const;
+        std::uint64_t count() const;
+        T sum() const { return total.value(); }
+        // upper bound of the bucket holding the q-quantile, max() of T for the last bucket
+        T quantile(double q) const;
+        void reset();
+    private:
+        struct alignas(cache_line_size) Line {
+            static constexpr std::size_t size = cache_line_size / sizeof(std::atomic<std::uint64_t>);
+            std::atomic<std::uint64_t> counts[size];
+        };
+        std::atomic<std::uint64_t>& bucket(std::size_t cell, std::size_t b) const {
+            return lines[cell * lines_per_cell + b / Line::size].counts[b % Line::size];
+        }
+
+        std::vector<T> upper_bounds;
+        std::size_t num_buckets;
+        std::size_t lines_per_cell;
+        std::size_t mask;
+        std::unique_ptr<Line[]> lines;
+        SumReducer<T> total;
+    };
+
+    template<typename T>
+    Histogram<T>::Histogram(std::vector<T> upper_bounds, std::size_t num_cells):
+        upper_bounds(std::move(upper_bounds)), num_buckets(this->upper_bounds.size() + 1),
+        lines_per_cell((num_buckets + Line::size - 1) / Line::size),
+        mask(detail::round_up_cells(num_cells) - 1),
+        lines(new Line[(mask + 1) * lines_per_cell]), total(T(0), {}, num_cells) {
+        std::sort(this->upper_bounds.begin(), this->upper_bounds.end());
+        reset();
+    }
+
+    template<typename T>
+    Histogram<T> Histogram<T>::exponential(T first, T factor, std::size_t num_bounds, std::size_t num_cells) {
+        std::vector<T> b;
+        for (auto x = first; b.size() != num_bounds; x *= factor)
+            b.push_back(x);
+        return Histogram(std::move(b), num_cells);
+    }
+
+    template<typename T>
+    Histogram<T> Histogram<T>::linear(T first, T width, std::size_t num_bounds, std::size_t num_cells) {
+        std::vector<T> b;
+        for (std::size_t i = 0; i != num_bounds; ++i)
+            b.push_back(first + width * T(i));
+        return Histogram(std::move(b), num_cells);
+    }
+
+    template<typename T>
+    void Histogram<T>::record(const T& value, std::uint64_t n) {
+        auto b = std::lower_bound(upper_bounds.begin(), upper_bounds.end(), value) - upper_bounds.begin();
+        bucket(detail::thread_index() & mask, b).fetch_add(n, std::memory_order_relaxed);
+        total.update(value * T(n));
+    }
+
+    template<typename T>
+    std::vector<std::uint64_t> Histogram<T>::counts() const {
+        std::vector<std::uint64_t> res(num_buckets);
+        for (std::size_t c = 0; c <= mask; ++c)
+            for (std::size_t b = 0; b != num_buckets; ++b)
+                res[b] += bucket(c, b).load(std::memory_order_relaxed);
+        return res;
+    }
+
+    template<typename T>
+    std::uint64_t Histogram<T>::count() const {
+        auto c = counts();
+        return std::accumulate(c.begin(), c.end(), std::uint64_t(0));
+    }
+
+    template<typename T>
+    T Histogram<T>::quantile(double q) const {
+        auto c = counts();
+        auto n = std::accumulate(c.begin(), c.end(), std::uint64_t(0));
+        auto rank = static_cast<std::uint64_t>(std::clamp(q, 0.0, 1.0) * n);
+        std::uint64_t seen = 0;
+        for (std::size_t b = 0; b != upper_bounds.size(); ++b) {
+            seen += c[b];
+            if (seen > rank || (seen == n && n))
+                return upper_bounds[b];
+        }
+        return std::numeric_limits<T>::max();
+    }
+
+    template<typename T>
+    void Histogram<T>::reset() {
+        for (std::size_t c = 0; c <= mask; ++c)
+            for (std::size_t b = 0; b != num_buckets; ++b)
+                bucket(c, b).store(0, std::memory_order_relaxed);
+        total.reset();
+    }
+}
+
+#endif
@@ -0,0 +1,72 @@
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "shm_queue.hpp"
+
+using namespace utility;
+
+/*
+A child process writes numbered messages in place into a queue in a memfd, and the parent reads
+them without copying, holding on to a few slices at a time. Build with -O2 (-lrt on older glibc).
+*/
+
+// slices held by the consumer keep their room, so a full ring must not be read past them
+void full_ring() {
+    auto q = SharedMemoryQueue::create_anonymous(64);   // room for 4 messages of 8 bytes
+    for (long i = 0; i != 4; ++i)
+        assert(q.try_push(&i, sizeof i));
+    long extra = 4;
+    assert(!q.try_push(&extra, sizeof extra));
+    std::vector<SharedMemoryQueue::Slice> held;
+    while (auto s = q.try_read())
+        held.push_back(*s);
+    assert(held.size() == 4);
+    for (long i = 0; i != 4; ++i)
+        assert(!std::memcmp(held[i].data(), &i, sizeof i));
+    q.release(held[1]);
+    assert(q.try_push(&extra, sizeof extra) && q.try_push(&extra, sizeof extra));
+    q.release(held[3]);
+    for (int i = 0; i != 2; ++i) {
+        auto s = q.try_read();
+        assert(s && !std::memcmp(s->data(), &extra, sizeof extra));
+        q.release(*s);
+    }
+    assert(!q.try_read());
+}
+
+int main() {
+    full_ring();
+    const int n = 100000;
+    auto q = SharedMemoryQueue::create_anonymous(1 << 16);
+    auto pid = fork();
+    if (pid == 0) {
+        // a mapping of its own, at another address
+        auto p = SharedMemoryQueue::open(dup(q.fd()));
+        for (int i = 0; i != n; ++i) {
+            auto text = "message " + std::to_string(i);
+            auto r = p.reserve(text.size());
+            std::memcpy(r.data(), text.data(), text.size());
+            r.commit();
+        }
+        _exit(0);
+    }
+    std::vector<SharedMemoryQueue::Slice> batch;
+    for (int i = 0; i != n; ++i) {
+        batch.push_back(q.read());
+        assert(batch.back().view() == "message " + std::to_string(i));
+        if (batch.size() == 8) {
+            q.release(batch.back());    // releases the whole batch
+            batch.clear();
+        }
+    }
+    if (!batch.empty())
+        q.release(batch.back());
+    waitpid(pid, nullptr, 0);
+    std::printf("%d messages\n", n);
+}
@@ -0,0 +1,380 @@
+#ifndef CONCURRENCY_SHM_QUEUE_H_
+#define CONCURRENCY_SHM_QUEUE_H_
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cache_line.hpp"
+#include "futex.hpp"
+
+namespace utility {
+    /*
+    Multi-producer single-consumer queue of variable-sized messages in a memory segment shared between
+    processes, either a named POSIX shared memory object (/dev/shm) or an anonymous memfd handed to
+    other processes by fork() or over a unix socket. The segment holds nothing but offsets, so every
+    process may map it at a different address.
+    A producer reserves room for a message and writes it in place, and a commit publishes it; the
+    consumer gets a slice of the segment instead of a copy and releases it when done with it, which
+    releases the slices read before it as well. A reservation dropped without a commit is skipped.
+    Producers claim room with a CAS on a shared position, so messages are read in the order they were
+    reserved, and a slow producer holds up the messages reserved after its own until it commits.
+    Released bytes are zeroed, which is how the consumer tells a committed message from stale data.
+    Producers waiting for room and the consumer waiting for messages sleep on process-shared event
+    counts, so a commit or a release only makes a syscall when somebody sleeps.
+    A process dying with a reservation in hand stalls the consumer at that message. Only one process
+    may read from a queue at a time. Link with -lrt on glibc older than 2.34.
+    */
+    class SharedMemoryQueue {
+        struct Record;
+    public:
+        class Reservation;
+        class Slice;
+
+        // capacity is rounded up to a power of two, a message takes its size plus 8 bytes rounded up to 8
+        static SharedMemoryQueue create(const std::string& name, std::size_t capacity);
+        static SharedMemoryQueue open(const std::string& name);
+        static void unlink(const std::string& name);
+        // a queue in an anonymous memfd, other processes open it with open(fd)
+        static SharedMemoryQueue create_anonymous(std::size_t capacity);
+        static SharedMemoryQueue open(int fd);
+
+        SharedMemoryQueue(SharedMemoryQueue&& other) noexcept;
+        SharedMemoryQueue& operator=(SharedMemoryQueue&& other) noexcept;
+        ~SharedMemoryQueue();
+
+        int fd() const { return file; }
+        std::size_t capacity() const { return ctl->capacity; }
+        std::size_t max_message_size() const { return capacity() / 2 - sizeof(Record); }
+
+        // producers, reserve() blocks while the queue is full and throws std::length_error
+        // if n > max_message_size()
+        Reservation reserve(std::size_t n);
+        std::optional<Reservation> try_reserve(std::size_t n);
+        void push(const void* data, std::size_t n);
+        bool try_push(const void* data, std::size_t n);
+
+        // the consumer, a slice stays valid until it or a slice read after it is released
+        Slice read();
+        std::optional<Slice> try_read();
+        template<typename Rep, typename Period>
+        std::optional<Slice> read_for(const std::chrono::duration<Rep, Period>& d);
+        void release(const Slice& s);
+    private:
+        static constexpr std::uint64_t magic = 0x53484d5155455545;     // "SHMQUEUE"
+        static constexpr std::uint32_t ready = 1;
+        static constexpr std::uint32_t skipped = 2;
+
+        // at the start of the segment, the ring follows
+        struct Control {
+            explicit Control(std::uint64_t capacity): capacity(capacity) {}
+            std::atomic<std::uint64_t> initialized{0};  // magic once constructed
+            const std::uint64_t capacity;
+            alignas(cache_line_size) std::atomic<std::uint64_t> claim{0};  // producers
+            alignas(cache_line_size) std::atomic<std::uint64_t> head{0};   // released by the consumer
+            alignas(cache_line_size) EventCount data{true};     // the consumer waits for commits
+            alignas(cache_line_size) EventCount room{true};     // producers wait for releases
+        };
+        // precedes every message, zero until committed
+        struct Record {
+            std::atomic<std::uint32_t> state;
+            std::uint32_t size;
+        };
+        static_assert(std::atomic<std::uint64_t>::is_always_lock_free
+            && std::atomic<std::uint32_t>::is_always_lock_free, "atomics in shared memory must be address-free");
+
+        SharedMemoryQueue(int fd, std::size_t map_size);
+        static SharedMemoryQueue init(int fd, std::size_t capacity);
+        static std::uint64_t stride(std::size_t n) { return (sizeof(Record) + n + 7) & ~std::uint64_t(7); }
+        Record* record_at(std::uint64_t pos) const {
+            return reinterpret_cast<Record*>(ring + (pos & (capacity() - 1)));
+        }
+        void commit_record(std::uint64_t pos, std::size_t n, std::uint32_t state);
+        void release_to(std::uint64_t end);
+        void unmap() noexcept;
+
+        int file = -1;
+        std::size_t map_size = 0;
+        Control* ctl = nullptr;
+        char* ring = nullptr;
+        std::uint64_t next = 0;     // read by the consumer, not released yet from head to next
+    };
+
+    // room for a message, committed by commit() or skipped by the destructor
+    class SharedMemoryQueue::Reservation {
+    public:
+        Reservation(Reservation&& other) noexcept:
+            q(std::exchange(other.q, nullptr)), pos(other.pos), n(other.n) {}
+        Reservation& operator=(Reservation&& other) noexcept {
+            std::swap(q, other.q);
+            std::swap(pos, other.pos);
+            std::swap(n, other.n);
+            return *this;
+        }
+        ~Reservation() {
+            if (q)
+                q->commit_record(pos, n, skipped);
+        }
+
+        char* data() const { return q->ring + ((pos + sizeof(Record)) & (q->capacity() - 1)); }
+        std::size_t size() const { return n; }
+        void commit() {
+            std::exchange(q, nullptr)->commit_record(pos, n, ready);
+        }
+    private:
+        friend class SharedMemoryQueue;
+        Reservation(SharedMemoryQueue* q, std::uint64_t pos, std::size_t n): q(q), pos(pos), n(n) {}
+        SharedMemoryQueue* q;
+        std::uint64_t pos;
+        std::size_t n;
+    };
+
+    // a message in the segment
+    class SharedMemoryQueue::Slice {
+    public:
+        const char* data() const { return p; }
+        std::size_t size() const { return n; }
+        std::string_view view() const { return {p, n}; }
+    private:
+        friend class SharedMemoryQueue;
+        Slice(const char* p, std::size_t n, std::uint64_t end): p(p), n(n), end(end) {}
+        const char* p;
+        std::size_t n;
+        std::uint64_t end;
+    };
+
+    inline SharedMemoryQueue::SharedMemoryQueue(int fd, std::size_t size): file(fd), map_size(size) {
+        auto p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (p == MAP_FAILED) {
+            auto e = errno;
+            ::close(fd);
+            throw std::system_error(e, std::generic_category(), "mmap");
+        }
+        ctl = static_cast<Control*>(p);
+        ring = static_cast<char*>(p) + sizeof(Control);
+    }
+
+    inline SharedMemoryQueue::SharedMemoryQueue(SharedMemoryQueue&& other) noexcept:
+        file(std::exchange(other.file, -1)), map_size(std::exchange(other.map_size, 0)),
+        ctl(std::exchange(other.ctl, nullptr)), ring(std::exchange(other.ring, nullptr)), next(other.next) {}
+
+    inline SharedMemoryQueue& SharedMemoryQueue::operator=(SharedMemoryQueue&& other) noexcept {
+        if (this != &other) {
+            unmap();
+            file = std::exchange(other.file, -1);
+            map_size = std::exchange(other.map_size, 0);
+            ctl = std::exchange(other.ctl, nullptr);
+            ring = std::exchange(other.ring, nullptr);
+            next = other.next;
+        }
+        return *this;
+    }
+
+    inline SharedMemoryQueue::~SharedMemoryQueue() {
+        unmap();
+    }
+
+    inline void SharedMemoryQueue::unmap() noexcept {
+        if (ctl)
+            munmap(ctl, map_size);
+        if (file != -1)
+            ::close(file);
+    }
+
+    // the segment is zero-filled by ftruncate(), as the ring must be
+    inline SharedMemoryQueue SharedMemoryQueue::init(int fd, std::size_t capacity) {
+        std::uint64_t c = 64;
+        while (c < capacity)
+            c *= 2;
+        if (ftruncate(fd, sizeof(Control) + c) == -1) {
+            auto e = errno;
+            ::close(fd);
+            throw std::system_error(e, std::generic_category(), "ftruncate");
+        }
+        SharedMemoryQueue q(fd, sizeof(Control) + c);
+        new (q.ctl) Control(c);
+        q.ctl->initialized.store(magic, std::memory_order_release);
+        return q;
+    }
+
+    inline SharedMemoryQueue SharedMemoryQueue::create(const std::string& name, std::size_t capacity) {
+        auto fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+        if (fd == -1)
+            throw std::system_error(errno, std::generic_category(), "shm_open " + name);
+        return init(fd, capacity);
+    }
+
+    inline SharedMemoryQueue SharedMemoryQueue::create_anonymous(std::size_t capacity) {
+        auto fd = memfd_create("SharedMemoryQueue", MFD_CLOEXEC);
+        if (fd == -1)
+            throw std::system_error(errno, std::generic_category(), "memfd_create");
+        return init(fd, capacity);
+    }
+
+    inline SharedMemoryQueue SharedMemoryQueue::open(const std::string& name) {
+        auto fd = shm_open(name.c_str(), O_RDWR | O_CLOEXEC, 0);
+        if (fd == -1)
+            throw std::system_error(errno, std::generic_category(), "shm_open " + name);
+        return open(fd);
+    }
+
+    // takes over fd
+    inline SharedMemoryQueue SharedMemoryQueue::open(int fd) {
+        struct stat st;
+        if (fstat(fd, &st) == -1) {
+            auto e = errno;
+            ::close(fd);
+            throw std::system_error(e, std::generic_category(), "fstat");
+        }
+        if (static_cast<std::size_t>(st.st_size) < sizeof(Control)) {
+            ::close(fd);
+            throw std::runtime_error("not a SharedMemoryQueue, or not created yet");
+        }
+        SharedMemoryQueue q(fd, st.st_size);
+        if (q.ctl->initialized.load(std::memory_order_acquire) != magic
+            || sizeof(Control) + q.ctl->capacity != q.map_size)
+            throw std::runtime_error("not a SharedMemoryQueue, or not created yet");
+        q.next = q.ctl->head.load(std::memory_order_acquire);
+        return q;
+    }
+
+    inline void SharedMemoryQueue::unlink(const std::string& name) {
+        if (shm_unlink(name.c_str()) == -1)
+            throw std::system_error(errno, std::generic_category(), "shm_unlink " + name);
+    }
+
+    inline std::optional<SharedMemoryQueue::Reservation> SharedMemoryQueue::try_reserve(std::size_t n) {
+        if (n > max_message_size())
+            throw std::length_error("message larger than max_message_size()");
+        auto s = stride(n);
+        auto c = ctl->claim.load(std::memory_order_relaxed);
+        std::uint64_t pad;
+        do {
+            // a message never wraps around, the end of the ring is skipped instead
+            auto to_end = capacity() - (c & (capacity() - 1));
+            pad = s > to_end? to_end: 0;
+            // acquire, so that the zeroing of the released bytes is seen before they are written
+            if (c + pad + s - ctl->head.load(std::memory_order_acquire) > capacity())
+                return std::nullopt;
+        } while (!ctl->claim.compare_exchange_weak(c, c + pad + s, std::memory_order_relaxed));
+        if (pad)
+            commit_record(c, pad - sizeof(Record), skipped);
+        return Reservation(this, c + pad, n);
+    }
+
+    inline SharedMemoryQueue::Reservation SharedMemoryQueue::reserve(std::size_t n) {
+        std::optional<Reservation> r;
+        ctl->room.await([&] { return (r = try_reserve(n)).has_value(); });
+        return std::move(*r);
+    }
+
+    inline void SharedMemoryQueue::push(const void* data, std::size_t n) {
+        auto r = reserve(n);
+        std::memcpy(r.data(), data, n);
+        r.commit();
+    }
+
+    inline bool SharedMemoryQueue::try_push(const void* data, std::size_t n) {
+        auto r = try_reserve(n);
+        if (!r)
+            return false;
+        std::memcpy(r->data(), data, n);
+        r->commit();
+        return true;
+    }
+
+    inline void SharedMemoryQueue::commit_record(std::uint64_t pos, std::size_t n, std::uint32_t state) {
+        auto r = record_at(pos);
+        r->size = static_cast<std::uint32_t>(n);
+        r->state.store(state, std::memory_order_release);
+        ctl->data.notify();
+    }
+
+    inline std::optional<SharedMemoryQueue::Slice> SharedMemoryQueue::try_read() {
+        while (true) {
+            // with the ring full of slices still in use, next has wrapped around onto the first of them
+            if (next - ctl->head.load(std::memory_order_relaxed) >= capacity())
+                return std::nullopt;
+            auto r = record_at(next);
+            auto state = r->state.load(std::memory_order_acquire);
+            if (!state)
+                return std::nullopt;
+            auto pos = next;
+            next += stride(r->size);
+            if (state == ready)
+                return Slice(reinterpret_cast<const char*>(r + 1), r->size, next);
+            // skipped, released right away unless slices before it are still in use
+            if (ctl->head.load(std::memory_order_relaxed) == pos)
+                release_to(next);
+        }
+    }
+
+    inline SharedMemoryQueue::Slice SharedMemoryQueue::read() {
+        std::optional<Slice> s;
+        ctl->data.await([&] { return (s = try_read()).has_value(); });
+        return *s;
+    }
+
+    template<typename Rep, typename Period>
+    std::optional<SharedMemoryQueue::Slice> SharedMemoryQueue::read_for(
+        const std::chrono::duration<Rep, Period>& d) {
+        auto deadline = std::chrono::steady_clock::now() + d;
+        std::optional<Slice> s;
+        auto found = [&] { return (s = try_read()).has_value(); };
+        if (detail::spin_until(found))
+            return s;
+        while (true) {
+            auto key = ctl->data.prepare_wait();
+            if (found()) {
+                ctl->data.cancel_wait();
+                return s;
+            }
+            if (!ctl->data.commit_wait_until(key, deadline))
+                return try_read();
+            if (found())
+                return s;
+        }
+    }
+
+    inline void SharedMemoryQueue::release(const Slice& s) {
+        release_to(s.end);
+    }
+
+    inline void SharedMemoryQueue::release_to(std::uint64_t end) {
+        // records skipped right after the slice go with it, nothing else would release them
+        while (end < next) {
+            auto r = record_at(end);
+            if (r->state.load(std::memory_order_relaxed) != skipped)
+                break;
+            end += stride(r->size);
+        }
+        auto head = ctl->head.load(std::memory_order_relaxed);
+        if (end <= head)
+            return;     // released along with a later slice
+        // zeroed up to the end of the ring and then from its start, as the bytes may wrap around
+        auto first = head & (capacity() - 1);
+        auto n = end - head;
+        auto to_end = std::min<std::uint64_t>(n, capacity() - first);
+        std::memset(ring + first, 0, to_end);
+        std::memset(ring, 0, n - to_end);
+        ctl->head.store(end, std::memory_order_release);
+        ctl->room.notify_all();
+    }
+}
+
+#endif
@@ -0,0 +1,67 @@
+#include <atomic>
+#include <cassert>
+#include <cstdio>
+#include <thread>
+#include <vector>
+
+#include "skip_list.hpp"
+
+using namespace utility;
+
+/*
+Writers insert and erase keys concurrently while readers scan ranges, which must always come out
+sorted and hold the odd keys, which are never erased. Build with -O2 -pthread, or -fsanitize=thread.
+*/
+
+constexpr int num_writers = 4;
+constexpr int keys_per_writer = 20000;
+
+int main() {
+    LockFreeSkipList<int, int> map;
+    std::atomic<bool> writing{true};
+    std::vector<std::thread> readers;
+    for (int r = 0; r != 2; ++r)
+        readers.emplace_back([&] {
+            while (writing.load()) {
+                int prev = -1;
+                map.for_each_range(1000, 3000, [&](auto& kv) {
+                    assert(kv.first > prev && kv.first >= 1000 && kv.first < 3000);
+                    assert(kv.second == kv.first * 2);
+                    prev = kv.first;
+                });
+                auto it = map.lower_bound(5001);
+                assert(it == map.end() || it->first >= 5001);
+            }
+        });
+    std::vector<std::thread> writers;
+    for (int w = 0; w != num_writers; ++w)
+        writers.emplace_back([&, w] {
+            // writers interleave their keys, so that they insert next to each other
+            for (int i = 0; i != keys_per_writer; ++i) {
+                auto k = i * num_writers + w;
+                assert(map.insert(k, k * 2));
+                assert(!map.insert(k, 0));
+                // the writers with even keys only keep their last one
+                if (k % 2 == 0 && i > 0)
+                    assert(map.erase(k - num_writers));
+            }
+        });
+    for (auto& t: writers)
+        t.join();
+    writing = false;
+    for (auto& t: readers)
+        t.join();
+
+    std::size_t n = 0;
+    int prev = -1;
+    for (auto& kv: map) {
+        assert(kv.first > prev && (kv.first % 2 || kv.first >= (keys_per_writer - 1) * num_writers));
+        prev = kv.first;
+        ++n;
+    }
+    assert(n == map.size());
+    assert(n == num_writers * keys_per_writer / 2 + num_writers / 2);
+    for (int k = 1; k < num_writers * keys_per_writer; k += 2)
+        assert(map.contains(k) && map.find(k)->second == k * 2);
+    std::printf("%zu keys\n", n);
+}
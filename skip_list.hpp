@@ -0,0 +1,398 @@
+#ifndef CONCURRENCY_SKIP_LIST_H_
+#define CONCURRENCY_SKIP_LIST_H_
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <random>
+#include <utility>
+
+namespace utility {
+    /*
+    Lock-free ordered map based on the skip list of Herlihy & Shavit (Chapter 14 of "The Art of Multiprocessor Programming").
+    A node is logically removed by marking the lowest bit of its next pointers (top level first, the bottom level last) and physically unlinked by whichever find() passes by.
+    Removed nodes are reclaimed in the same way as Listing 7.4-7.6: they are put in a pending list that is only deleted when no other thread is inside the map.
+    Iterators are weakly consistent: they never block writers, see every element that is present during the whole traversal and may or may not see concurrent modifications.
+    NOTE: an alive iterator counts as a thread inside the map, so holding one for long delays reclamation.
+    */
+    template<typename Key, typename Value, typename Compare=std::less<Key>>
+    class LockFreeSkipList {
+        static constexpr int max_level = 24;
+        struct Node;
+    public:
+        using value_type = std::pair<const Key, Value>;
+        class Iterator;
+
+        LockFreeSkipList(const Compare& comp=Compare()): comp(comp) {}
+        LockFreeSkipList(const LockFreeSkipList&) = delete;
+        LockFreeSkipList& operator=(const LockFreeSkipList&) = delete;
+        ~LockFreeSkipList();
+
+        // returns false if key is already in the map, the value is not overwritten in that case
+        bool insert(const Key&, const Value&);
+        bool insert(const Key&, Value&&);
+        bool erase(const Key&);
+        Iterator find(const Key&) const;
+        Iterator lower_bound(const Key&) const;
+        bool contains(const Key& k) const { return find(k) != end(); }
+
+        Iterator begin() const;
+        Iterator end() const { return Iterator(); }
+        // apply f to every element in [lo, hi)
+        template<typename Func>
+        void for_each_range(const Key& lo, const Key& hi, Func f) const;
+        template<typename Func>
+        void for_each(Func f) const;
+
+        // approximate as it may be changed by other threads concurrently
+        std::size_t size() const { return count.load(std::memory_order_relaxed); }
+        bool empty() const { return size() == 0; }
+
+    private:
+        struct Node {
+            Node(const Key& k, Value&& v, int h):
+                data(k, std::move(v)), height(h), next(new std::atomic<Node*>[h]) {}
+            value_type data;
+            const int height;
+            std::unique_ptr<std::atomic<Node*>[]> next;
+            // one count held by the inserting thread until all levels are linked,
+            // one held by the element until it's erased
+            std::atomic<int> ref{2};
+            Node* next_pending = nullptr;    // used by the pending list only
+        };
+
+        // RAII counter of threads inside the map, see Listing 7.5
+        class Guard {
+        public:
+            explicit Guard(const LockFreeSkipList* l=nullptr): list(l) { if (list) ++list->active; }
+            Guard(const Guard& other): Guard(other.list) {}
+            Guard& operator=(Guard other) { std::swap(list, other.list); return *this; }
+            ~Guard() { if (list) list->leave(); }
+        private:
+            const LockFreeSkipList* list;
+        };
+
+        static bool is_marked(Node* p) {
+            return reinterpret_cast<std::uintptr_t>(p) & 1;
+        }
+        static Node* marked(Node* p) {
+            return reinterpret_cast<Node*>(reinterpret_cast<std::uintptr_t>(p) | 1);
+        }
+        static Node* unmarked(Node* p) {
+            return reinterpret_cast<Node*>(reinterpret_cast<std::uintptr_t>(p) & ~std::uintptr_t(1));
+        }
+        // nullptr stands for the head sentinel, which saves us from default constructing a Key
+        std::atomic<Node*>& next_of(Node* pred, int level) const {
+            return pred? pred->next[level]: head[level];
+        }
+        static int random_level();
+
+        bool find(const Key&, Node** preds, Node** succs);
+        Node* search(const Key&) const;
+        bool insert_node(const Key&, Value&&);
+        void release(Node*);
+        void leave() const;
+        void chain_pending_nodes(Node* first, Node* last) const;
+        static void delete_nodes(Node*);
+
+        mutable std::atomic<Node*> head[max_level] = {};
+        mutable std::atomic<unsigned> active{0};
+        mutable std::atomic<Node*> to_be_deleted{nullptr};
+        std::atomic<std::size_t> count{0};
+        Compare comp;
+    };
+
+    template<typename Key, typename Value, typename Compare>
+    class LockFreeSkipList<Key, Value, Compare>::Iterator {
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = typename LockFreeSkipList::value_type;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const value_type*;
+        using reference = const value_type&;
+
+        Iterator() = default;
+        reference operator*() const { return node->data; }
+        pointer operator->() const { return &node->data; }
+        Iterator& operator++() {
+            node = skip_marked(unmarked(node->next[0].load()));
+            return *this;
+        }
+        Iterator operator++(int) {
+            auto tmp = *this;
+            ++*this;
+            return tmp;
+        }
+        bool operator==(const Iterator& rhs) const { return node == rhs.node; }
+        bool operator!=(const Iterator& rhs) const { return node != rhs.node; }
+    private:
+        friend class LockFreeSkipList;
+        Iterator(Guard g, Node* n): guard(std::move(g)), node(n) {}
+        static Node* skip_marked(Node* p) {
+            Node* succ;
+            while (p && is_marked(succ = p->next[0].load()))
+                p = unmarked(succ);
+            return p;
+        }
+        Guard guard;
+        Node* node = nullptr;
+    };
+
+    template<typename Key, typename Value, typename Compare>
+    LockFreeSkipList<Key, Value, Compare>::~LockFreeSkipList() {
+        // nodes still linked at the bottom level, marked or not, are not in the pending list
+        auto p = unmarked(head[0].load(std::memory_order_relaxed));
+        while (p) {
+            auto next = unmarked(p->next[0].load(std::memory_order_relaxed));
+            delete p;
+            p = next;
+        }
+        delete_nodes(to_be_deleted.load(std::memory_order_relaxed));
+    }
+
+    template<typename Key, typename Value, typename Compare>
+    int LockFreeSkipList<Key, Value, Compare>::random_level() {
+        static thread_local std::minstd_rand gen(std::random_device{}());
+        // geometric distribution with p=1/2
+        auto bits = gen();
+        int h = 1;
+        while ((bits & 1) && h < max_level) {
+            ++h;
+            bits >>= 1;
+        }
+        return h;
+    }
+
+    /*
+    Fills preds/succs with the last node whose key < k and the first node whose key >= k at each level.
+    Marked nodes met on the way are unlinked; we restart from the head if pred has been marked meanwhile.
+    Returns true if succs[0] holds k.
+    */
+    template<typename Key, typename Value, typename Compare>
+    bool LockFreeSkipList<Key, Value, Compare>::find(
+        const Key& k, Node** preds, Node** succs) {
+    retry:
+        Node* pred = nullptr;
+        for (auto level = max_level - 1; level >= 0; --level) {
+            auto curr = unmarked(next_of(pred, level).load());
+            while (curr) {
+                auto succ = curr->next[level].load();
+                while (is_marked(succ)) {
+                    if (!next_of(pred, level).compare_exchange_strong(curr, unmarked(succ)))
+                        goto retry;
+                    curr = unmarked(succ);
+                    if (!curr)
+                        break;
+                    succ = curr->next[level].load();
+                }
+                if (curr && comp(curr->data.first, k)) {
+                    pred = curr;
+                    curr = unmarked(succ);
+                }
+                else
+                    break;
+            }
+            preds[level] = pred;
+            succs[level] = curr;
+        }
+        return succs[0] && !comp(k, succs[0]->data.first);
+    }
+
+    // same as find() but read-only, marked nodes are skipped instead of unlinked
+    template<typename Key, typename Value, typename Compare>
+    typename LockFreeSkipList<Key, Value, Compare>::Node*
+    LockFreeSkipList<Key, Value, Compare>::search(const Key& k) const {
+        Node* pred = nullptr;
+        Node* curr = nullptr;
+        for (auto level = max_level - 1; level >= 0; --level) {
+            curr = unmarked(next_of(pred, level).load());
+            while (curr) {
+                auto succ = curr->next[level].load();
+                while (is_marked(succ)) {
+                    curr = unmarked(succ);
+                    if (!curr)
+                        break;
+                    succ = curr->next[level].load();
+                }
+                if (curr && comp(curr->data.first, k)) {
+                    pred = curr;
+                    curr = unmarked(succ);
+                }
+                else
+                    break;
+            }
+        }
+        return curr;
+    }
+
+    template<typename Key, typename Value, typename Compare>
+    bool LockFreeSkipList<Key, Value, Compare>::insert(const Key& k, const Value& v) {
+        return insert_node(k, Value(v));
+    }
+
+    template<typename Key, typename Value, typename Compare>
+    bool LockFreeSkipList<Key, Value, Compare>::insert(const Key& k, Value&& v) {
+        return insert_node(k, std::move(v));
+    }
+
+    template<typename Key, typename Value, typename Compare>
+    bool LockFreeSkipList<Key, Value, Compare>::insert_node(const Key& k, Value&& v) {
+        Guard g(this);
+        Node* preds[max_level];
+        Node* succs[max_level];
+        Node* node = nullptr;
+        while (true) {
+            if (find(k, preds, succs)) {
+                delete node;
+                return false;
+            }
+            if (!node)
+                node = new Node(k, std::move(v), random_level());
+            for (auto i = 0; i != node->height; ++i)
+                node->next[i].store(succs[i], std::memory_order_relaxed);
+            // linking the bottom level is the linearization point
+            auto succ = succs[0];
+            if (next_of(preds[0], 0).compare_exchange_strong(succ, node))
+                break;
+        }
+        count.fetch_add(1, std::memory_order_relaxed);
+        for (auto level = 1; level < node->height; ++level) {
+            while (true) {
+                auto expected = node->next[level].load();
+                // stop linking as soon as the node is being erased
+                if (is_marked(expected))
+                    goto linked;
+                if (expected != succs[level]
+                    && !node->next[level].compare_exchange_strong(expected, succs[level]))
+                    goto linked;
+                auto succ = succs[level];
+                if (next_of(preds[level], level).compare_exchange_strong(succ, node))
+                    break;
+                find(k, preds, succs);
+                if (succs[0] != node)
+                    goto linked;
+            }
+        }
+    linked:
+        // the eraser may have finished unlinking before we linked the upper levels
+        if (is_marked(node->next[0].load()))
+            find(k, preds, succs);
+        release(node);
+        return true;
+    }
+
+    template<typename Key, typename Value, typename Compare>
+    bool LockFreeSkipList<Key, Value, Compare>::erase(const Key& k) {
+        Guard g(this);
+        Node* preds[max_level];
+        Node* succs[max_level];
+        if (!find(k, preds, succs))
+            return false;
+        auto node = succs[0];
+        for (auto level = node->height - 1; level > 0; --level) {
+            auto succ = node->next[level].load();
+            while (!is_marked(succ))
+                node->next[level].compare_exchange_weak(succ, marked(succ));
+        }
+        auto succ = node->next[0].load();
+        while (true) {
+            if (is_marked(succ))
+                return false;   // someone else erased it first
+            if (node->next[0].compare_exchange_weak(succ, marked(succ)))
+                break;
+        }
+        count.fetch_sub(1, std::memory_order_relaxed);
+        find(k, preds, succs);  // unlink node at all levels
+        release(node);
+        return true;
+    }
+
+    template<typename Key, typename Value, typename Compare>
+    typename LockFreeSkipList<Key, Value, Compare>::Iterator
+    LockFreeSkipList<Key, Value, Compare>::find(const Key& k) const {
+        Guard g(this);
+        auto p = search(k);
+        if (!p || comp(k, p->data.first))
+            return end();
+        return Iterator(std::move(g), p);
+    }
+
+    template<typename Key, typename Value, typename Compare>
+    typename LockFreeSkipList<Key, Value, Compare>::Iterator
+    LockFreeSkipList<Key, Value, Compare>::lower_bound(const Key& k) const {
+        Guard g(this);
+        auto p = search(k);
+        if (!p)
+            return end();
+        return Iterator(std::move(g), p);
+    }
+
+    template<typename Key, typename Value, typename Compare>
+    typename LockFreeSkipList<Key, Value, Compare>::Iterator
+    LockFreeSkipList<Key, Value, Compare>::begin() const {
+        Guard g(this);
+        auto p = Iterator::skip_marked(unmarked(head[0].load()));
+        if (!p)
+            return end();
+        return Iterator(std::move(g), p);
+    }
+
+    template<typename Key, typename Value, typename Compare>
+    template<typename Func>
+    void LockFreeSkipList<Key, Value, Compare>::for_each_range(
+        const Key& lo, const Key& hi, Func f) const {
+        for (auto it = lower_bound(lo); it != end() && comp(it->first, hi); ++it)
+            f(*it);
+    }
+
+    template<typename Key, typename Value, typename Compare>
+    template<typename Func>
+    void LockFreeSkipList<Key, Value, Compare>::for_each(Func f) const {
+        for (auto it = begin(); it != end(); ++it)
+            f(*it);
+    }
+
+    // the node is retired after both the inserter and the eraser are done with it,
+    // at which time it's no longer reachable from the head
+    template<typename Key, typename Value, typename Compare>
+    void LockFreeSkipList<Key, Value, Compare>::release(Node* node) {
+        if (node->ref.fetch_sub(1) == 1)
+            chain_pending_nodes(node, node);
+    }
+
+    template<typename Key, typename Value, typename Compare>
+    void LockFreeSkipList<Key, Value, Compare>::leave() const {
+        if (active.load() == 1) {
+            auto nodes = to_be_deleted.exchange(nullptr);
+            if (!--active)
+                delete_nodes(nodes);
+            else if (nodes) {
+                auto last = nodes;
+                while (last->next_pending)
+                    last = last->next_pending;
+                chain_pending_nodes(nodes, last);
+            }
+        }
+        else
+            --active;
+    }
+
+    template<typename Key, typename Value, typename Compare>
+    void LockFreeSkipList<Key, Value, Compare>::chain_pending_nodes(
+        Node* first, Node* last) const {
+        last->next_pending = to_be_deleted.load();
+        while (!to_be_deleted.compare_exchange_weak(last->next_pending, first));
+    }
+
+    template<typename Key, typename Value, typename Compare>
+    void LockFreeSkipList<Key, Value, Compare>::delete_nodes(Node* nodes) {
+        while (nodes) {
+            auto next = nodes->next_pending;
+            delete nodes;
+            nodes = next;
+        }
+    }
+}
+
+#endif
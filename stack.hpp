@@ -5,38 +5,67 @@
 #include <memory>
 #include <future>
 #include <atomic>
+#include <memory_resource>
+
+#include "atomic_shared_ptr.hpp"
+#include "cache_line.hpp"
+#include "memory_resource.hpp"
+#include "object_pool.hpp"
 
 namespace utility{
+    /*
+    A popped node may still be read by a thread that loaded it as head before, so it is not freed at
+    once but put in a pending list, which is only deleted when no other thread is inside pop(), see
+    Listing 7.4-7.6. Freeing it at once would also let the resource hand the same address back to a
+    push(), which a stale compare_exchange would then take for the old head (ABA).
+    Nodes and data are allocated from the memory_resource of the allocator, which must be thread-safe,
+    see ThreadCachingResource. The specialization for TaggedPtr recycles its nodes through ObjectPool
+    instead.
+    */
     template<typename T, typename PtrType=void*>
     class LockFreeStack {
     public:
+        using allocator_type = std::pmr::polymorphic_allocator<T>;
+
+        explicit LockFreeStack(const allocator_type& a={}): resource(a.resource()) {}
         LockFreeStack(const LockFreeStack&) = delete;
         LockFreeStack& operator=(const LockFreeStack&) = delete;
         ~LockFreeStack();
 
         void push(const T& data);
         std::shared_ptr<T> pop();
+        allocator_type get_allocator() const { return allocator_type(resource); }
     private:
         struct Node {
+            explicit Node(std::shared_ptr<T>&& d): data(std::move(d)) {}
             std::shared_ptr<T> data;
-            Node* next;
-            Node(const T& d): data(std::make_shared<T>(data)) {}
+            Node* next;                     // never written once pushed, stale readers may load it
+            Node* next_pending = nullptr;
         };
-        std::atomic<Node*> head;
+        void leave();
+        void chain_pending(Node* first, Node* last);
+        void delete_nodes(Node*);
+
+        std::pmr::memory_resource* const resource;
+        alignas(cache_line_size) std::atomic<Node*> head{nullptr};
+        std::atomic<unsigned> threads_in_pop{0};
+        std::atomic<Node*> to_be_deleted{nullptr};
     };
 
     template<typename T, typename PtrType>
     LockFreeStack<T, PtrType>::~LockFreeStack() {
-        auto old_head = head.load(std::memory_order_relaxed);
-        while (old_head
-            && head.compare_exchange_weak(old_head, old_head->next,
-                std::memory_order_acquire, std::memory_order_relaxed)) {
-            delete old_head;
+        auto p = head.load(std::memory_order_relaxed);
+        while (p) {
+            auto next = p->next;
+            detail::PmrDelete<Node>{resource}(p);
+            p = next;
         }
+        delete_nodes(to_be_deleted.load(std::memory_order_relaxed));
     }
     template<typename T, typename PtrType>
     void LockFreeStack<T, PtrType>::push(const T& data) {
-        const Node* p = new Node(data);
+        auto p = make_pmr_unique<Node>(resource,
+            std::allocate_shared<T>(allocator_type(resource), data)).release();
         p->next = head.load(std::memory_order_relaxed);
         while (!head.compare_exchange_weak(p->next, p,
             std::memory_order_release, std::memory_order_relaxed));
@@ -44,54 +73,90 @@ namespace utility{
 
     template<typename T, typename PtrType>
     std::shared_ptr<T> LockFreeStack<T, PtrType>::pop() {
-        auto old_head = head.load();
+        ++threads_in_pop;
+        auto old_head = head.load(std::memory_order_acquire);
         while (old_head
-            && head.compare_exchange_weak(old_head, old_head->next,
-                std::memory_order_acquire, std::memory_order_release));
-        // NOTE: it's safe to delete right now as long as we do not 
-        // define any other operations that access the stack
+            && !head.compare_exchange_weak(old_head, old_head->next,
+                std::memory_order_acquire, std::memory_order_acquire));
+        std::shared_ptr<T> res;
         if (old_head) {
-            auto res = old_head->data;
-            delete old_head;
-            return res;
+            // data is only touched by the thread that popped the node
+            res = std::move(old_head->data);
+            chain_pending(old_head, old_head);
+        }
+        leave();
+        return res;
+    }
+
+    // deletes the pending nodes if no other thread is inside pop(), see Listing 7.5
+    template<typename T, typename PtrType>
+    void LockFreeStack<T, PtrType>::leave() {
+        if (threads_in_pop.load() == 1) {
+            auto pending = to_be_deleted.exchange(nullptr);
+            if (!--threads_in_pop)
+                delete_nodes(pending);
+            else if (pending) {
+                auto last = pending;
+                while (last->next_pending)
+                    last = last->next_pending;
+                chain_pending(pending, last);
+            }
+        }
+        else
+            --threads_in_pop;
+    }
+
+    template<typename T, typename PtrType>
+    void LockFreeStack<T, PtrType>::chain_pending(Node* first, Node* last) {
+        last->next_pending = to_be_deleted.load();
+        while (!to_be_deleted.compare_exchange_weak(last->next_pending, first));
+    }
+
+    template<typename T, typename PtrType>
+    void LockFreeStack<T, PtrType>::delete_nodes(Node* p) {
+        while (p) {
+            auto next = p->next_pending;
+            detail::PmrDelete<Node>{resource}(p);
+            p = next;
         }
-        return {};
     }
 
     /* Specialization for atomic<shared_ptr> */
     template<typename T>
     class LockFreeStack<T, std::atomic<std::shared_ptr<T>>> {
     public:
+        using allocator_type = std::pmr::polymorphic_allocator<T>;
+
+        explicit LockFreeStack(const allocator_type& a={}): resource(a.resource()) {}
         LockFreeStack(const LockFreeStack&) = delete;
         LockFreeStack& operator=(const LockFreeStack&) = delete;
         ~LockFreeStack();
 
         void push(const T& data);
         std::shared_ptr<T> pop();
+        allocator_type get_allocator() const { return allocator_type(resource); }
     private:
         struct Node {
+            explicit Node(std::shared_ptr<T>&& d): data(std::move(d)) {}
             std::shared_ptr<T> data;
             std::shared_ptr<Node> next;
-            Node(const T& d): data(std::make_shared<T>(data)) {}
         };
-        std::atomic<std::shared_ptr<Node>> head;
+        std::pmr::memory_resource* const resource;
+        alignas(cache_line_size) std::atomic<std::shared_ptr<Node>> head;
     };
 
     template<typename T>
     LockFreeStack<T, std::atomic<std::shared_ptr<T>>>::~LockFreeStack() {
-        auto old_head = head.load(std::memory_order_relaxed);
-        while (old_head
-            && head.compare_exchange_weak(old_head, old_head->next,
-                std::memory_order_acquire, std::memory_order_relaxed)) {
-            // regarding that old_head might still be held by some 
-            // other thread, we clear its next so that the next can
-            // be reclaimed first
-            old_head->next = nullptr;
-        }
+        // regarding that a node might still be held by some
+        // other thread, we only free the chain up to it
+        auto p = head.exchange(nullptr, std::memory_order_acquire);
+        while (p && p.use_count() == 1)
+            p = std::move(p->next);
     }
     template<typename T>
     void LockFreeStack<T, std::atomic<std::shared_ptr<T>>>::push(const T& data) {
-        auto p = std::make_shared<Node>(data);
+        auto p = std::allocate_shared<Node>(std::pmr::polymorphic_allocator<Node>(resource),
+            std::allocate_shared<T>(allocator_type(resource), data));
         p->next = head.load(std::memory_order_relaxed);
         while (!head.compare_exchange_weak(p->next, p,
             std::memory_order_release, std::memory_order_relaxed));
@@ -100,20 +165,158 @@ namespace utility{
     template<typename T>
     std::shared_ptr<T> 
     LockFreeStack<T, std::atomic<std::shared_ptr<T>>>::pop() {
-        auto old_head = head.load();
+        auto old_head = head.load(std::memory_order_acquire);
         while (old_head
-            && head.compare_exchange_weak(old_head, old_head->next,
-                std::memory_order_acquire, std::memory_order_release));
-        // NOTE: it's safe to delete right now as long as we do not 
-        // define any other operations that access the stack
-        if (old_head) {
-            // regarding that old_head might still be held by some 
-            // other thread, we clear its next so that the next can
-            // be reclaimed first
-            old_head->next = nullptr;
-            return old_head->data;
-        }
-        return {};
+            && !head.compare_exchange_weak(old_head, old_head->next,
+                std::memory_order_acquire, std::memory_order_acquire));
+        // old_head->data is not touched by the threads still holding old_head
+        return old_head? std::move(old_head->data): std::shared_ptr<T>();
+    }
+
+    /*
+    Specialization for AtomicSharedPtr, which is lock-free unlike std::atomic<std::shared_ptr>
+    in libstdc++. Popped nodes are reclaimed by reference counting once no thread holds them.
+    */
+    template<typename T>
+    class LockFreeStack<T, AtomicSharedPtr<T>> {
+    public:
+        using allocator_type = std::pmr::polymorphic_allocator<T>;
+
+        explicit LockFreeStack(const allocator_type& a={}): resource(a.resource()) {}
+        LockFreeStack(const LockFreeStack&) = delete;
+        LockFreeStack& operator=(const LockFreeStack&) = delete;
+        ~LockFreeStack();
+
+        void push(const T& data);
+        std::shared_ptr<T> pop();
+        bool is_lock_free() const { return head.is_lock_free(); }
+        allocator_type get_allocator() const { return allocator_type(resource); }
+    private:
+        struct Node {
+            std::shared_ptr<T> data;
+            SharedPtr<Node> next;
+            explicit Node(std::shared_ptr<T>&& d): data(std::move(d)) {}
+            // a thread holding a stale head keeps the nodes popped after it alive, free them
+            // iteratively. next is never written once the node is pushed, so other threads may
+            // still read it; a node held by next only cannot be reached by anyone else
+            ~Node() {
+                while (next && next.use_count() == 1)
+                    next = std::move(next->next);
+            }
+        };
+        std::pmr::memory_resource* const resource;
+        alignas(cache_line_size) AtomicSharedPtr<Node> head;
+    };
+
+    template<typename T>
+    LockFreeStack<T, AtomicSharedPtr<T>>::~LockFreeStack() {
+        head.store(nullptr, std::memory_order_relaxed);
+    }
+
+    template<typename T>
+    void LockFreeStack<T, AtomicSharedPtr<T>>::push(const T& data) {
+        auto p = allocate_shared_ptr<Node>(resource,
+            std::allocate_shared<T>(allocator_type(resource), data));
+        p->next = head.load(std::memory_order_relaxed);
+        while (!head.compare_exchange_weak(p->next, p,
+            std::memory_order_release, std::memory_order_relaxed));
+    }
+
+    template<typename T>
+    std::shared_ptr<T> LockFreeStack<T, AtomicSharedPtr<T>>::pop() {
+        auto old_head = head.load(std::memory_order_acquire);
+        while (old_head
+            && !head.compare_exchange_weak(old_head, old_head->next,
+                std::memory_order_acquire, std::memory_order_acquire));
+        // old_head->data is not touched by the threads still holding old_head
+        return old_head? std::move(old_head->data): std::shared_ptr<T>();
+    }
+    /*
+    Specialization for TaggedPtr: nodes come from an ObjectPool, so push and pop do not call malloc
+    once the pool is warm, and the version tag of head keeps a recycled node from passing the CAS of a
+    thread that read it earlier. Such a thread may still load next of a node recycled meanwhile, so next
+    is the link() of the pool block rather than a member that every create() would construct anew.
+    */
+    template<typename T>
+    class LockFreeStack<T, TaggedPtr<T>> {
+    public:
+        LockFreeStack() = default;
+        LockFreeStack(const LockFreeStack&) = delete;
+        LockFreeStack& operator=(const LockFreeStack&) = delete;
+        ~LockFreeStack();
+
+        void push(const T& data);
+        void push(T&& data);
+        // moves the top element into res, so that nothing is allocated
+        bool pop(T& res);
+        std::shared_ptr<T> pop();
+        bool is_lock_free() const { return head.is_lock_free(); }
+    private:
+        struct Node {
+            template<typename U>
+            Node(U&& d): data(std::forward<U>(d)) {}
+            T data;
+        };
+        using Pool = ObjectPool<Node>;
+        static std::atomic<void*>& next(Node* p) { return Pool::link(p); }
+        void push_node(Node* p);
+        Node* pop_node();
+
+        alignas(cache_line_size) std::atomic<TaggedPtr<Node>> head{};
+    };
+
+    template<typename T>
+    LockFreeStack<T, TaggedPtr<T>>::~LockFreeStack() {
+        while (auto p = pop_node())
+            Pool::destroy(p);
+    }
+
+    template<typename T>
+    void LockFreeStack<T, TaggedPtr<T>>::push(const T& data) {
+        push_node(Pool::create(data));
+    }
+
+    template<typename T>
+    void LockFreeStack<T, TaggedPtr<T>>::push(T&& data) {
+        push_node(Pool::create(std::move(data)));
+    }
+
+    template<typename T>
+    bool LockFreeStack<T, TaggedPtr<T>>::pop(T& res) {
+        auto p = pop_node();
+        if (!p)
+            return false;
+        res = std::move(p->data);
+        Pool::destroy(p);
+        return true;
+    }
+
+    template<typename T>
+    std::shared_ptr<T> LockFreeStack<T, TaggedPtr<T>>::pop() {
+        auto p = pop_node();
+        if (!p)
+            return {};
+        // destroy the node even if make_shared throws
+        std::unique_ptr<Node, void(*)(Node*)> guard(p, &Pool::destroy);
+        return std::make_shared<T>(std::move(p->data));
+    }
+
+    template<typename T>
+    void LockFreeStack<T, TaggedPtr<T>>::push_node(Node* p) {
+        auto old = head.load(std::memory_order_relaxed);
+        do {
+            next(p).store(old.get(), std::memory_order_relaxed);
+        } while (!head.compare_exchange_weak(old, old.next(p),
+            std::memory_order_release, std::memory_order_relaxed));
+    }
+
+    template<typename T>
+    typename LockFreeStack<T, TaggedPtr<T>>::Node* LockFreeStack<T, TaggedPtr<T>>::pop_node() {
+        auto old = head.load(std::memory_order_acquire);
+        while (old.get() && !head.compare_exchange_weak(old,
+            old.next(static_cast<Node*>(next(old.get()).load(std::memory_order_relaxed))),
+            std::memory_order_acquire, std::memory_order_acquire));
+        return old.get();
     }
 }
 
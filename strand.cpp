@@ -0,0 +1,137 @@
+#include <atomic>
+#include <cassert>
+#include <cstdio>
+#include <future>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "strand.hpp"
+#include "thread_pool.hpp"
+
+using namespace utility;
+
+/*
+Tasks posted to a strand from several threads never overlap and keep the order of each poster,
+dispatch() runs inline from a task of the strand, the keys of a StrandMap keep their order while
+different keys run in parallel, and a strand is destroyed cleanly also when its pool has been
+stopped. Build with -O2 -pthread, or -fsanitize=thread.
+*/
+
+using Pool = ThreadPool<void()>;
+
+constexpr int num_posters = 4;
+constexpr int per_poster = 20000;
+
+void serial(Pool& pool) {
+    std::atomic<int> inside{0};
+    long processed = 0;     // no lock, only the tasks of the strand touch it
+    std::vector<int> last(num_posters, -1);
+    {
+        Strand<Pool> strand(pool, 16);
+        std::vector<std::thread> ts;
+        for (int p = 0; p != num_posters; ++p)
+            ts.emplace_back([&, p] {
+                for (int i = 0; i != per_poster; ++i)
+                    strand.post([&, p, i] {
+                        assert(++inside == 1);
+                        assert(strand.running_in_this_thread());
+                        assert(i == last[p] + 1);
+                        last[p] = i;
+                        ++processed;
+                        --inside;
+                    });
+            });
+        for (auto& t: ts)
+            t.join();
+        assert(!strand.running_in_this_thread());
+    }
+    assert(processed == num_posters * per_poster);
+}
+
+void submit_and_dispatch(Pool& pool) {
+    Strand<Pool> strand(pool);
+    std::vector<std::future<int>> fs;
+    for (int i = 0; i != 1000; ++i)
+        fs.push_back(strand.submit([](int x) { return x * 2; }, i));
+    for (int i = 0; i != 1000; ++i)
+        assert(fs[i].get() == i * 2);
+    auto f = strand.submit([] { throw std::string("failed"); });
+    try {
+        f.get();
+        assert(false);
+    }
+    catch (std::string& e) {
+        assert(e == "failed");
+    }
+
+    // from a task of the strand dispatch() runs at once, from outside it is posted
+    std::vector<int> order;
+    strand.submit([&] {
+        order.push_back(1);
+        strand.dispatch([&] { order.push_back(2); });
+        strand.post([&] { order.push_back(4); });
+        order.push_back(3);
+    }).get();
+    strand.dispatch([&] { order.push_back(5); });
+    strand.submit([] {}).get();
+    assert((order == std::vector<int>{1, 2, 3, 4, 5}));
+}
+
+void keyed(Pool& pool) {
+    constexpr int num_keys = 32;
+    // the last task run per key and poster, the first one of key k is k
+    std::vector<int> last(num_keys * num_posters);
+    for (int k = 0; k != num_keys; ++k)
+        for (int p = 0; p != num_posters; ++p)
+            last[k * num_posters + p] = k - num_keys;
+    {
+        // fewer strands than keys, so that keys share strands
+        StrandMap<int, Pool> strands(pool, 7);
+        std::vector<std::thread> ts;
+        for (int p = 0; p != num_posters; ++p)
+            ts.emplace_back([&, p] {
+                for (int i = 0; i != per_poster; ++i) {
+                    auto k = i % num_keys;
+                    strands.post(k, [&, k, p, i] {
+                        assert(strands[k].running_in_this_thread());
+                        auto& l = last[k * num_posters + p];
+                        assert(i == l + num_keys);
+                        l = i;
+                    });
+                }
+            });
+        for (auto& t: ts)
+            t.join();
+    }
+    for (int k = 0; k != num_keys; ++k)
+        for (int p = 0; p != num_posters; ++p)
+            assert(last[k * num_posters + p] == per_poster - num_keys + k);
+}
+
+// tasks left when the pool stops are run by the destructor
+void stopped_pool() {
+    Pool pool(2);
+    int processed = 0;
+    {
+        Strand<Pool> strand(pool, 4);
+        for (int i = 0; i != 100; ++i)
+            strand.post([&] { ++processed; });
+        pool.stop();
+        for (int i = 0; i != 100; ++i)
+            try {
+                strand.post([&] { ++processed; });
+            }
+            catch (QueueClosed&) {}
+    }
+    assert(processed == 200);
+}
+
+int main() {
+    Pool pool(4);
+    serial(pool);
+    submit_and_dispatch(pool);
+    keyed(pool);
+    stopped_pool();
+    std::printf("ok\n");
+}
@@ -0,0 +1,108 @@
+#ifndef CONCURRENCY_STRAND_H_
+#define CONCURRENCY_STRAND_H_
+
+#include <cstddef>
+#include <functional>
+#include <future>
+#include <memory>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "actor.hpp"
+
+namespace utility {
+    /*
+    Serial executor on pool, a ThreadPool<void()>: the tasks of a strand run one at a time in the
+    order they were posted, each seeing the effects of the previous ones, but on whichever worker is
+    free. A strand is an Actor whose messages are tasks, so it takes no thread while idle, posting
+    is lock-free, and a turn runs up to batch tasks before giving the worker back.
+    An exception thrown by a task of submit() is stored in its future, one thrown by a task of
+    post() is discarded. The destructor waits for the tasks posted, or runs them itself once the
+    pool is stopped, see Actor.
+    */
+    template<typename Pool>
+    class Strand {
+    public:
+        explicit Strand(Pool& pool, std::size_t batch=64): tasks(pool, Run{this}, batch) {}
+
+        template<typename FuncType, typename... Args,
+            typename ReturnType=typename std::invoke_result<
+                std::decay_t<FuncType>, std::decay_t<Args>...>::type>
+        std::future<ReturnType> submit(FuncType&& f, Args&&... args) {
+            std::packaged_task<ReturnType()> task(
+                std::bind(std::forward<FuncType>(f), std::forward<Args>(args)...));
+            auto res = task.get_future();
+            tasks.emplace(std::move(task));
+            return res;
+        }
+        template<typename FuncType>
+        void post(FuncType&& f) { tasks.emplace(std::forward<FuncType>(f)); }
+        // runs f at once if called from a task of this strand, otherwise posts it
+        template<typename FuncType>
+        void dispatch(FuncType&& f) {
+            if (running_in_this_thread())
+                std::forward<FuncType>(f)();
+            else
+                post(std::forward<FuncType>(f));
+        }
+
+        bool running_in_this_thread() const { return current() == this; }
+        // tasks posted and not run yet, approximate while posting
+        std::size_t backlog() const { return tasks.backlog(); }
+    private:
+        using Task = std::packaged_task<void()>;
+        struct Run {
+            void operator()(Task& t) const {
+                // strands may nest, e.g., a task of one strand running dispatch() of another
+                auto outer = std::exchange(current(), self);
+                t();
+                current() = outer;
+            }
+            const Strand* self;
+        };
+        static const Strand*& current() {
+            static thread_local const Strand* s = nullptr;
+            return s;
+        }
+
+        Actor<Task, Pool, Run> tasks;
+    };
+
+    /*
+    Fixed set of strands with keys hashed to them, so that the tasks of a key, e.g., a connection,
+    run in order while the tasks of different keys run in parallel. Keys sharing a strand are
+    serialized as well, more strands make that rarer at the cost of sizeof(Strand) bytes each.
+    */
+    template<typename Key, typename Pool, typename Hash=std::hash<Key>>
+    class StrandMap {
+    public:
+        // a prime number of strands spreads poor hashes better
+        explicit StrandMap(Pool& pool, std::size_t num_strands=61, const Hash& hasher=Hash(),
+            std::size_t batch=64): hasher(hasher) {
+            for (std::size_t i = 0; i != (num_strands? num_strands: 1); ++i)
+                strands.push_back(std::make_unique<Strand<Pool>>(pool, batch));
+        }
+        StrandMap(const StrandMap&) = delete;
+        StrandMap& operator=(const StrandMap&) = delete;
+
+        Strand<Pool>& strand(const Key& k) { return *strands[hasher(k) % strands.size()]; }
+        Strand<Pool>& operator[](const Key& k) { return strand(k); }
+
+        template<typename FuncType, typename... Args>
+        auto submit(const Key& k, FuncType&& f, Args&&... args) {
+            return strand(k).submit(std::forward<FuncType>(f), std::forward<Args>(args)...);
+        }
+        template<typename FuncType>
+        void post(const Key& k, FuncType&& f) { strand(k).post(std::forward<FuncType>(f)); }
+        template<typename FuncType>
+        void dispatch(const Key& k, FuncType&& f) { strand(k).dispatch(std::forward<FuncType>(f)); }
+
+        std::size_t size() const { return strands.size(); }
+    private:
+        std::vector<std::unique_ptr<Strand<Pool>>> strands;
+        Hash hasher;
+    };
+}
+
+#endif
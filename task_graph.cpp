@@ -0,0 +1,99 @@
+#include <atomic>
+#include <cassert>
+#include <cstdio>
+#include <stdexcept>
+#include <vector>
+
+#include "task_graph.hpp"
+#include "thread_pool.hpp"
+
+using namespace utility;
+
+/*
+A layered graph where every task checks that its predecessors have finished, run several times on a
+pool; then a throwing task, a cycle and a stopped pool. Build with -O2 -pthread, or -fsanitize=thread.
+*/
+
+constexpr int layers = 20;
+constexpr int width = 16;
+
+void layered(ThreadPool<void()>& pool) {
+    TaskGraph g;
+    std::vector<std::atomic<int>> runs(layers * width);
+    std::vector<TaskGraph::TaskId> prev;
+    for (int l = 0; l != layers; ++l) {
+        std::vector<TaskGraph::TaskId> cur;
+        for (int i = 0; i != width; ++i) {
+            auto id = l * width + i;
+            cur.push_back(g.add([&, l, id] {
+                // the tasks of the previous layer this one depends on have run as often as it
+                auto n = runs[id].load();
+                if (l) {
+                    auto below = (l - 1) * width;
+                    assert(runs[below + id % width].load() == n + 1);
+                    assert(runs[below + (id + 1) % width].load() == n + 1);
+                }
+                ++runs[id];
+            }));
+            if (l) {
+                g.precede(prev[i], cur[i]);
+                g.precede(prev[(i + 1) % width], cur[i]);
+            }
+        }
+        prev = cur;
+    }
+    for (int r = 1; r <= 5; ++r) {
+        g.run(pool).get();
+        for (auto& n: runs)
+            assert(n == r);
+    }
+}
+
+void failures(ThreadPool<void()>& pool) {
+    TaskGraph g;
+    std::atomic<int> ran{0};
+    auto a = g.add([&] { ++ran; });
+    auto b = g.add([] { throw std::runtime_error("task failed"); }, {a});
+    g.add([&] { ++ran; }, {b});
+    bool threw = false;
+    try {
+        g.run(pool).get();
+    }
+    catch (std::runtime_error&) {
+        threw = true;
+    }
+    // the successor of the failed task is skipped
+    assert(threw && ran == 1);
+
+    TaskGraph cyclic;
+    auto x = cyclic.add([] {});
+    auto y = cyclic.add([] {}, {x});
+    cyclic.precede(y, x);
+    threw = false;
+    try {
+        cyclic.run(pool);
+    }
+    catch (std::logic_error&) {
+        threw = true;
+    }
+    assert(threw);
+
+    // a stopped pool refuses the tasks, the run fails instead of hanging
+    pool.stop();
+    threw = false;
+    try {
+        g.run(pool).get();
+    }
+    catch (QueueClosed&) {
+        threw = true;
+    }
+    assert(threw && ran == 1);
+    pool.restart();
+}
+
+int main() {
+    ThreadPool<void()> pool(4);
+    layered(pool);
+    failures(pool);
+    std::printf("ok\n");
+}
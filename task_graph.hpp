@@ -0,0 +1,196 @@
+#ifndef CONCURRENCY_TASK_GRAPH_H_
+#define CONCURRENCY_TASK_GRAPH_H_
+
+#include <atomic>
+#include <exception>
+#include <functional>
+#include <future>
+#include <initializer_list>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+
+namespace utility {
+    /*
+    A DAG of tasks executed on a thread pool. Instead of waiting on futures inside pool tasks,
+    each task keeps an atomic count of unfinished predecessors; the task finishing last
+    schedules the successor, so no worker ever blocks on another task.
+    A graph can be run repeatedly without being rebuilt, but not concurrently with itself, and
+    must not be changed by add() or precede() while a run is in progress.
+    If a task throws, or the pool refuses a task, e.g., with QueueClosed, the remaining tasks are
+    skipped and the first exception is stored in the future returned by run().
+    */
+    class TaskGraph {
+    public:
+        using TaskId = std::size_t;
+
+        TaskGraph() = default;
+        TaskGraph(const TaskGraph&) = delete;
+        TaskGraph& operator=(const TaskGraph&) = delete;
+
+        // adds a task running after all tasks in preds, not while the graph is running
+        TaskId add(std::function<void()> f, std::initializer_list<TaskId> preds={});
+        // makes after depend on before, not while the graph is running
+        void precede(TaskId before, TaskId after);
+        std::size_t size() const { return nodes.size(); }
+
+        // Pool is a ThreadPool<void()>, or anything whose submit() accepts a void() callable
+        template<typename Pool>
+        std::future<void> run(Pool& pool);
+    private:
+        struct Node {
+            std::function<void()> f;
+            std::vector<TaskId> successors;
+            std::size_t num_preds = 0;
+            std::atomic<std::size_t> pending{0};    // unfinished predecessors in the current run
+        };
+        struct RunState {
+            std::atomic<std::size_t> remaining;
+            std::atomic<bool> failed{false};
+            std::exception_ptr error;   // written by the thread setting failed only
+            std::promise<void> done;
+        };
+
+        void check_acyclic() const;
+        void check_idle() const {
+            // catches a task changing its own graph, not a race with another thread starting a run
+            if (running.load(std::memory_order_relaxed))
+                throw std::logic_error("task graph changed while running");
+        }
+        static void fail(RunState&, std::exception_ptr);
+        template<typename Pool>
+        void schedule(Pool&, TaskId, const std::shared_ptr<RunState>&);
+        template<typename Pool>
+        void execute(Pool&, TaskId, const std::shared_ptr<RunState>&);
+
+        std::vector<std::unique_ptr<Node>> nodes;
+        std::atomic<bool> running{false};
+        bool checked = true;    // whether the graph is known to be acyclic
+    };
+
+    inline TaskGraph::TaskId TaskGraph::add(
+        std::function<void()> f, std::initializer_list<TaskId> preds) {
+        check_idle();
+        auto id = nodes.size();
+        nodes.emplace_back(new Node);
+        nodes.back()->f = std::move(f);
+        for (auto p: preds)
+            precede(p, id);
+        return id;
+    }
+
+    inline void TaskGraph::precede(TaskId before, TaskId after) {
+        check_idle();
+        if (before >= nodes.size() || after >= nodes.size())
+            throw std::out_of_range("unknown task");
+        nodes[before]->successors.push_back(after);
+        ++nodes[after]->num_preds;
+        checked = false;
+    }
+
+    // Kahn's algorithm, only run after the graph is changed
+    inline void TaskGraph::check_acyclic() const {
+        std::vector<std::size_t> in_degree(nodes.size());
+        std::vector<TaskId> ready;
+        for (TaskId i = 0; i != nodes.size(); ++i)
+            if (!(in_degree[i] = nodes[i]->num_preds))
+                ready.push_back(i);
+        std::size_t visited = 0;
+        while (!ready.empty()) {
+            auto id = ready.back();
+            ready.pop_back();
+            ++visited;
+            for (auto s: nodes[id]->successors)
+                if (!--in_degree[s])
+                    ready.push_back(s);
+        }
+        if (visited != nodes.size())
+            throw std::logic_error("task graph contains a cycle");
+    }
+
+    template<typename Pool>
+    std::future<void> TaskGraph::run(Pool& pool) {
+        if (!checked) {
+            check_acyclic();
+            checked = true;
+        }
+        if (running.exchange(true, std::memory_order_acquire))
+            throw std::logic_error("task graph is already running");
+        auto state = std::make_shared<RunState>();
+        auto res = state->done.get_future();
+        if (nodes.empty()) {
+            running.store(false, std::memory_order_release);
+            state->done.set_value();
+            return res;
+        }
+        state->remaining.store(nodes.size(), std::memory_order_relaxed);
+        for (auto& n: nodes)
+            n->pending.store(n->num_preds, std::memory_order_relaxed);
+        // collect the roots first, as the tasks may run before the loop ends
+        std::vector<TaskId> roots;
+        for (TaskId i = 0; i != nodes.size(); ++i)
+            if (!nodes[i]->num_preds)
+                roots.push_back(i);
+        for (auto id: roots)
+            schedule(pool, id, state);
+        return res;
+    }
+
+    inline void TaskGraph::fail(RunState& state, std::exception_ptr e) {
+        if (!state.failed.exchange(true))
+            state.error = std::move(e);
+    }
+
+    template<typename Pool>
+    void TaskGraph::schedule(Pool& pool, TaskId id, const std::shared_ptr<RunState>& state) {
+        try {
+            pool.submit([this, &pool, id, state] { execute(pool, id, state); });
+        }
+        catch (...) {
+            // the run has failed, settle the counts of the task and its successors on this thread
+            // without running them, so that the future is ready
+            fail(*state, std::current_exception());
+            execute(pool, id, state);
+        }
+    }
+
+    template<typename Pool>
+    void TaskGraph::execute(Pool& pool, TaskId id, const std::shared_ptr<RunState>& state) {
+        while (true) {
+            auto& node = *nodes[id];
+            if (!state->failed.load(std::memory_order_relaxed)) {
+                try {
+                    if (node.f)
+                        node.f();
+                }
+                catch (...) {
+                    fail(*state, std::current_exception());
+                }
+            }
+            // run one ready successor on this thread and hand the others to the pool
+            const auto none = nodes.size();
+            auto next = none;
+            for (auto s: node.successors) {
+                if (nodes[s]->pending.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+                    if (next != none)
+                        schedule(pool, next, state);
+                    next = s;
+                }
+            }
+            // the graph must not be touched after the last task is done, as it may be gone
+            if (state->remaining.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+                running.store(false, std::memory_order_release);
+                if (state->error)
+                    state->done.set_exception(state->error);
+                else
+                    state->done.set_value();
+                return;
+            }
+            if (next == none)
+                return;
+            id = next;
+        }
+    }
+}
+
+#endif
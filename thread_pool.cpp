@@ -1,6 +1,9 @@
+#include <cassert>
 #include <iostream>
 #include <functional>
 #include <future>
+#include <thread>
+#include <vector>
 
 #include "thread_pool.hpp"
 
@@ -16,8 +19,65 @@ double task() {
     return i.load(std::memory_order_relaxed);
 }
 
+ThreadPool<double()>* pool;
+
+// nested tasks wait through the pool, which runs other tasks meanwhile instead of blocking
+double fib(int n) {
+    if (n < 2)
+        return n;
+    auto f = pool->submit(fib, n - 1);
+    auto b = fib(n - 2);
+    return pool->get(f) + b;
+}
+
+// stop() closes the shared queue, so that submit() throws, and restart() runs the tasks left
+void stop_and_restart() {
+    ThreadPool<int()> p(2);
+    auto f = p.submit([] { return 1; });
+    assert(f.get() == 1);
+    p.stop();
+    bool refused = false;
+    try {
+        p.submit([] { return 2; });
+    }
+    catch (QueueClosed&) {
+        refused = true;
+    }
+    assert(refused);
+    p.restart();
+    assert(p.submit([] { return 3; }).get() == 3);
+}
+
+// blocked workers make an elastic pool grow, busy ones do not, and idle ones retire
+void elastic() {
+    using namespace std::chrono_literals;
+    ThreadPool<void()> p(2, 8, 50ms);
+    std::vector<std::future<void>> fs;
+    for (int i = 0; i != 32; ++i)
+        fs.push_back(p.submit([] { std::this_thread::sleep_for(20ms); }));
+    for (auto& f: fs)
+        f.get();
+    auto grown = p.size();
+    assert(grown > 2 && grown <= 8);
+    std::this_thread::sleep_for(300ms);
+    assert(p.size() == 2);
+    fs.clear();
+    for (int i = 0; i != 8; ++i)
+        fs.push_back(p.submit([] {
+            auto until = std::chrono::steady_clock::now() + 50ms;
+            while (std::chrono::steady_clock::now() < until);
+        }));
+    for (auto& f: fs)
+        f.get();
+    cout << "elastic pool grew to " << grown << " threads on blocking tasks, "
+         << p.size() << " on computing ones\n";
+}
+
 int main() {
+    stop_and_restart();
+    elastic();
     ThreadPool<double()> thread_pool(2);
+    pool = &thread_pool;
     int k = 1;
     vector<future<double>> v;
     for (auto i = 0; i != 10; ++i) {
@@ -25,4 +85,5 @@ int main() {
     }
     for (auto& f: v)
         cout << f.get() << '\n';
+    cout << "fib(15) = " << thread_pool.submit(fib, 15).get() << '\n';
 }
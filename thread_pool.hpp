@@ -7,19 +7,45 @@
 #include <functional>
 #include <future>
 #include <memory>
+#include <mutex>
 #include <queue>
+#include <stdexcept>
 #include <thread>
+#include <vector>
 
+#include <pthread.h>
+#include <time.h>
+
+#include "cache_line.hpp"
 #include "queue.hpp"
 #include "join_thread.hpp"
+#include "timing_wheel.hpp"
+#include "trace.hpp"
 
 namespace utility {
-    template<typename Func>
+    /*
+    SharedQueue may be any queue providing push(), push_bulk(), try_pop(), pop(T&), pop_for(), close() and
+    empty(), e.g. MultiQueue.
+    An elastic pool keeps between min_threads and max_threads workers. A monitor thread checks the
+    pool every probe_interval and adds a worker when, for two probes in a row, tasks have been waiting
+    in the shared queue, no worker was free and the busy workers were blocked, e.g., on I/O, a lock or
+    a future: their threads, read through their CPU clocks, left most of a core they could have used
+    idle since the last probe. Workers busy computing do not grow the pool, as more threads would only
+    compete with them for the CPU; other processes loading the machine may make them look blocked
+    though. A worker retires after being idle for idle_timeout.
+    */
+    template<typename Func, typename SharedQueue=LockBasedQueue<
+        std::packaged_task<Func>, std::list<std::packaged_task<Func>>>>
     class ThreadPool {
     public:
         ThreadPool(std::size_t=std::thread::hardware_concurrency()); // should I minus one here for the main thread?
+        ThreadPool(std::size_t min_threads, std::size_t max_threads,
+            std::chrono::milliseconds idle_timeout=std::chrono::seconds(1),
+            std::chrono::milliseconds probe_interval=std::chrono::milliseconds(5));
         ~ThreadPool();
 
+        std::size_t size() const { return num_threads.load(std::memory_order_relaxed); }
+
         template<typename FuncType, typename... Args, // a separate FuncType required for lambda functions
             typename ReturnType=typename std::invoke_result<
                 std::decay_t<FuncType>, std::decay_t<Args>...>::type>
@@ -28,86 +54,321 @@ namespace utility {
             typename ReturnType=typename std::invoke_result<
                 std::decay_t<FuncType>, std::decay_t<Args>...>::type>
         std::future<ReturnType> submit_local(FuncType&& f, Args&&...args);
-        void stop();    // stop may delay until the current task in each thread is finished
+        // closes the shared queue, so that submit() throws QueueClosed, and lets every worker exit
+        // once its current task is finished. Tasks still queued stay there until restart()
+        void stop();
+        // joins the workers stopped and starts new ones on a new shared queue, which takes over the
+        // tasks left; must not be called concurrently with other member functions
         void restart();
+
+        // delayed and periodic tasks, kept in a timing wheel run by one timer thread, which is
+        // started on first use. Tasks expiring on the same tick are pushed to the shared queue at once.
+        // As with submit(), f(args...) must return the return type of Func; its result is discarded
+        using TimerHandle = typename TimerService<std::function<Func>>::Handle;
+        template<typename Rep, typename Period, typename FuncType, typename... Args>
+        TimerHandle submit_after(const std::chrono::duration<Rep, Period>& d, FuncType&& f, Args&&...args) {
+            return get_timers().schedule(std::chrono::steady_clock::now() + d,
+                std::bind(std::forward<FuncType>(f), std::forward<Args>(args)...));
+        }
+        template<typename Clock, typename Duration, typename FuncType, typename... Args>
+        TimerHandle submit_at(const std::chrono::time_point<Clock, Duration>& t, FuncType&& f, Args&&...args) {
+            return submit_after(t - Clock::now(), std::forward<FuncType>(f), std::forward<Args>(args)...);
+        }
+        // the first run is one period from now. The period is rounded up to whole ticks of 1ms,
+        // one that is not positive throws std::invalid_argument
+        template<typename Rep, typename Period, typename FuncType, typename... Args>
+        TimerHandle submit_every(const std::chrono::duration<Rep, Period>& period, FuncType&& f, Args&&...args) {
+            if (period <= period.zero())
+                throw std::invalid_argument("timer period must be positive");
+            auto p = std::chrono::ceil<std::chrono::milliseconds>(period);
+            return get_timers().schedule(std::chrono::steady_clock::now() + p,
+                std::bind(std::forward<FuncType>(f), std::forward<Args>(args)...), p);
+        }
+
+        // runs one task, local ones first, without blocking. Returns false if there is none, see Listing 9.7
+        bool run_pending_task();
+        // waits for f while running other pending tasks, so that a task waiting for its
+        // children does not take a worker away from the pool
+        template<typename T>
+        void wait(const std::future<T>& f);
+        template<typename T>
+        T get(std::future<T>& f) {
+            wait(f);
+            return f.get();
+        }
     private:
-        void worker_thread();
-        void run_task();
+        // a worker thread and what the monitor needs to know about it
+        struct alignas(cache_line_size) Worker {
+            std::atomic<bool> busy{false};              // only maintained by elastic pools
+            std::chrono::nanoseconds cpu_time{0};       // at the last probe, monitor only
+            JoinThread thread;                          // declared last so that it's joined first
+        };
+
+        void start();
+        void worker_thread(Worker*);
+        bool run_task(Worker*);
+        void monitor_thread();
+        bool workers_blocked(std::chrono::nanoseconds elapsed);
+        void spawn_thread();
+        bool try_retire();
+        bool elastic() const { return max_threads > min_threads; }
+        TimerService<std::function<Func>>& get_timers();
+
         using LocalThreadType = std::queue<std::packaged_task<Func>>;
         static thread_local LocalThreadType local_queue;   // local queue, not used for now
-        using SharedQueueType = LockBasedQueue<std::packaged_task<Func>, 
-                                    std::list<std::packaged_task<Func>>>;
-        std::shared_ptr<SharedQueueType> shared_queue;
+        using SharedQueueType = SharedQueue;
+        // read by every worker on every task, written only by restart()
+        alignas(cache_line_size) std::shared_ptr<SharedQueueType> shared_queue;
         std::atomic_bool done;
-        std::vector<JoinThread> threads;
+        const std::size_t min_threads;
+        const std::size_t max_threads;
+        const std::chrono::milliseconds idle_timeout;
+        const std::chrono::milliseconds probe_interval;
+        // written when workers are added or retire
+        alignas(cache_line_size) std::atomic<std::size_t> num_threads{0};
+        std::mutex threads_mutex;
+        std::vector<std::thread::id> retired;      // retired threads yet to be joined
+        std::vector<std::unique_ptr<Worker>> workers;
+        std::once_flag timers_flag;
+        std::shared_ptr<TimerService<std::function<Func>>> timers;     // stopped by the destructor
+        JoinThread monitor;     // declared last so that it's joined first
     };
 
-    template<typename Func>
-    ThreadPool<Func>::ThreadPool(std::size_t n):
-        shared_queue(new SharedQueueType{}), done(false) {
-        for (auto i = 0; i != n; ++i)
-            threads.emplace_back(&ThreadPool::worker_thread, this);
+    template<typename Func, typename SharedQueue>
+    ThreadPool<Func, SharedQueue>::ThreadPool(std::size_t n):
+        ThreadPool(n, n) {}
+
+    template<typename Func, typename SharedQueue>
+    ThreadPool<Func, SharedQueue>::ThreadPool(std::size_t min_threads, std::size_t max_threads,
+        std::chrono::milliseconds idle_timeout, std::chrono::milliseconds probe_interval):
+        shared_queue(new SharedQueueType{}), done(false),
+        min_threads(min_threads), max_threads(std::max(min_threads, max_threads)),
+        idle_timeout(idle_timeout), probe_interval(probe_interval) {
+        start();
     }
 
-    template<typename Func>
-    ThreadPool<Func>::~ThreadPool() {
-        done.store(true, std::memory_order_relaxed);
+    template<typename Func, typename SharedQueue>
+    ThreadPool<Func, SharedQueue>::~ThreadPool() {
+        if (timers)
+            timers->stop();
+        stop();
+    }
+
+    template<typename Func, typename SharedQueue>
+    void ThreadPool<Func, SharedQueue>::start() {
+        for (std::size_t i = 0; i != min_threads; ++i) {
+            num_threads.fetch_add(1, std::memory_order_relaxed);
+            spawn_thread();
+        }
+        if (elastic())
+            monitor = JoinThread(&ThreadPool::monitor_thread, this);
+    }
+
+    template<typename Func, typename SharedQueue>
+    TimerService<std::function<Func>>& ThreadPool<Func, SharedQueue>::get_timers() {
+        std::call_once(timers_flag, [this] {
+            timers = std::make_shared<TimerService<std::function<Func>>>(
+                [this](std::vector<std::function<Func>>& batch) {
+                    std::vector<std::packaged_task<Func>> tasks;
+                    tasks.reserve(batch.size());
+                    for (auto& f: batch)
+                        tasks.emplace_back(std::move(f));
+                    // the timer thread may race with restart()
+                    std::atomic_load(&shared_queue)->push_bulk(std::make_move_iterator(tasks.begin()),
+                        std::make_move_iterator(tasks.end()));
+                });
+        });
+        return *timers;
     }
 
-    template<typename Func>
+    template<typename Func, typename SharedQueue>
     template<typename FuncType, typename...Args, typename ReturnType>
-    std::future<ReturnType> ThreadPool<Func>::submit(FuncType&& f, Args&&...args) {
+    std::future<ReturnType> ThreadPool<Func, SharedQueue>::submit(FuncType&& f, Args&&...args) {
         auto result = post_task(*shared_queue,
-            std::forward<FuncType>(f), std::forward<Args>(args)...);
+            CONCURRENCY_TRACED("task", std::forward<FuncType>(f)), std::forward<Args>(args)...);
         return result;
     }
 
-    template<typename Func>
+    template<typename Func, typename SharedQueue>
     template<typename FuncType, typename...Args, typename ReturnType>
-    std::future<ReturnType> ThreadPool<Func>::submit_local(FuncType&& f, Args&&...args) {
-        auto result = post_task(local_queue, 
-            std::forward<FuncType>(f), std::forward<Args>(args)...);
+    std::future<ReturnType> ThreadPool<Func, SharedQueue>::submit_local(FuncType&& f, Args&&...args) {
+        auto result = post_task(local_queue,
+            CONCURRENCY_TRACED("task", std::forward<FuncType>(f)), std::forward<Args>(args)...);
         return result;
     }
 
-    template<typename Func>
-    void ThreadPool<Func>::stop() {
+    template<typename Func, typename SharedQueue>
+    void ThreadPool<Func, SharedQueue>::stop() {
         done.store(true, std::memory_order_relaxed);
+        // wakes the workers blocked on an empty queue
+        shared_queue->close();
     }
 
-    template<typename Func>
-    void ThreadPool<Func>::restart() {
+    template<typename Func, typename SharedQueue>
+    void ThreadPool<Func, SharedQueue>::restart() {
+        if (!done.load(std::memory_order_relaxed))
+            return;
+        if (monitor.joinable())
+            monitor.join();
+        std::vector<std::unique_ptr<Worker>> stopped;
+        {
+            std::lock_guard l(threads_mutex);
+            stopped.swap(workers);
+            retired.clear();
+        }
+        stopped.clear();    // joins them, a worker retiring takes threads_mutex
+        // a closed queue stays closed
+        auto queue = std::make_shared<SharedQueueType>();
+        std::packaged_task<Func> task;
+        while (shared_queue->try_pop(task))
+            queue->push(std::move(task));
+        std::atomic_store(&shared_queue, std::move(queue));
+        num_threads.store(0, std::memory_order_relaxed);
         done.store(false, std::memory_order_relaxed);
+        start();
     }
 
-    template<typename Func>
-    void ThreadPool<Func>::run_task() {
+    template<typename Func, typename SharedQueue>
+    bool ThreadPool<Func, SharedQueue>::run_task(Worker* w) {
+        std::packaged_task<Func> task;
         if (!local_queue.empty()) {
-            auto task = std::move(local_queue.front());
+            task = std::move(local_queue.front());
             local_queue.pop();
+        }
+        // blocks until a task comes or stop() closes the queue; an elastic worker wakes up
+        // after idle_timeout to see whether it may retire
+        else if (elastic()? !shared_queue->pop_for(task, idle_timeout): !shared_queue->pop(task))
+            return false;
+        if (elastic()) {
+            w->busy.store(true, std::memory_order_relaxed);
             task();
+            w->busy.store(false, std::memory_order_relaxed);
         }
-        else {
-            std::packaged_task<Func> task;
-            auto flag = shared_queue->try_pop(task);
-            if (flag)
-                task();
-            else {
-                using namespace std::chrono_literals;
-                std::this_thread::sleep_for(1s);
-            }
+        else
+            task();
+        return true;
+    }
+
+    template<typename Func, typename SharedQueue>
+    bool ThreadPool<Func, SharedQueue>::run_pending_task() {
+        std::packaged_task<Func> task;
+        if (!local_queue.empty()) {
+            task = std::move(local_queue.front());
+            local_queue.pop();
+        }
+        else if (!shared_queue->try_pop(task))
+            return false;
+        task();
+        return true;
+    }
+
+    template<typename Func, typename SharedQueue>
+    template<typename T>
+    void ThreadPool<Func, SharedQueue>::wait(const std::future<T>& f) {
+        using namespace std::chrono_literals;
+        while (f.wait_for(0s) != std::future_status::ready) {
+            // nothing else to do, block on f for a while before looking for new tasks
+            if (!run_pending_task())
+                f.wait_for(100us);
         }
     }
 
-    template<typename Func>
-    void ThreadPool<Func>::worker_thread() {
+    template<typename Func, typename SharedQueue>
+    void ThreadPool<Func, SharedQueue>::worker_thread(Worker* w) {
+        auto idle_since = std::chrono::steady_clock::now();
         while (!done.load(std::memory_order_relaxed)) {
-            run_task();
+            if (run_task(w))
+                idle_since = std::chrono::steady_clock::now();
+            else if (elastic()
+                && std::chrono::steady_clock::now() - idle_since >= idle_timeout
+                && try_retire())
+                return;
+        }
+    }
+
+    template<typename Func, typename SharedQueue>
+    void ThreadPool<Func, SharedQueue>::monitor_thread() {
+        unsigned pressure = 0;  // consecutive probes finding waiting tasks and blocked workers
+        auto last_probe = std::chrono::steady_clock::now();
+        while (!done.load(std::memory_order_relaxed)) {
+            std::this_thread::sleep_for(probe_interval);
+            auto now = std::chrono::steady_clock::now();
+            auto n = num_threads.load(std::memory_order_relaxed);
+            if (workers_blocked(now - last_probe) && !shared_queue->empty())
+                ++pressure;
+            else
+                pressure = 0;
+            last_probe = now;
+            // only the monitor adds workers, so n cannot grow meanwhile
+            if (pressure >= 2 && n < max_threads) {
+                num_threads.fetch_add(1, std::memory_order_relaxed);
+                spawn_thread();
+                pressure = 0;
+            }
+        }
+    }
+
+    // true if no worker is free and the workers left most of a core idle over the elapsed time
+    template<typename Func, typename SharedQueue>
+    bool ThreadPool<Func, SharedQueue>::workers_blocked(std::chrono::nanoseconds elapsed) {
+        std::chrono::nanoseconds used{0};   // CPU time of the workers since the last probe
+        std::size_t live = 0;
+        bool all_busy = true;
+        std::lock_guard l(threads_mutex);
+        for (auto& w: workers) {
+            // the thread is not joined while threads_mutex is held, so its handle stays valid
+            clockid_t clock;
+            timespec ts;
+            if (pthread_getcpuclockid(w->thread.get_thread().native_handle(), &clock)
+                || clock_gettime(clock, &ts))
+                continue;
+            auto cpu_time = std::chrono::seconds(ts.tv_sec) + std::chrono::nanoseconds(ts.tv_nsec);
+            used += cpu_time - w->cpu_time;
+            w->cpu_time = cpu_time;
+            if (std::find(retired.begin(), retired.end(), w->thread.get_id()) != retired.end())
+                continue;   // exiting
+            ++live;
+            all_busy = all_busy && w->busy.load(std::memory_order_relaxed);
+        }
+        // summed up rather than per worker, as a running thread may well miss a whole probe_interval
+        // on a loaded core
+        auto cores = std::min<std::size_t>(std::max(1u, std::thread::hardware_concurrency()), live);
+        return all_busy && live && elapsed * cores - used > elapsed * 3 / 4;
+    }
+
+    template<typename Func, typename SharedQueue>
+    void ThreadPool<Func, SharedQueue>::spawn_thread() {
+        std::lock_guard l(threads_mutex);
+        // join the retired threads, which are exiting if not gone yet
+        for (auto id: retired) {
+            auto it = std::find_if(workers.begin(), workers.end(),
+                [id](const std::unique_ptr<Worker>& w) { return w->thread.get_id() == id; });
+            if (it != workers.end()) {
+                (*it)->thread.join();
+                workers.erase(it);
+            }
+        }
+        retired.clear();
+        auto w = std::make_unique<Worker>();
+        w->thread = JoinThread(&ThreadPool::worker_thread, this, w.get());
+        workers.push_back(std::move(w));
+    }
+
+    template<typename Func, typename SharedQueue>
+    bool ThreadPool<Func, SharedQueue>::try_retire() {
+        auto n = num_threads.load(std::memory_order_relaxed);
+        while (n > min_threads) {
+            if (num_threads.compare_exchange_weak(n, n - 1, std::memory_order_relaxed)) {
+                std::lock_guard l(threads_mutex);
+                retired.push_back(std::this_thread::get_id());
+                return true;
+            }
         }
+        return false;
     }
 
-    template<typename Func>
-    thread_local typename ThreadPool<Func>::LocalThreadType ThreadPool<Func>::local_queue = {};
+    template<typename Func, typename SharedQueue>
+    thread_local typename ThreadPool<Func, SharedQueue>::LocalThreadType ThreadPool<Func, SharedQueue>::local_queue = {};
 }
 
 #endif
@@ -0,0 +1,116 @@
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "thread_pool.hpp"
+#include "timing_wheel.hpp"
+
+using namespace utility;
+using namespace std::chrono_literals;
+
+/*
+The wheel on its own must expire every entry on the advance reaching its tick, on every level; on
+a pool, delayed tasks never run before their deadline, periodic ones keep their period, and
+cancelled ones stop. Build with -O2 -pthread, or -fsanitize=thread.
+*/
+
+void wheel_deadlines() {
+    using Wheel = TimingWheel<int>;
+    Wheel wheel(1000);
+    std::mt19937_64 rng(42);
+    std::vector<Wheel::EntryPtr> entries;
+    // deltas on every level, past the last one, and a few right on the slot boundaries
+    std::vector<std::uint64_t> deltas = {0, 1, 63, 64, 65, 4095, 4096, 262143, 262144, 16777215, 16777216, 40000000};
+    for (int i = 0; i != 2000; ++i)
+        deltas.push_back(rng() % (std::uint64_t(1) << (rng() % 26)));
+    for (std::size_t i = 0; i != deltas.size(); ++i) {
+        auto e = std::make_shared<Wheel::Entry>();
+        e->callback = i;
+        e->expire = wheel.now() + deltas[i];
+        entries.push_back(e);
+        wheel.add(e);
+    }
+    // removed entries never expire
+    for (std::size_t i = 12; i < entries.size(); i += 7)
+        assert(wheel.remove(entries[i].get()));
+    std::vector<bool> fired(entries.size());
+    while (!wheel.empty()) {
+        // jump as far as the wheel allows, or less
+        auto from = wheel.now();
+        auto to = from + std::max<std::uint64_t>(1, rng() % (wheel.ticks_to_next() + 1));
+        wheel.advance(to, [&](Wheel::EntryPtr e) {
+            assert(!fired[e->callback]);
+            // on the first advance reaching its deadline, a deadline of now is due on the next tick
+            auto due = std::max<std::uint64_t>(e->expire, 1001);
+            assert(from < due && due <= to);
+            fired[e->callback] = true;
+        });
+        assert(wheel.now() == to);
+    }
+    for (std::size_t i = 0; i != entries.size(); ++i)
+        assert(fired[i] == (i < 12 || (i - 12) % 7 != 0));
+}
+
+void pool_deadlines(ThreadPool<void()>& pool) {
+    std::atomic<int> early{0}, done{0};
+    std::vector<std::thread> ts;
+    for (int t = 0; t != 4; ++t)
+        ts.emplace_back([&, t] {
+            for (int i = 0; i != 50; ++i) {
+                auto d = std::chrono::microseconds((i * 997 + t * 131) % 30000);
+                auto deadline = std::chrono::steady_clock::now() + d;
+                pool.submit_after(d, [&, deadline] {
+                    if (std::chrono::steady_clock::now() < deadline)
+                        ++early;
+                    ++done;
+                });
+            }
+        });
+    for (auto& t: ts)
+        t.join();
+    while (done != 200)
+        std::this_thread::sleep_for(1ms);
+    assert(early == 0);
+}
+
+void pool_periods(ThreadPool<void()>& pool) {
+    std::atomic<int> runs{0}, fine{0}, cancelled{0};
+    auto start = std::chrono::steady_clock::now();
+    auto h = pool.submit_every(10ms, [&] { ++runs; });
+    // a period finer than the ticks is rounded up, not down to zero
+    auto f = pool.submit_every(100us, [&] { ++fine; });
+    auto c = pool.submit_after(50ms, [&] { ++cancelled; });
+    assert(c.cancel() && !c.cancel());
+    std::this_thread::sleep_for(200ms);
+    assert(h.cancel() && f.cancel() && !h.cancel());
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    // never more often than the period allows, and not lagging far behind on an idle pool
+    assert(runs <= elapsed / 10ms && runs >= 5);
+    assert(fine <= elapsed / 1ms);
+    // a run handed to the pool before the cancel may still come
+    std::this_thread::sleep_for(30ms);
+    auto after = runs.load();
+    std::this_thread::sleep_for(50ms);
+    assert(runs == after && cancelled == 0);
+
+    bool threw = false;
+    try {
+        pool.submit_every(0ms, [] {});
+    }
+    catch (std::invalid_argument&) {
+        threw = true;
+    }
+    assert(threw);
+}
+
+int main() {
+    wheel_deadlines();
+    ThreadPool<void()> pool(2);
+    pool_deadlines(pool);
+    pool_periods(pool);
+    std::printf("ok\n");
+}
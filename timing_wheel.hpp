@@ -0,0 +1,343 @@
+#ifndef CONCURRENCY_TIMING_WHEEL_H_
+#define CONCURRENCY_TIMING_WHEEL_H_
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include "join_thread.hpp"
+
+namespace utility {
+    /*
+    Hierarchical timing wheel (Varghese & Lauck, as used by the Linux kernel timers).
+    Level l has 64 slots of 64^l ticks each, so four levels cover 64^4 ticks; later deadlines are
+    parked in the last level and re-inserted until they get close. Every slot is an intrusive
+    doubly linked list, which makes add() and remove() O(1). A slot of a higher level is spread over
+    the lower levels (cascaded) when the lower level wraps around.
+    The wheel itself is not thread safe, see TimerService.
+    */
+    template<typename Callback>
+    class TimingWheel {
+        static constexpr int levels = 4;
+        static constexpr int slot_bits = 6;
+        static constexpr std::uint64_t slots = 1 << slot_bits;
+        static constexpr std::uint64_t mask = slots - 1;
+        static constexpr std::uint64_t max_delta = (std::uint64_t(1) << (slot_bits * levels)) - 1;
+    public:
+        struct Entry {
+            Callback callback;
+            std::uint64_t expire = 0;   // tick
+            std::uint64_t period = 0;   // ticks, 0 for one-shot timers
+            bool cancelled = false;     // left to the owner of the wheel, see TimerService
+            Entry* prev = nullptr;
+            Entry* next = nullptr;
+            Entry** slot = nullptr;     // the list the entry is linked in, nullptr if not linked
+            std::shared_ptr<Entry> self;    // keeps a linked entry alive
+        };
+        using EntryPtr = std::shared_ptr<Entry>;
+
+        explicit TimingWheel(std::uint64_t now=0): current(now) {}
+        TimingWheel(const TimingWheel&) = delete;
+        TimingWheel& operator=(const TimingWheel&) = delete;
+        ~TimingWheel();
+
+        std::uint64_t now() const { return current; }
+        bool empty() const { return count == 0; }
+        std::size_t size() const { return count; }
+        // a deadline not in the future expires on the next tick
+        void add(EntryPtr e);
+        bool remove(Entry* e);
+        // moves the wheel to tick `to`, calling on_expire(EntryPtr) for each expired entry.
+        // on_expire may add entries back, e.g. to reschedule periodic timers
+        template<typename Func>
+        void advance(std::uint64_t to, Func on_expire);
+        // number of ticks we can sleep before the wheel has to advance
+        std::uint64_t ticks_to_next() const;
+    private:
+        void link(Entry* e);
+        static void unlink(Entry* e);
+        void cascade(int level);
+
+        Entry* wheel[levels][slots] = {};
+        std::uint64_t current;
+        std::size_t count = 0;
+    };
+
+    template<typename Callback>
+    TimingWheel<Callback>::~TimingWheel() {
+        for (auto& level: wheel)
+            for (auto& head: level)
+                while (head) {
+                    auto e = head;
+                    unlink(e);
+                    e->self.reset();
+                }
+    }
+
+    template<typename Callback>
+    void TimingWheel<Callback>::add(EntryPtr e) {
+        if (e->expire <= current)
+            e->expire = current + 1;
+        auto p = e.get();
+        p->self = std::move(e);
+        link(p);
+        ++count;
+    }
+
+    template<typename Callback>
+    bool TimingWheel<Callback>::remove(Entry* e) {
+        if (!e->slot)
+            return false;
+        unlink(e);
+        --count;
+        e->self.reset();    // may destroy e
+        return true;
+    }
+
+    // places e by its deadline relative to the current tick, an entry may expire at the current tick when cascaded
+    template<typename Callback>
+    void TimingWheel<Callback>::link(Entry* e) {
+        auto expire = e->expire;
+        if (expire > current && expire - current > max_delta)
+            expire = current + max_delta;
+        auto delta = expire > current? expire - current: 0;
+        int level = 0;
+        while (level != levels - 1 && delta >= (std::uint64_t(1) << (slot_bits * (level + 1))))
+            ++level;
+        auto& head = wheel[level][(expire >> (slot_bits * level)) & mask];
+        e->prev = nullptr;
+        e->next = head;
+        if (head)
+            head->prev = e;
+        head = e;
+        e->slot = &head;
+    }
+
+    template<typename Callback>
+    void TimingWheel<Callback>::unlink(Entry* e) {
+        if (e->prev)
+            e->prev->next = e->next;
+        else
+            *e->slot = e->next;
+        if (e->next)
+            e->next->prev = e->prev;
+        e->prev = e->next = nullptr;
+        e->slot = nullptr;
+    }
+
+    template<typename Callback>
+    void TimingWheel<Callback>::cascade(int level) {
+        auto& head = wheel[level][(current >> (slot_bits * level)) & mask];
+        auto e = head;
+        head = nullptr;
+        while (e) {
+            auto next = e->next;
+            e->slot = nullptr;
+            link(e);
+            e = next;
+        }
+    }
+
+    template<typename Callback>
+    template<typename Func>
+    void TimingWheel<Callback>::advance(std::uint64_t to, Func on_expire) {
+        while (current < to) {
+            ++current;
+            // cascade level l when all lower levels wrap around
+            for (int level = 1; level != levels; ++level) {
+                if (current & ((std::uint64_t(1) << (slot_bits * level)) - 1))
+                    break;
+                cascade(level);
+            }
+            auto& head = wheel[0][current & mask];
+            while (head) {
+                auto e = head;
+                unlink(e);
+                --count;
+                auto p = std::move(e->self);
+                on_expire(std::move(p));
+            }
+            if (!count) {   // nothing left, skip the idle ticks
+                current = to;
+                return;
+            }
+        }
+    }
+
+    template<typename Callback>
+    std::uint64_t TimingWheel<Callback>::ticks_to_next() const {
+        if (!count)
+            return max_delta;
+        // the next non-empty slot of the lowest level, or the next cascade
+        for (std::uint64_t i = 1; i != slots; ++i) {
+            if (((current + i) & mask) == 0)
+                return i;
+            if (wheel[0][(current + i) & mask])
+                return i;
+        }
+        return slots;
+    }
+
+    /*
+    Runs a TimingWheel on a thread of its own. Expired callbacks are collected and handed to
+    `dispatch` in one batch per tick, outside of the lock. Ticks are `Resolution` long.
+    A periodic timer is rescheduled after its batch has been dispatched, unless it was cancelled
+    meanwhile; a run already handed to dispatch is not called back. If dispatch throws, e.g.
+    because the queue it pushes to has been closed, the batch is dropped.
+    */
+    template<typename Callback, typename Resolution=std::chrono::milliseconds>
+    class TimerService: public std::enable_shared_from_this<TimerService<Callback, Resolution>> {
+        using Wheel = TimingWheel<Callback>;
+    public:
+        using Clock = std::chrono::steady_clock;
+        using Dispatch = std::function<void(std::vector<Callback>&)>;
+
+        // cancels a timer, see TimerService::schedule
+        class Handle {
+        public:
+            Handle() = default;
+            // returns false if the timer has already fired (one-shot) or been cancelled
+            bool cancel() {
+                auto s = service.lock();
+                return s && s->cancel(entry);
+            }
+        private:
+            friend class TimerService;
+            Handle(std::weak_ptr<TimerService> s, std::weak_ptr<typename Wheel::Entry> e):
+                service(std::move(s)), entry(std::move(e)) {}
+            std::weak_ptr<TimerService> service;
+            std::weak_ptr<typename Wheel::Entry> entry;
+        };
+
+        explicit TimerService(Dispatch dispatch):
+            dispatch(std::move(dispatch)), start(Clock::now()) {}
+        ~TimerService() { stop(); }
+
+        // period of zero makes a one-shot timer, a negative one throws std::invalid_argument
+        Handle schedule(Clock::time_point deadline, Callback callback,
+            Resolution period=Resolution::zero());
+        void stop();
+    private:
+        // the tick a time falls in, which the wheel reaches once that time has come
+        std::uint64_t to_tick(Clock::time_point t) const {
+            return t <= start? 0: std::chrono::duration_cast<Resolution>(t - start).count();
+        }
+        // the first tick not before a deadline, so that a timer never fires early
+        std::uint64_t deadline_tick(Clock::time_point t) const {
+            return t <= start? 0: std::chrono::ceil<Resolution>(t - start).count();
+        }
+        bool cancel(const std::weak_ptr<typename Wheel::Entry>&);
+        void timer_thread();
+
+        Dispatch dispatch;
+        const Clock::time_point start;
+        std::mutex m;
+        std::condition_variable cond;
+        Wheel wheel;
+        bool done = false;
+        JoinThread thread;  // started by the first schedule()
+    };
+
+    template<typename Callback, typename Resolution>
+    typename TimerService<Callback, Resolution>::Handle
+    TimerService<Callback, Resolution>::schedule(
+        Clock::time_point deadline, Callback callback, Resolution period) {
+        if (period < Resolution::zero())
+            throw std::invalid_argument("negative timer period");
+        auto e = std::make_shared<typename Wheel::Entry>();
+        e->callback = std::move(callback);
+        e->expire = deadline_tick(deadline);
+        e->period = period.count();
+        Handle h(this->weak_from_this(), e);
+        bool wake;
+        {
+            std::lock_guard l(m);
+            if (!thread.joinable() && !done)
+                thread = JoinThread(&TimerService::timer_thread, this);
+            // an empty wheel is left behind while idle, catch up in O(1) rather than tick by tick
+            // in the first advance() after the add
+            if (wheel.empty())
+                wheel.advance(to_tick(Clock::now()), [](typename Wheel::EntryPtr) {});
+            // the timer thread sleeps until the next known deadline, wake it if this one is earlier
+            wake = wheel.empty() || e->expire < wheel.now() + wheel.ticks_to_next();
+            wheel.add(std::move(e));
+        }
+        if (wake)
+            cond.notify_one();
+        return h;
+    }
+
+    template<typename Callback, typename Resolution>
+    bool TimerService<Callback, Resolution>::cancel(
+        const std::weak_ptr<typename Wheel::Entry>& entry) {
+        std::lock_guard l(m);
+        auto e = entry.lock();
+        if (!e || e->cancelled)
+            return false;
+        // a periodic timer being dispatched is not linked, but is rescheduled unless cancelled
+        if (!wheel.remove(e.get()) && !e->period)
+            return false;
+        e->cancelled = true;
+        return true;
+    }
+
+    template<typename Callback, typename Resolution>
+    void TimerService<Callback, Resolution>::stop() {
+        {
+            std::lock_guard l(m);
+            done = true;
+        }
+        cond.notify_one();
+        if (thread.joinable())
+            thread.join();
+    }
+
+    template<typename Callback, typename Resolution>
+    void TimerService<Callback, Resolution>::timer_thread() {
+        std::vector<Callback> batch;
+        std::vector<typename Wheel::EntryPtr> periodic;     // dispatched, to be rescheduled
+        std::unique_lock l(m);
+        while (!done) {
+            if (wheel.empty())
+                cond.wait(l);
+            else
+                cond.wait_until(l, start + Resolution(wheel.now() + wheel.ticks_to_next()));
+            if (done)
+                break;
+            wheel.advance(to_tick(Clock::now()), [&batch, &periodic](typename Wheel::EntryPtr e) {
+                if (e->period) {
+                    batch.push_back(e->callback);
+                    periodic.push_back(std::move(e));
+                }
+                else
+                    batch.push_back(std::move(e->callback));
+            });
+            if (!batch.empty()) {
+                l.unlock();
+                try {
+                    dispatch(batch);
+                }
+                catch (...) {
+                    // nowhere to run the batch, drop it rather than end the timer thread
+                }
+                batch.clear();
+                l.lock();
+            }
+            for (auto& e: periodic)
+                if (!e->cancelled) {
+                    e->expire += e->period;
+                    wheel.add(std::move(e));
+                }
+            periodic.clear();
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,66 @@
+#define CONCURRENCY_TRACE
+
+#include <atomic>
+#include <cassert>
+#include <cstdio>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "thread_pool.hpp"
+#include "trace.hpp"
+
+using namespace utility;
+
+/*
+Records scopes and pool tasks from threads that come and go while another thread dumps, then
+checks the final dump and writes it to trace.json for chrome://tracing or ui.perfetto.dev.
+Build with -O2 -pthread, or -fsanitize=thread.
+*/
+
+std::size_t count(const std::string& s, const std::string& what) {
+    std::size_t n = 0;
+    for (auto i = s.find(what); i != std::string::npos; i = s.find(what, i + 1))
+        ++n;
+    return n;
+}
+
+int main() {
+    Tracer::enable();
+    std::atomic<bool> recording{true};
+    // dumps may run while the buffers are written
+    std::thread dumper([&] {
+        while (recording) {
+            std::ostringstream os;
+            Tracer::dump(os);
+            assert(os.str().rfind("{\"traceEvents\":[", 0) == 0);
+        }
+    });
+    for (int round = 0; round != 100; ++round) {
+        std::thread a([] { Tracer::Scope s("a"); }), b([] { Tracer::Scope s("b"); });
+        a.join();
+        b.join();
+    }
+    {
+        ThreadPool<int()> pool(2);
+        std::vector<std::future<int>> fs;
+        for (int i = 0; i != 100; ++i)
+            fs.push_back(pool.submit([i] { return i; }));
+        for (int i = 0; i != 100; ++i)
+            assert(fs[i].get() == i);
+    }
+    recording = false;
+    dumper.join();
+
+    std::ostringstream os;
+    Tracer::dump(os);
+    auto out = os.str();
+    assert(count(out, "\"ph\":\"B\"") == count(out, "\"ph\":\"E\""));
+    assert(count(out, "\"ph\":\"b\"") == count(out, "\"ph\":\"e\""));
+    assert(count(out, "\"name\":\"a\"") == 200 && count(out, "\"name\":\"b\"") == 200);
+    assert(out.find("\"ts\":-") == std::string::npos);
+    // the buffers of the two threads of each round are reused by the main thread and the workers
+    assert(out.find("\"tid\":3,") == std::string::npos);
+    std::printf("%s\n", Tracer::dump("trace.json")? "trace.json written": "cannot write trace.json");
+}
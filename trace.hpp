@@ -0,0 +1,233 @@
+#ifndef CONCURRENCY_TRACE_H_
+#define CONCURRENCY_TRACE_H_
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+namespace utility {
+    /*
+    Timeline tracer writing Chrome/Perfetto trace JSON (load it in chrome://tracing or ui.perfetto.dev).
+    Every thread records into its own ring buffer, which is written by that thread only, so recording
+    an event is a few relaxed stores, a release store and a TSC read. When a buffer is full the oldest
+    events are overwritten. dump() may run concurrently with recording; events overwritten during
+    the dump are dropped. The buffer of an exiting thread is handed to the next thread starting to
+    record, so that threads coming and going, e.g., in an elastic ThreadPool, take no more buffers
+    than have been in use at once; their events share a tid in the trace.
+    The hooks in ThreadPool and LockBasedQueue are compiled in only when CONCURRENCY_TRACE is defined,
+    and record nothing until Tracer::enable() is called.
+    */
+    class Tracer {
+    public:
+        enum Phase: std::uint8_t {
+            Begin,          // slice on the calling thread
+            End,
+            AsyncBegin,     // slice spanning threads, matched by id
+            AsyncEnd,
+        };
+        static constexpr std::size_t buffer_size = 1 << 14;    // events per thread
+
+        static void enable(bool on=true) {
+            state().enabled.store(on, std::memory_order_relaxed);
+        }
+        static bool enabled() {
+            return state().enabled.load(std::memory_order_relaxed);
+        }
+        // name must outlive the dump, i.e., a string literal
+        static void record(const char* name, Phase phase, std::uint64_t id=0) {
+            if (enabled())
+                local_buffer().record(name, phase, id, now());
+        }
+        // unique across threads without a shared counter
+        static std::uint64_t next_id() {
+            auto& b = local_buffer();
+            return (std::uint64_t(b.tid) << 40) | ++b.last_id;
+        }
+        static void dump(std::ostream&);
+        static bool dump(const std::string& path) {
+            std::ofstream os(path);
+            dump(os);
+            return bool(os);
+        }
+
+        // records a slice on the current thread for the lifetime of the object
+        class Scope {
+        public:
+            explicit Scope(const char* name): name(name) { record(name, Begin); }
+            Scope(const Scope&) = delete;
+            Scope& operator=(const Scope&) = delete;
+            ~Scope() { record(name, End); }
+        private:
+            const char* name;
+        };
+
+        // wraps f so that the time from now to the call of f (the queueing delay) is recorded as
+        // an async slice, and the call itself as a slice on the thread running it
+        template<typename Func>
+        static auto traced(const char* name, Func&& f) {
+            std::uint64_t id = 0;
+            if (enabled()) {
+                id = next_id();
+                record(name, AsyncBegin, id);
+            }
+            return [name, id, f=std::forward<Func>(f)](auto&&... args) mutable -> decltype(auto) {
+                if (id)
+                    record(name, AsyncEnd, id);
+                Scope s(name);
+                return f(std::forward<decltype(args)>(args)...);
+            };
+        }
+
+    private:
+        struct Event {
+            std::atomic<std::uint64_t> ts;
+            std::atomic<std::uint64_t> id;
+            std::atomic<const char*> name;
+            std::atomic<Phase> phase;
+        };
+        struct Buffer {
+            explicit Buffer(unsigned tid): tid(tid), events(new Event[buffer_size]) {}
+            /*
+            Seqlock-like: the fence orders the previous publication of head before the overwrite of the slot,
+            so a dump that reads an overwritten slot also sees the head that tells it to drop the event.
+            */
+            void record(const char* name, Phase phase, std::uint64_t id, std::uint64_t ts) {
+                auto h = head.load(std::memory_order_relaxed);
+                std::atomic_thread_fence(std::memory_order_release);
+                auto& e = events[h % buffer_size];
+                e.ts.store(ts, std::memory_order_relaxed);
+                e.id.store(id, std::memory_order_relaxed);
+                e.name.store(name, std::memory_order_relaxed);
+                e.phase.store(phase, std::memory_order_relaxed);
+                head.store(h + 1, std::memory_order_release);
+            }
+            const unsigned tid;
+            std::uint64_t last_id = 0;      // owner thread only
+            std::atomic<std::uint64_t> head{0};
+            std::unique_ptr<Event[]> events;
+        };
+        struct State {
+            State(): base_ticks(now()), base_time(std::chrono::steady_clock::now()) {}
+            std::atomic<bool> enabled{false};
+            std::mutex m;
+            // buffers outlive their threads so that they can be dumped later
+            std::vector<std::unique_ptr<Buffer>> buffers;
+            std::vector<Buffer*> free_buffers;      // of exited threads, to be reused
+            const std::uint64_t base_ticks;
+            const std::chrono::steady_clock::time_point base_time;
+        };
+
+        static State& state() {
+            static State s;
+            return s;
+        }
+        // gives the buffer back when its thread exits
+        struct Owner {
+            Buffer* buffer = nullptr;
+            ~Owner() {
+                if (buffer) {
+                    auto& s = state();
+                    std::lock_guard l(s.m);
+                    s.free_buffers.push_back(std::exchange(buffer, nullptr));
+                }
+            }
+        };
+        static Buffer& local_buffer() {
+            static thread_local Owner owner;
+            if (!owner.buffer) {
+                auto& s = state();
+                std::lock_guard l(s.m);
+                if (!s.free_buffers.empty()) {
+                    owner.buffer = s.free_buffers.back();
+                    s.free_buffers.pop_back();
+                }
+                else {
+                    s.buffers.emplace_back(new Buffer(s.buffers.size()));
+                    owner.buffer = s.buffers.back().get();
+                }
+            }
+            return *owner.buffer;
+        }
+        static std::uint64_t now() {
+#if defined(__x86_64__) || defined(__i386__)
+            return __rdtsc();
+#else
+            return std::chrono::steady_clock::now().time_since_epoch().count();
+#endif
+        }
+    };
+
+    inline void Tracer::dump(std::ostream& os) {
+        auto& s = state();
+        // calibrate ticks against steady_clock over the whole lifetime of the tracer
+        auto t = now();
+        auto ticks = t > s.base_ticks? t - s.base_ticks: 0;
+        auto elapsed = std::chrono::duration<double, std::micro>(
+            std::chrono::steady_clock::now() - s.base_time).count();
+        auto us_per_tick = ticks? elapsed / ticks: 0.;
+
+        std::lock_guard l(s.m);
+        os << "{\"traceEvents\":[\n";
+        bool first = true;
+        auto emit = [&](unsigned tid, const char* name, const char* ph,
+                        std::uint64_t ts, std::uint64_t id, bool has_id) {
+            // the TSCs of different cores may be slightly apart, an event recorded right after
+            // the tracer was set up may seem to precede it
+            os << (first? "": ",\n") << "{\"name\":\"" << name << "\",\"ph\":\"" << ph
+               << "\",\"pid\":0,\"tid\":" << tid << ",\"ts\":"
+               << (ts > s.base_ticks? ts - s.base_ticks: 0) * us_per_tick;
+            if (has_id)
+                os << ",\"cat\":\"queue\",\"id\":" << id;
+            os << "}";
+            first = false;
+        };
+        for (auto& b: s.buffers) {
+            auto h = b->head.load(std::memory_order_acquire);
+            auto start = h > buffer_size? h - buffer_size: 0;
+            struct Copy { std::uint64_t ts, id; const char* name; Phase phase; };
+            std::vector<Copy> copies;
+            copies.reserve(h - start);
+            for (auto i = start; i != h; ++i) {
+                auto& e = b->events[i % buffer_size];
+                copies.push_back({e.ts.load(std::memory_order_relaxed), e.id.load(std::memory_order_relaxed),
+                    e.name.load(std::memory_order_relaxed), e.phase.load(std::memory_order_relaxed)});
+            }
+            std::atomic_thread_fence(std::memory_order_acquire);
+            // the owner may have overwritten the oldest events meanwhile, including the slot it's writing now
+            auto h2 = b->head.load(std::memory_order_relaxed);
+            auto valid = h2 >= buffer_size? h2 - buffer_size + 1: 0;
+            for (auto i = std::max(start, valid); i < h; ++i) {
+                auto& c = copies[i - start];
+                switch (c.phase) {
+                case Begin: emit(b->tid, c.name, "B", c.ts, 0, false); break;
+                case End: emit(b->tid, c.name, "E", c.ts, 0, false); break;
+                case AsyncBegin: emit(b->tid, c.name, "b", c.ts, c.id, true); break;
+                case AsyncEnd: emit(b->tid, c.name, "e", c.ts, c.id, true); break;
+                }
+            }
+        }
+        os << "\n]}\n";
+    }
+}
+
+#ifdef CONCURRENCY_TRACE
+#define CONCURRENCY_TRACE_SCOPE(name) ::utility::Tracer::Scope concurrency_trace_scope_(name)
+#define CONCURRENCY_TRACED(name, f) ::utility::Tracer::traced(name, f)
+#else
+#define CONCURRENCY_TRACE_SCOPE(name) ((void)0)
+#define CONCURRENCY_TRACED(name, f) f
+#endif
+
+#endif